@@ -0,0 +1,156 @@
+/*
+ * Compare the generated keymap tables against the if/else chain usbhid.c
+ * used before them: per character cost, bulk encoding cost and how much of
+ * printable ASCII each one can type.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "keymap.h"
+
+#define ROUNDS 20000
+
+/* The former usbhid.c encoder, kept verbatim for reference. */
+static void string_formating(char a, uint8_t *buf){
+    if (isdigit(a)) {
+        if (a == '0') {
+            buf[2] = 39;
+        } else {
+            int b = a - '0';
+            buf[2] = 29 + b;
+        }
+    } else if (isalpha(a)) {
+        if (isupper(a)) {
+            buf[0] = 2;
+            int b = (int)a;
+            buf[2] = b - 61;
+        } else {
+            int b = (int)a;
+            buf[2] = b - 93;
+        }
+    } else if (a == ' '){
+	buf[2] = 44;
+    } else if (a == '='){
+	buf[2] = 46;
+    } else if (a == ':'){
+	buf[0] = 2;
+	buf[2] = 51;
+    } else if (a == '/'){
+	buf[2] = 56;
+    } else if (a == '.'){
+	buf[2] = 55;
+    } else if (a == '?'){
+	buf[0] = 2;
+	buf[2] = 56;
+    } else if (a == '\n'){
+	buf[2] = 88;
+    } else if (a == '@'){
+	buf[0] = 0x08;
+    } else if (a == '#'){
+	buf[0] = 0x01;
+	buf[2] = 21;
+    } else if (a == '&'){
+	buf[0] = 0x04;
+	buf[2] = 61;
+    } else if (a == '('){
+	buf[0] = 2;
+	buf[2] = 38;
+    } else if (a == ')'){
+	buf[0] = 2;
+	buf[2] = 39;
+    } else if (a == '\''){
+	buf[2] = 52;
+    } else if (a == '!'){
+	buf[0] = 2;
+	buf[2] = 30;
+    }
+}
+
+static const char corpus[] =
+	" \nimport webbrowser\nimport time\nwhile True:\n"
+	"    webbrowser.open('https://www.youtube.com/watch?v=dQw4w9WgXcQ')\n"
+	"    time.sleep(2)\n"
+	"The quick brown fox jumps over the lazy dog 0123456789.\n"
+	"{\"key\": [1, 2, 3], \"path\": \"C:\\\\tmp\\\\x\", 'a' < b > c | d ~ e}\n";
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Keep the optimiser from discarding the work. */
+static volatile uint8_t sink;
+
+int main(void)
+{
+	static uint8_t reports[4 * sizeof(corpus)][HID_REPORT_SIZE];
+	const size_t len = sizeof(corpus) - 1;
+	const char *names[] = { "us", "uk", "de", "cz" };
+	uint8_t buf[HID_REPORT_SIZE];
+	double t, legacy_ns, table_ns, bulk_ns;
+	size_t n = 0;
+	int legacy_cover = 0;
+
+	t = now();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (size_t i = 0; i < len; i++) {
+			memset(buf, 0, sizeof(buf));
+			string_formating(corpus[i], buf);
+			sink ^= buf[2];
+		}
+	}
+	legacy_ns = (now() - t) * 1e9 / ((double)ROUNDS * len);
+
+	t = now();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (size_t i = 0; i < len; i++) {
+			keymap_encode_char(KEYMAP_US, corpus[i], buf);
+			sink ^= buf[2];
+		}
+	}
+	table_ns = (now() - t) * 1e9 / ((double)ROUNDS * len);
+
+	t = now();
+	for (int r = 0; r < ROUNDS; r++) {
+		const char *s = corpus;
+
+		n = keymap_encode(KEYMAP_US, &s, reports, sizeof(reports) /
+				  sizeof(reports[0]));
+		sink ^= reports[n - 2][2];
+	}
+	bulk_ns = (now() - t) * 1e9 / ((double)ROUNDS * len);
+
+	for (int c = 0x20; c < 0x7f; c++) {
+		memset(buf, 0, sizeof(buf));
+		string_formating((char)c, buf);
+		if (buf[2] || c == ' ')
+			legacy_cover++;
+	}
+
+	printf("corpus: %zu characters, %zu reports, %.2f per character"
+	       " (legacy 2.00)\n", len, n, (double)n / len);
+	printf("%-28s %8.2f ns/char\n", "string_formating()", legacy_ns);
+	printf("%-28s %8.2f ns/char\n", "keymap_encode_char()", table_ns);
+	printf("%-28s %8.2f ns/char\n", "keymap_encode() (reports)", bulk_ns);
+	printf("printable ASCII covered: legacy %d/95", legacy_cover);
+	for (int l = 0; l < KEYMAP_NUM_LAYOUTS; l++) {
+		int cover = 0;
+
+		for (int c = 0x20; c < 0x7f; c++) {
+			const struct keymap_entry *e = keymap_lookup(l, (char)c);
+
+			if (e->usage)
+				cover++;
+		}
+		printf(", %s %d/95", names[l], cover);
+	}
+	printf("\n");
+
+	return 0;
+}
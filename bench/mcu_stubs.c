@@ -0,0 +1,108 @@
+/*
+ * The few libopencm3 peripheral calls usbhid.c makes outside the USB stack,
+ * reduced to what the host simulation needs to know about them.
+ */
+
+#include <setjmp.h>
+#include <stdlib.h>
+
+#include <libopencm3/cm3/assert.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+
+#include "mcu_stubs.h"
+
+jmp_buf mcu_boot;
+uint32_t mcu_systick_reload;
+bool mcu_systick_enabled;
+
+uint32_t rcc_ahb_frequency;
+
+const struct rcc_clock_scale rcc_hsi_configs[RCC_CLOCK_HSI_END] = {
+	[RCC_CLOCK_HSI_24MHZ] = { .ahb_frequency = 24000000 },
+	[RCC_CLOCK_HSI_48MHZ] = { .ahb_frequency = 48000000 },
+	[RCC_CLOCK_HSI_64MHZ] = { .ahb_frequency = 64000000 },
+};
+
+void rcc_clock_setup_pll(const struct rcc_clock_scale *clock)
+{
+	rcc_ahb_frequency = clock->ahb_frequency;
+}
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken)
+{
+	(void)clken;
+}
+
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf,
+		   uint16_t gpios)
+{
+	(void)gpioport;
+	(void)mode;
+	(void)cnf;
+	(void)gpios;
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios)
+{
+	(void)gpioport;
+	(void)gpios;
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios)
+{
+	(void)gpioport;
+	(void)gpios;
+}
+
+void nvic_set_priority(uint8_t irqn, uint8_t priority)
+{
+	(void)irqn;
+	(void)priority;
+}
+
+/* Enabling the USB interrupt is the last thing main() does before idling. */
+void nvic_enable_irq(uint8_t irqn)
+{
+	if (irqn == NVIC_USB_LP_CAN_RX0_IRQ)
+		longjmp(mcu_boot, 1);
+}
+
+void systick_set_clocksource(uint8_t clocksource)
+{
+	(void)clocksource;
+}
+
+void systick_set_reload(uint32_t value)
+{
+	mcu_systick_reload = value;
+}
+
+void systick_interrupt_enable(void)
+{
+}
+
+void systick_counter_enable(void)
+{
+	mcu_systick_enabled = true;
+}
+
+uint32_t mcu_systick_period_ms(void)
+{
+	/* Clocked from AHB / 8 */
+	return (uint64_t)(mcu_systick_reload + 1) * 8 * 1000 /
+	       rcc_ahb_frequency;
+}
+
+void scb_reset_core(void)
+{
+	abort();
+}
+
+/* A bad configuration descriptor blob, see usbd_register_config_descriptors */
+void cm3_assert_failed(void)
+{
+	abort();
+}
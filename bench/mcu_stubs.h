@@ -0,0 +1,23 @@
+#ifndef MCU_STUBS_H
+#define MCU_STUBS_H
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Booting the firmware: main() is built as usbhid_main() and returns here,
+ * through longjmp(), once it has enabled the USB interrupt and would go to
+ * sleep.  From then on the harness calls the interrupt handlers itself.
+ */
+extern jmp_buf mcu_boot;
+int usbhid_main(void);
+
+/* SysTick as last programmed by the firmware. */
+extern uint32_t mcu_systick_reload;
+extern bool mcu_systick_enabled;
+uint32_t mcu_systick_period_ms(void);
+
+void scb_reset_core(void) __attribute__((noreturn));
+
+#endif
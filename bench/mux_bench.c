@@ -0,0 +1,205 @@
+/*
+ * Aggregate events per second through the one interrupt endpoint when the
+ * keyboard, media keys and mouse share it.  The host collects one report
+ * per frame, as with HID_INTERVAL_MS 1, while producers run on the 1 ms
+ * tick.  The round robin hid_mux is compared with a single FIFO holding
+ * every report type.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hid_mux.h"
+#include "keymap.h"
+
+#define SECONDS	10
+#define FRAMES	(SECONDS * 1000)
+
+static const char corpus[] =
+	"import webbrowser\nimport time\nwhile True:\n"
+	"    webbrowser.open('https://www.youtube.com/watch?v=dQw4w9WgXcQ')\n"
+	"    time.sleep(2)\n"
+	"The quick brown fox jumps over the lazy dog 0123456789.\n";
+
+/* How often each producer wants to send, in frames. */
+struct load {
+	const char *name;
+	int type_every;		/* Keyboard report */
+	int mouse_every;	/* Mouse motion report */
+	int media_every;	/* Media key tap, press and release */
+};
+
+static const struct load loads[] = {
+	{ "firmware rates", 8, 4, 100 },
+	{ "keyboard flood", 1, 2, 20 },
+	{ "everything flood", 1, 1, 2 },
+};
+
+/* Per queued report: frame it was produced in and what it completes. */
+struct meta {
+	enum hid_source source;
+	int frame;
+	int chars;	/* Keyboard characters typed once it is delivered */
+	int event;	/* Counts as an event once delivered */
+};
+
+struct stats {
+	long events[HID_NUM_SOURCES];
+	int worst[HID_NUM_SOURCES];	/* Frames from produced to delivered */
+	long wait[HID_NUM_SOURCES];
+	long reports[HID_NUM_SOURCES];
+	long dropped;	/* Mouse and media reports refused, queue full */
+};
+
+static struct hid_mux mux;
+static struct meta meta[HID_NUM_SOURCES][HID_QUEUE_LEN];
+static bool fifo;
+
+static struct hid_queue *queue_of(enum hid_source source)
+{
+	return &mux.queue[fifo ? HID_SOURCE_KEYBOARD : source];
+}
+
+static bool push(enum hid_source source, const uint8_t *report,
+		 uint16_t len, int frame, int chars, int event)
+{
+	struct hid_queue *q = queue_of(source);
+	struct meta *m = &meta[q - mux.queue][q->head & (HID_QUEUE_LEN - 1)];
+
+	if (!hid_queue_push(q, report, len))
+		return false;
+
+	m->source = source;
+	m->frame = frame;
+	m->chars = chars;
+	m->event = event;
+	return true;
+}
+
+/* The host collects one report, returns its metadata or NULL. */
+static const struct meta *poll(void)
+{
+	const struct meta *m;
+	struct hid_queue *q;
+	uint16_t len;
+
+	if (fifo) {
+		q = &mux.queue[HID_SOURCE_KEYBOARD];
+		if (!hid_queue_peek(q, &len))
+			return NULL;
+		m = &meta[HID_SOURCE_KEYBOARD][q->tail & (HID_QUEUE_LEN - 1)];
+		hid_queue_pop(q);
+		return m;
+	}
+
+	if (!hid_mux_peek(&mux, &len))
+		return NULL;
+	q = &mux.queue[mux.peeked];
+	m = &meta[mux.peeked][q->tail & (HID_QUEUE_LEN - 1)];
+	hid_mux_pop(&mux);
+	return m;
+}
+
+static void run(const struct load *l, struct stats *st)
+{
+	struct keymap_typer typer;
+	uint8_t report[HID_REPORT_MAX];
+	uint16_t len = 0;
+	int typed = 0;
+
+	memset(st, 0, sizeof(*st));
+	hid_mux_init(&mux);
+	keymap_typer_start(&typer, KEYMAP_US, corpus);
+
+	for (int frame = 0; frame < FRAMES; frame++) {
+		const struct meta *m;
+
+		if (!(frame % l->type_every)) {
+			/* Retry a refused report before making a new one. */
+			if (!len) {
+				len = keymap_typer_next(&typer, report,
+							KEYMAP_BOOT);
+				if (!len) {
+					keymap_typer_start(&typer, KEYMAP_US,
+							   corpus);
+					typed = 0;
+					len = keymap_typer_next(&typer, report,
+								KEYMAP_BOOT);
+				}
+			}
+			/* Characters consumed once this report is out. */
+			if (push(HID_SOURCE_KEYBOARD, report, len, frame,
+				 typer.s - corpus - typed, 0)) {
+				typed = typer.s - corpus;
+				len = 0;
+			}
+		}
+
+		if (!(frame % l->mouse_every)) {
+			const uint8_t motion[] = { 0, 1, 1, 0 };
+
+			if (!push(HID_SOURCE_MOUSE, motion, sizeof(motion),
+				  frame, 0, 1))
+				st->dropped++;
+		}
+
+		if (!(frame % l->media_every)) {
+			const uint8_t press[] = { 0xe9, 0 }, up[] = { 0, 0 };
+
+			if (HID_QUEUE_LEN - hid_queue_depth(
+				    queue_of(HID_SOURCE_CONSUMER)) >= 2) {
+				push(HID_SOURCE_CONSUMER, press, sizeof(press),
+				     frame, 0, 1);
+				push(HID_SOURCE_CONSUMER, up, sizeof(up),
+				     frame, 0, 0);
+			} else {
+				st->dropped += 2;
+			}
+		}
+
+		m = poll();
+		if (m) {
+			int wait = frame - m->frame;
+
+			st->reports[m->source]++;
+			st->events[m->source] += m->source ==
+				HID_SOURCE_KEYBOARD ? m->chars : m->event;
+			st->wait[m->source] += wait;
+			if (wait > st->worst[m->source])
+				st->worst[m->source] = wait;
+		}
+	}
+}
+
+int main(void)
+{
+	const char *names[] = { "keys", "media", "mouse" };
+
+	printf("%d s at one report per frame; events/s, mean and worst"
+	       " frames from produced to delivered, reports dropped\n",
+	       SECONDS);
+
+	for (size_t i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+		for (int f = 1; f >= 0; f--) {
+			struct stats st;
+			long total = 0;
+
+			fifo = f;
+			run(&loads[i], &st);
+
+			printf("%-16s %-11s", loads[i].name,
+			       fifo ? "fifo" : "round robin");
+			for (int s = 0; s < HID_NUM_SOURCES; s++) {
+				total += st.events[s];
+				printf("  %s %5ld/s %5.1f %3d", names[s],
+				       st.events[s] / SECONDS,
+				       st.reports[s] ? (double)st.wait[s] /
+				       st.reports[s] : 0.0, st.worst[s]);
+			}
+			printf("  total %5ld/s  dropped %ld\n",
+			       total / SECONDS, st.dropped);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Checks st_usbfs_copy_to_pm() and st_usbfs_copy_from_pm() of both
+ * st_usbfs variants against a plain byte copy, for every buffer alignment
+ * and every length up to two full packets and a bit.  Packet memory is an
+ * array here: on v1 each halfword sits in the low half of a 32 bit word,
+ * on v2 the halfwords are packed.  The two driver files are built with
+ * their copy routines renamed, see the Makefile.
+ *
+ *	pm_copy_check
+ *
+ * Prints each failed check and exits non zero if there was one.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_LEN		130
+#define SLACK		8
+
+#define CHECK(cond, v, dir, align, len) \
+	check((cond), #cond, v, dir, align, len)
+
+void st_usbfs_v1_copy_to_pm(volatile void *vPM, const void *buf,
+			    uint16_t len);
+void st_usbfs_v1_copy_from_pm(void *buf, const volatile void *vPM,
+			      uint16_t len);
+void st_usbfs_v2_copy_to_pm(volatile void *vPM, const void *buf,
+			    uint16_t len);
+void st_usbfs_v2_copy_from_pm(void *buf, const volatile void *vPM,
+			      uint16_t len);
+
+static unsigned failed, checks;
+
+/* Source and destination buffers, word aligned so an offset sets the
+ * alignment. */
+static union {
+	uint32_t align;
+	uint8_t b[MAX_LEN + 2 * SLACK];
+} ram;
+
+static uint32_t pm1[MAX_LEN / 2 + SLACK];
+static uint16_t pm2[MAX_LEN / 2 + SLACK];
+
+static void check(bool ok, const char *what, int v, const char *dir,
+		  unsigned align, unsigned len)
+{
+	checks++;
+	if (!ok) {
+		failed++;
+		fprintf(stderr, "pm_copy_check: v%d %s align %u len %u: %s\n",
+			v, dir, align, len, what);
+	}
+}
+
+static uint8_t pattern(unsigned i)
+{
+	return (uint8_t)(i * 37 + 11);
+}
+
+/* Halfword i of packet memory as a plain copy of the buffer leaves it. */
+static uint16_t pm_halfword(const uint8_t *buf, unsigned len, unsigned i)
+{
+	uint16_t h = buf[2 * i];
+
+	if (2 * i + 1 < len)
+		h |= (uint16_t)buf[2 * i + 1] << 8;
+	return h;
+}
+
+static void check_to_pm(unsigned align, unsigned len)
+{
+	const uint8_t *buf = ram.b + align;
+	unsigned i, n = (len + 1) / 2;
+	bool ok1 = true, ok2 = true, kept1 = true, kept2 = true;
+
+	for (i = 0; i < sizeof(ram.b); i++)
+		ram.b[i] = pattern(i);
+	memset(pm1, 0xa5, sizeof(pm1));
+	memset(pm2, 0xa5, sizeof(pm2));
+
+	st_usbfs_v1_copy_to_pm(pm1, buf, len);
+	st_usbfs_v2_copy_to_pm(pm2, buf, len);
+
+	for (i = 0; i < n; i++) {
+		/* Only the low halfword of a v1 word is packet memory. */
+		ok1 &= (uint16_t)pm1[i] == pm_halfword(buf, len, i);
+		ok2 &= pm2[i] == pm_halfword(buf, len, i);
+	}
+	for (; i < MAX_LEN / 2 + SLACK; i++) {
+		kept1 &= pm1[i] == 0xa5a5a5a5;
+		kept2 &= pm2[i] == 0xa5a5;
+	}
+	CHECK(ok1, 1, "to_pm", align, len);
+	CHECK(kept1, 1, "to_pm", align, len);
+	CHECK(ok2, 2, "to_pm", align, len);
+	CHECK(kept2, 2, "to_pm", align, len);
+}
+
+static bool check_buffer(unsigned align, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(ram.b); i++) {
+		if (i >= align && i < align + len) {
+			if (ram.b[i] != pattern(i - align))
+				return false;
+		} else if (ram.b[i] != 0x5a) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void check_from_pm(unsigned align, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < MAX_LEN / 2 + SLACK; i++) {
+		uint16_t h = pattern(2 * i) | (uint16_t)pattern(2 * i + 1) << 8;
+
+		/* The high half of a v1 word must be ignored. */
+		pm1[i] = 0xdead0000 | h;
+		pm2[i] = h;
+	}
+
+	memset(ram.b, 0x5a, sizeof(ram.b));
+	st_usbfs_v1_copy_from_pm(ram.b + align, pm1, len);
+	CHECK(check_buffer(align, len), 1, "from_pm", align, len);
+
+	memset(ram.b, 0x5a, sizeof(ram.b));
+	st_usbfs_v2_copy_from_pm(ram.b + align, pm2, len);
+	CHECK(check_buffer(align, len), 2, "from_pm", align, len);
+}
+
+int main(void)
+{
+	unsigned align, len;
+
+	for (align = 0; align < 4; align++) {
+		for (len = 0; len <= MAX_LEN; len++) {
+			check_to_pm(align, len);
+			check_from_pm(align, len);
+		}
+	}
+
+	printf("pm_copy_check: %u checks, %u failed\n", checks, failed);
+	return failed != 0;
+}
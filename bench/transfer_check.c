@@ -0,0 +1,375 @@
+/*
+ * Checks usbd_ep_transfer_in/out() and the usbd_ep_queue_in/out() request
+ * queues of the libopencm3 USB core against the mock driver: how packets
+ * are cut, when zero length packets go out, and when the completion
+ * callbacks run.  The mock host collects IN packets and
+ * sends OUT packets one at a time, so every step can be looked at.
+ *
+ *	transfer_check
+ *
+ * Prints each failed check and exits non zero if there was one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libopencm3/usb/usbd.h>
+
+#include "usbd_mock.h"
+
+#define IN_EP		0x81
+#define OUT_EP		0x01
+#define EP_SIZE		64
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static usbd_device *dev;
+static uint8_t control_buffer[64];
+static unsigned failed, checks;
+
+static const struct usb_device_descriptor dev_descr = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_endpoint_descriptor endpoints[] = {
+	{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = IN_EP,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = EP_SIZE,
+	}, {
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = OUT_EP,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = EP_SIZE,
+	},
+};
+
+static const struct usb_interface_descriptor iface = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = USB_CLASS_VENDOR,
+	.endpoint = endpoints,
+};
+
+static const struct usb_interface ifaces[] = {
+	{ .num_altsetting = 1, .altsetting = &iface },
+};
+
+static const struct usb_config_descriptor config = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.interface = ifaces,
+};
+
+/* Completions seen, the last one's endpoint and length. */
+static struct {
+	unsigned calls;
+	uint8_t ep;
+	uint16_t len;
+} done;
+
+/* Queued requests completed, in order. */
+static struct {
+	unsigned calls;
+	uint16_t len[32];
+	unsigned refill;	/* Requests left to queue from the callback */
+} queued;
+
+static void check(bool ok, const char *what, int line)
+{
+	checks++;
+	if (!ok) {
+		failed++;
+		fprintf(stderr, "transfer_check.c:%d: %s\n", line, what);
+	}
+}
+
+static void isr(void)
+{
+	usbd_poll(dev);
+}
+
+static void complete(usbd_device *d, uint8_t ep, uint16_t len)
+{
+	(void)d;
+
+	done.calls++;
+	done.ep = ep;
+	done.len = len;
+}
+
+static void queue_complete(usbd_device *d, uint8_t ep, uint16_t len)
+{
+	static const uint8_t data[64];
+
+	if (queued.calls < 32)
+		queued.len[queued.calls] = len;
+	queued.calls++;
+
+	if (queued.refill) {
+		queued.refill--;
+		usbd_ep_queue_in(d, ep, data, 64, false, queue_complete);
+	}
+}
+
+static void set_config(usbd_device *d, uint16_t value)
+{
+	(void)value;
+
+	usbd_ep_setup(d, IN_EP, USB_ENDPOINT_ATTR_BULK, EP_SIZE, NULL);
+	usbd_ep_setup(d, OUT_EP, USB_ENDPOINT_ATTR_BULK, EP_SIZE, NULL);
+}
+
+static void configure(void)
+{
+	mock_control(0x00, USB_REQ_SET_CONFIGURATION, 1, 0, 0, NULL);
+	memset(&done, 0, sizeof(done));
+	memset(&queued, 0, sizeof(queued));
+}
+
+/*
+ * Collect IN packets until the endpoint NAKs.  Returns the bytes got into
+ * buf, with the length of each packet in sizes.
+ */
+static int collect(uint8_t *buf, int *sizes, int *packets)
+{
+	int len, total = 0;
+
+	*packets = 0;
+	while ((len = mock_in_token(IN_EP, buf + total)) >= 0) {
+		sizes[(*packets)++] = len;
+		total += len;
+	}
+
+	return total;
+}
+
+static void check_in(void)
+{
+	static uint8_t data[256], got[512];
+	int sizes[16], packets;
+
+	for (unsigned i = 0; i < sizeof(data); i++)
+		data[i] = i;
+
+	/* Short last packet, no ZLP needed even if asked for. */
+	configure();
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 100, true, complete));
+	CHECK(collect(got, sizes, &packets) == 100);
+	CHECK(packets == 2 && sizes[0] == 64 && sizes[1] == 36);
+	CHECK(!memcmp(got, data, 100));
+	CHECK(done.calls == 1 && done.ep == IN_EP && done.len == 100);
+
+	/* Exact multiple, without and with ZLP. */
+	configure();
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 128, false, complete));
+	CHECK(collect(got, sizes, &packets) == 128 && packets == 2);
+	CHECK(done.calls == 1 && done.len == 128);
+
+	configure();
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 128, true, complete));
+	CHECK(collect(got, sizes, &packets) == 128);
+	CHECK(packets == 3 && sizes[2] == 0);
+	CHECK(done.calls == 1 && done.len == 128);
+
+	/* Nothing to send is one ZLP. */
+	configure();
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 0, false, complete));
+	CHECK(collect(got, sizes, &packets) == 0 && packets == 1);
+	CHECK(done.calls == 1 && done.len == 0);
+
+	/* One transfer at a time. */
+	configure();
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 10, false, complete));
+	CHECK(!usbd_ep_transfer_in(dev, IN_EP, data, 10, false, complete));
+	collect(got, sizes, &packets);
+	CHECK(done.calls == 1);
+
+	/* Started while a packet is still queued, it goes first. */
+	configure();
+	CHECK(usbd_ep_write_packet(dev, IN_EP, "x", 1) == 1);
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 64, true, complete));
+	CHECK(collect(got, sizes, &packets) == 65);
+	CHECK(packets == 3 && sizes[0] == 1 && sizes[1] == 64 &&
+	      sizes[2] == 0);
+	CHECK(!memcmp(got + 1, data, 64));
+	CHECK(done.calls == 1 && done.len == 64);
+
+	/* The same with nothing to send: the ZLP must still follow. */
+	configure();
+	CHECK(usbd_ep_write_packet(dev, IN_EP, "x", 1) == 1);
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 0, false, complete));
+	CHECK(done.calls == 0);
+	CHECK(collect(got, sizes, &packets) == 1);
+	CHECK(packets == 2 && sizes[0] == 1 && sizes[1] == 0);
+	CHECK(done.calls == 1 && done.len == 0);
+
+	/* A new configuration drops the transfer, without completing it. */
+	configure();
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 200, false, complete));
+	CHECK(mock_in_token(IN_EP, got) == 64);
+	configure();
+	CHECK(!mock_in_pending(IN_EP));
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 10, false, complete));
+	CHECK(collect(got, sizes, &packets) == 10);
+	CHECK(done.calls == 1 && done.len == 10);
+}
+
+static void check_out(void)
+{
+	static uint8_t data[256], buf[256];
+
+	for (unsigned i = 0; i < sizeof(data); i++)
+		data[i] = 255 - i;
+
+	/* Ends on a short packet. */
+	configure();
+	memset(buf, 0, sizeof(buf));
+	CHECK(usbd_ep_transfer_out(dev, OUT_EP, buf, 256, complete));
+	CHECK(mock_out_token(OUT_EP, data, 64) == 64);
+	CHECK(mock_out_token(OUT_EP, data + 64, 64) == 64);
+	CHECK(done.calls == 0);
+	CHECK(mock_out_token(OUT_EP, data + 128, 22) == 22);
+	CHECK(done.calls == 1 && done.ep == OUT_EP && done.len == 150);
+	CHECK(!memcmp(buf, data, 150));
+
+	/* Ends on a full buffer, without waiting for a short packet. */
+	configure();
+	CHECK(usbd_ep_transfer_out(dev, OUT_EP, buf, 128, complete));
+	mock_out_token(OUT_EP, data, 64);
+	mock_out_token(OUT_EP, data + 64, 64);
+	CHECK(done.calls == 1 && done.len == 128);
+
+	/* Ends on a ZLP. */
+	configure();
+	CHECK(usbd_ep_transfer_out(dev, OUT_EP, buf, 256, complete));
+	mock_out_token(OUT_EP, data, 64);
+	mock_out_token(OUT_EP, data, 0);
+	CHECK(done.calls == 1 && done.len == 64);
+
+	/* Dropped by a new configuration. */
+	configure();
+	CHECK(usbd_ep_transfer_out(dev, OUT_EP, buf, 256, complete));
+	mock_out_token(OUT_EP, data, 64);
+	configure();
+	CHECK(usbd_ep_transfer_out(dev, OUT_EP, buf, 64, complete));
+	mock_out_token(OUT_EP, data, 64);
+	CHECK(done.calls == 1 && done.len == 64);
+}
+
+static void check_queue(void)
+{
+	static uint8_t data[256], got[512], buf[2][128];
+	int sizes[16], packets, n;
+
+	/* In order, each with its own ZLP. */
+	configure();
+	CHECK(usbd_ep_queue_in(dev, IN_EP, data, 100, true, queue_complete));
+	CHECK(usbd_ep_queue_in(dev, IN_EP, data, 64, true, queue_complete));
+	CHECK(usbd_ep_queue_in(dev, IN_EP, data, 0, false, queue_complete));
+	CHECK(collect(got, sizes, &packets) == 164);
+	CHECK(packets == 5 && sizes[0] == 64 && sizes[1] == 36 &&
+	      sizes[2] == 64 && sizes[3] == 0 && sizes[4] == 0);
+	CHECK(queued.calls == 3 && queued.len[0] == 100 &&
+	      queued.len[1] == 64 && queued.len[2] == 0);
+
+	/* The pool is shared, and empties. */
+	configure();
+	for (n = 0; n < 16; n++) {
+		if (!usbd_ep_queue_in(dev, IN_EP, data, 10, false,
+				      queue_complete))
+			break;
+	}
+	CHECK(n == 8);
+	CHECK(!usbd_ep_queue_out(dev, OUT_EP, buf[0], 64, queue_complete));
+	CHECK(collect(got, sizes, &packets) == 80 && queued.calls == 8);
+	CHECK(usbd_ep_queue_out(dev, OUT_EP, buf[0], 64, queue_complete));
+
+	/* A depth limit caps one endpoint, not the others. */
+	configure();
+	usbd_ep_set_queue_depth(dev, IN_EP, 2);
+	CHECK(usbd_ep_queue_in(dev, IN_EP, data, 10, false, queue_complete));
+	CHECK(usbd_ep_queue_in(dev, IN_EP, data, 10, false, queue_complete));
+	CHECK(!usbd_ep_queue_in(dev, IN_EP, data, 10, false, queue_complete));
+	CHECK(usbd_ep_queue_out(dev, OUT_EP, buf[0], 64, queue_complete));
+	collect(got, sizes, &packets);
+	usbd_ep_set_queue_depth(dev, IN_EP, 0);
+
+	/* Refilled from the completion, the endpoint never runs dry. */
+	configure();
+	queued.refill = 4;
+	CHECK(usbd_ep_queue_in(dev, IN_EP, data, 64, false, queue_complete));
+	CHECK(collect(got, sizes, &packets) == 5 * 64 && packets == 5);
+	CHECK(queued.calls == 5 && !queued.refill);
+
+	/* OUT requests end on a short packet or a full buffer. */
+	configure();
+	CHECK(usbd_ep_queue_out(dev, OUT_EP, buf[0], 128, queue_complete));
+	CHECK(usbd_ep_queue_out(dev, OUT_EP, buf[1], 128, queue_complete));
+	mock_out_token(OUT_EP, data, 64);
+	mock_out_token(OUT_EP, data + 64, 10);
+	CHECK(queued.calls == 1 && queued.len[0] == 74);
+	mock_out_token(OUT_EP, data + 1, 64);
+	mock_out_token(OUT_EP, data + 65, 64);
+	CHECK(queued.calls == 2 && queued.len[1] == 128);
+	CHECK(!memcmp(buf[0], data, 74) && !memcmp(buf[1], data + 1, 128));
+
+	/* A new configuration hands everything back, completing nothing. */
+	configure();
+	for (n = 0; n < 8; n++)
+		usbd_ep_queue_in(dev, IN_EP, data, 10, false, queue_complete);
+	configure();
+	for (n = 0; n < 8; n++) {
+		if (!usbd_ep_queue_out(dev, OUT_EP, buf[0], 64,
+				       queue_complete))
+			break;
+	}
+	CHECK(n == 8 && queued.calls == 0);
+
+	/* After a bus reset there is no endpoint to start a transfer on
+	 * until the next configuration, nor ever on one not set up. */
+	mock_bus_reset();
+	CHECK(!usbd_ep_transfer_in(dev, IN_EP, data, 10, false, complete));
+	CHECK(!usbd_ep_queue_out(dev, OUT_EP, buf[0], 64, queue_complete));
+	configure();
+	CHECK(!usbd_ep_transfer_in(dev, 0x82, data, 10, false, complete));
+	CHECK(!usbd_ep_transfer_out(dev, 0x02, buf[0], 64, complete));
+	CHECK(usbd_ep_transfer_in(dev, IN_EP, data, 10, false, complete));
+	CHECK(collect(got, sizes, &packets) == 10 && done.calls == 1);
+	configure();
+}
+
+/* usb_standard.c asserts on bad descriptor blobs, none are used here. */
+void cm3_assert_failed(void);
+void cm3_assert_failed(void)
+{
+	abort();
+}
+
+int main(void)
+{
+	mock_init(isr);
+	dev = usbd_init(&st_usbfs_v1_usb_driver, &dev_descr, &config, NULL, 0,
+			control_buffer, sizeof(control_buffer));
+	usbd_register_set_config_callback(dev, set_config);
+	mock_bus_reset();
+
+	check_in();
+	check_out();
+	check_queue();
+
+	printf("transfer_check: %u checks, %u failed\n", checks, failed);
+	return failed != 0;
+}
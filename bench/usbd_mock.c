@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/bos.h>
+#include "usb_private.h"
+
+#include "usbd_mock.h"
+
+uint32_t mock_frame;
+struct mock_write *mock_log;
+uint32_t mock_log_len;
+uint32_t mock_write_busy;
+
+static usbd_device *mock_dev;
+static void (*mock_isr)(void);
+static uint32_t mock_log_size;
+
+static struct {
+	bool busy;
+	bool stall;
+	uint8_t len;
+	uint8_t data[64];
+	uint32_t log;		/* Index of the packet in mock_log */
+} ep_in[ENDPOINT_COUNT];
+
+static struct {
+	bool stall;
+	bool nak;		/* Forced by the firmware */
+	bool full;		/* Packet not read yet, NAK the next one */
+	uint8_t len;
+	uint8_t data[64];
+} ep_out[ENDPOINT_COUNT];
+
+/* Interrupt sources waiting for the next poll, like USB_ISTR. */
+static struct {
+	bool reset;
+	bool setup;
+	int out;		/* Endpoint with an OUT packet, or -1 */
+	int in;			/* Endpoint whose IN packet went, or -1 */
+} pending = { .out = -1, .in = -1 };
+
+static uint8_t setup_packet[8];
+
+static usbd_device *mock_usbd_init(usbd_device *dev)
+{
+	mock_dev = dev;
+	memset(ep_in, 0, sizeof(ep_in));
+	memset(ep_out, 0, sizeof(ep_out));
+	return dev;
+}
+
+static void mock_set_address(usbd_device *dev, uint8_t addr)
+{
+	dev->current_address = addr;
+}
+
+static void mock_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
+			  uint16_t max_size, usbd_endpoint_callback callback)
+{
+	uint8_t dir = addr & 0x80;
+
+	(void)type;
+	(void)max_size;
+	addr &= 0x7f;
+
+	if (dir || (addr == 0)) {
+		if (callback)
+			dev->user_callback_ctr[addr][USB_TRANSACTION_IN] =
+				callback;
+		ep_in[addr].busy = false;
+		ep_in[addr].stall = false;
+	}
+	if (!dir) {
+		if (callback)
+			dev->user_callback_ctr[addr][USB_TRANSACTION_OUT] =
+				callback;
+		ep_out[addr].stall = false;
+		ep_out[addr].nak = false;
+		ep_out[addr].full = false;
+	}
+}
+
+static void mock_ep_reset(usbd_device *dev)
+{
+	(void)dev;
+
+	for (unsigned i = 1; i < ENDPOINT_COUNT; i++) {
+		ep_in[i].busy = false;
+		ep_in[i].stall = false;
+		ep_out[i].stall = false;
+		ep_out[i].nak = false;
+		ep_out[i].full = false;
+	}
+}
+
+static void mock_ep_stall_set(usbd_device *dev, uint8_t addr, uint8_t stall)
+{
+	(void)dev;
+
+	if (addr == 0)
+		ep_in[0].stall = stall;
+	if (addr & 0x80)
+		ep_in[addr & 0x7f].stall = stall;
+	else
+		ep_out[addr].stall = stall;
+}
+
+static uint8_t mock_ep_stall_get(usbd_device *dev, uint8_t addr)
+{
+	(void)dev;
+
+	if (addr & 0x80)
+		return ep_in[addr & 0x7f].stall;
+	return ep_out[addr].stall;
+}
+
+static void mock_ep_nak_set(usbd_device *dev, uint8_t addr, uint8_t nak)
+{
+	(void)dev;
+
+	/* Like st_usbfs, only OUT endpoints can be forced to NAK. */
+	if (!(addr & 0x80))
+		ep_out[addr].nak = nak;
+}
+
+static uint16_t mock_ep_write_packet(usbd_device *dev, uint8_t addr,
+				     const void *buf, uint16_t len)
+{
+	struct mock_write *w;
+
+	(void)dev;
+	addr &= 0x7f;
+
+	if (ep_in[addr].busy) {
+		mock_write_busy++;
+		return 0;
+	}
+
+	if (mock_log_len == mock_log_size) {
+		mock_log_size = mock_log_size ? 2 * mock_log_size : 1024;
+		mock_log = realloc(mock_log, mock_log_size * sizeof(*mock_log));
+		if (!mock_log)
+			abort();
+	}
+
+	w = &mock_log[mock_log_len];
+	w->written = mock_frame;
+	w->collected = 0;
+	w->ep = addr | 0x80;
+	w->len = len;
+	if (len)
+		memcpy(w->data, buf, len);
+
+	ep_in[addr].busy = true;
+	ep_in[addr].len = len;
+	if (len)
+		memcpy(ep_in[addr].data, buf, len);
+	ep_in[addr].log = mock_log_len++;
+
+	return len;
+}
+
+static bool mock_ep_in_busy(usbd_device *dev, uint8_t addr)
+{
+	(void)dev;
+
+	return ep_in[addr & 0x7f].busy;
+}
+
+static uint16_t mock_ep_read_packet(usbd_device *dev, uint8_t addr,
+				    void *buf, uint16_t len)
+{
+	(void)dev;
+
+	if (len > ep_out[addr].len)
+		len = ep_out[addr].len;
+	if (buf && len)
+		memcpy(buf, ep_out[addr].data, len);
+	ep_out[addr].full = false;
+
+	return len;
+}
+
+/* One event per call, like st_usbfs_poll(). */
+static void mock_poll(usbd_device *dev)
+{
+	usbd_endpoint_callback cb;
+	int ep;
+
+	if (pending.reset) {
+		pending.reset = false;
+		_usbd_reset(dev);
+		return;
+	}
+
+	if (pending.setup) {
+		pending.setup = false;
+		memcpy(&dev->control_state.req, setup_packet, 8);
+		cb = dev->user_callback_ctr[0][USB_TRANSACTION_SETUP];
+		if (cb)
+			cb(dev, 0);
+		return;
+	}
+
+	if (pending.out >= 0) {
+		ep = pending.out;
+		pending.out = -1;
+		cb = dev->user_callback_ctr[ep][USB_TRANSACTION_OUT];
+		if (cb)
+			cb(dev, ep);
+		return;
+	}
+
+	if (pending.in >= 0) {
+		ep = pending.in;
+		pending.in = -1;
+		cb = dev->user_callback_ctr[ep][USB_TRANSACTION_IN];
+		if (cb)
+			cb(dev, ep);
+	}
+}
+
+const struct _usbd_driver st_usbfs_v1_usb_driver = {
+	.init = mock_usbd_init,
+	.set_address = mock_set_address,
+	.ep_setup = mock_ep_setup,
+	.ep_reset = mock_ep_reset,
+	.ep_stall_set = mock_ep_stall_set,
+	.ep_stall_get = mock_ep_stall_get,
+	.ep_nak_set = mock_ep_nak_set,
+	.ep_write_packet = mock_ep_write_packet,
+	.ep_read_packet = mock_ep_read_packet,
+	.ep_in_busy = mock_ep_in_busy,
+	.poll = mock_poll,
+	.set_address_before_status = false,
+};
+
+void mock_init(void (*isr)(void))
+{
+	mock_isr = isr;
+	mock_frame = 0;
+	mock_log_clear();
+}
+
+void mock_log_clear(void)
+{
+	mock_log_len = 0;
+	mock_write_busy = 0;
+}
+
+void mock_bus_reset(void)
+{
+	pending.reset = true;
+	mock_isr();
+}
+
+bool mock_in_pending(uint8_t ep)
+{
+	return ep_in[ep & 0x7f].busy;
+}
+
+int mock_in_token(uint8_t ep, uint8_t *buf)
+{
+	uint8_t len;
+
+	ep &= 0x7f;
+	if (!ep_in[ep].busy || ep_in[ep].stall)
+		return -1;
+
+	len = ep_in[ep].len;
+	if (buf)
+		memcpy(buf, ep_in[ep].data, len);
+	if (ep_in[ep].log < mock_log_len)
+		mock_log[ep_in[ep].log].collected = mock_frame;
+	ep_in[ep].busy = false;
+
+	pending.in = ep;
+	mock_isr();
+
+	return len;
+}
+
+int mock_out_token(uint8_t ep, const void *data, uint16_t len)
+{
+	if (ep_out[ep].stall || ep_out[ep].nak || ep_out[ep].full)
+		return -1;
+
+	memcpy(ep_out[ep].data, data, len);
+	ep_out[ep].len = len;
+	ep_out[ep].full = true;
+
+	pending.out = ep;
+	mock_isr();
+
+	return len;
+}
+
+int mock_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		 uint16_t wIndex, uint16_t wLength, void *data)
+{
+	const struct usb_setup_data req = {
+		.bmRequestType = bmRequestType,
+		.bRequest = bRequest,
+		.wValue = wValue,
+		.wIndex = wIndex,
+		.wLength = wLength,
+	};
+	uint8_t packet[64];
+	uint16_t done = 0;
+	int len;
+
+	/* A SETUP always gets through, it clears a previous stall. */
+	ep_in[0].stall = false;
+	ep_out[0].stall = false;
+	memcpy(setup_packet, &req, sizeof(setup_packet));
+	pending.setup = true;
+	mock_isr();
+
+	if (bmRequestType & USB_REQ_TYPE_IN) {
+		while ((len = mock_in_token(0, packet)) >= 0) {
+			if (len > wLength - done)
+				len = wLength - done;
+			memcpy((uint8_t *)data + done, packet, len);
+			done += len;
+		}
+		if (ep_in[0].stall)
+			return -1;
+
+		/* Status stage, a zero length OUT. */
+		ep_out[0].len = 0;
+		pending.out = 0;
+		mock_isr();
+		return done;
+	}
+
+	while (done < wLength) {
+		uint16_t chunk = wLength - done;
+
+		if (chunk > mock_dev->desc->bMaxPacketSize0)
+			chunk = mock_dev->desc->bMaxPacketSize0;
+		if (ep_out[0].stall)
+			return -1;
+		memcpy(ep_out[0].data, (const uint8_t *)data + done, chunk);
+		ep_out[0].len = chunk;
+		done += chunk;
+		pending.out = 0;
+		mock_isr();
+	}
+
+	/* Status stage, a zero length IN. */
+	if (mock_in_token(0, NULL) != 0)
+		return -1;
+
+	return done;
+}
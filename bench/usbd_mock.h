@@ -0,0 +1,68 @@
+#ifndef USBD_MOCK_H
+#define USBD_MOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libopencm3/usb/usbd.h>
+
+/*
+ * A usbd_driver standing in for st_usbfs on the host, with just enough of a
+ * USB host around it to enumerate the device and poll its endpoints.  It is
+ * linked in under the name st_usbfs_v1_usb_driver, so firmware code runs
+ * unchanged on top of it.
+ *
+ * Nothing happens behind the firmware's back: every transfer completion is
+ * delivered by calling the interrupt handler given to mock_init(), which is
+ * expected to end up in usbd_poll() like the real one does.
+ */
+
+/* Current frame of the simulated bus, advanced by the harness. */
+extern uint32_t mock_frame;
+
+/* One accepted ep_write_packet(), in the order they happened. */
+struct mock_write {
+	uint32_t written;	/* Frame the firmware armed the endpoint in */
+	uint32_t collected;	/* Frame the host took it in, 0 until then */
+	uint8_t ep;
+	uint8_t len;
+	uint8_t data[64];
+};
+
+extern struct mock_write *mock_log;
+extern uint32_t mock_log_len;
+/* ep_write_packet() calls refused because the endpoint was still full. */
+extern uint32_t mock_write_busy;
+
+void mock_init(void (*isr)(void));
+
+/* Drop the log, keeping the device state. */
+void mock_log_clear(void);
+
+/* Signal a bus reset. */
+void mock_bus_reset(void);
+
+/*
+ * Run a whole control transfer on endpoint 0.  data holds the wLength bytes
+ * to send, or receives up to wLength bytes.  Returns the number of bytes
+ * transferred in the data stage, or -1 if the device stalled.
+ */
+int mock_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		 uint16_t wIndex, uint16_t wLength, void *data);
+
+/*
+ * The host sends an IN token to endpoint ep.  Returns the length of the
+ * packet it got, copied to buf, or -1 for a NAK.
+ */
+int mock_in_token(uint8_t ep, uint8_t *buf);
+
+/*
+ * The host sends len bytes to OUT endpoint ep, at most its packet size.
+ * Returns len, or -1 if the endpoint NAKed them.
+ */
+int mock_out_token(uint8_t ep, const void *data, uint16_t len);
+
+/* True while the firmware has a packet waiting on IN endpoint ep. */
+bool mock_in_pending(uint8_t ep);
+
+#endif
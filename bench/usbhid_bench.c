@@ -0,0 +1,511 @@
+/*
+ * Runs the usbhid firmware on the host: usbhid.c, its encoder and scheduler
+ * and the libopencm3 USB core, on top of a mock driver that plays the USB
+ * host.  The host enumerates the device, polls endpoint 0x81 at the
+ * bInterval it was given and decodes every report back into characters,
+ * while the harness fires SysTick at the period the firmware programmed.
+ *
+ * For each report rate it prints characters per second, reports per
+ * character, characters lost or mangled on the way, and the worst time
+ * spent in either interrupt handler (host time, only useful to compare).
+ * With -s the corpus is streamed over the vendor bulk endpoint as fast as
+ * the device accepts it, instead of being queued in the firmware directly,
+ * and typed at the firmware's STREAM_RATE_MS.  With -e it only enumerates
+ * the device, many times over, and prints the USB interrupt time that took.
+ *
+ *	usbhid_bench [-e] [-s] [-l us|uk|de|cz] [-r rate_ms] [corpus]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/hid.h>
+
+#include "hid_mux.h"
+#include "keymap.h"
+#include "sequence.h"
+#include "stream.h"
+
+#include "mcu_stubs.h"
+#include "usbd_mock.h"
+
+/* Give up on a run after this many simulated frames. */
+#define FRAME_LIMIT	(10 * 60 * 1000)
+
+#define HID_EP		0x81
+#define STREAM_EP	0x02
+
+/* Enumerations timed by -e. */
+#define ENUM_RUNS	10000
+
+/* Bulk packets a full speed host fits in one frame. */
+#define BULK_PER_FRAME	19
+
+/* From usbhid.c */
+extern struct seq_sched typist;
+extern struct hid_mux hid_reports;
+extern struct stream host_text;
+extern volatile uint8_t hid_leds;
+
+static const char default_corpus[] =
+	" \nimport webbrowser\nimport time\nwhile True:\n"
+	"    webbrowser.open('https://www.youtube.com/watch?v=dQw4w9WgXcQ')\n"
+	"    time.sleep(2)\n"
+	"The quick brown fox jumps over the lazy dog 0123456789.\n"
+	"{\"key\": [1, 2, 3], \"path\": \"C:\\\\tmp\\\\x\", 'a' < b > c | d ~ e}\n";
+
+struct isr_time {
+	unsigned long calls;
+	double total_ns;
+	double worst_ns;
+};
+
+static struct isr_time usb_time, tick_time;
+/* USB interrupt time spent on GET_DESCRIPTOR(CONFIGURATION) alone. */
+static struct isr_time config_time;
+static bool config_timed;
+
+static void timed(struct isr_time *t, void (*isr)(void))
+{
+	struct timespec a, b;
+	double ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	isr();
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+	t->calls++;
+	t->total_ns += ns;
+	if (ns > t->worst_ns)
+		t->worst_ns = ns;
+}
+
+static void usb_isr(void)
+{
+	struct isr_time before = usb_time;
+
+	timed(&usb_time, usb_lp_can_rx0_isr);
+	if (config_timed) {
+		config_time.calls++;
+		config_time.total_ns += usb_time.total_ns - before.total_ns;
+	}
+}
+
+/* Character a chord types, first match in the table, or 0. */
+static char chord_char(enum keymap_layout layout, uint8_t usage,
+		       uint8_t modifiers)
+{
+	for (int c = 1; c < KEYMAP_TABLE_SIZE; c++) {
+		const struct keymap_entry *e = &keymap_tables[layout][c];
+
+		if (e->usage == usage && e->modifiers == modifiers &&
+		    (usage || modifiers))
+			return c;
+	}
+
+	return 0;
+}
+
+/* Turns the keyboard reports the host sees back into text. */
+struct decoder {
+	enum keymap_layout layout;
+	uint8_t modifiers;
+	uint8_t down[32];	/* Usages held, one bit each */
+	bool dead;		/* Swallow the space after a dead key */
+	char *text;
+	size_t len;
+};
+
+static void decode_emit(struct decoder *d, char c)
+{
+	if (d->dead && c == ' ') {
+		d->dead = false;
+		return;
+	}
+	d->dead = c && (keymap_lookup(d->layout, c)->flags & KEYMAP_DEAD);
+	d->text[d->len++] = c ? c : '?';
+}
+
+static void decode(struct decoder *d, const uint8_t *r, int len)
+{
+	uint8_t down[32] = { 0 };
+	bool pressed = false, any = false;
+
+	/* Keyboard reports only, with or without report ID. */
+	if ((len == HID_REPORT_SIZE + 1 || len == HID_NKRO_REPORT_SIZE + 1) &&
+	    r[0] == 1) {
+		r++;
+		len--;
+	} else if (len != HID_REPORT_SIZE) {
+		return;
+	}
+
+	if (len == HID_REPORT_SIZE) {
+		for (int i = 2; i < HID_REPORT_SIZE; i++)
+			if (r[i])
+				down[r[i] >> 3] |= 1 << (r[i] & 7);
+	} else {
+		memcpy(down, r + 1, HID_NKRO_REPORT_SIZE - 1);
+	}
+
+	for (int u = 0; u < 256; u++) {
+		if (!(down[u >> 3] & (1 << (u & 7))))
+			continue;
+		any = true;
+		if (!(d->down[u >> 3] & (1 << (u & 7)))) {
+			decode_emit(d, chord_char(d->layout, u, r[0]));
+			pressed = true;
+		}
+	}
+	/* A modifier on its own, like the GUI key tap. */
+	if (!pressed && !any && r[0] && r[0] != d->modifiers)
+		decode_emit(d, chord_char(d->layout, 0, r[0]));
+
+	memcpy(d->down, down, sizeof(down));
+	d->modifiers = r[0];
+}
+
+/* Run the firmware's main() up to the point where it would sleep. */
+static void boot(void)
+{
+	mock_init(usb_isr);
+	if (!setjmp(mcu_boot))
+		usbhid_main();
+}
+
+/* Read string descriptor index as Linux does and compare it with ascii. */
+static bool string_ok(uint8_t index, const char *ascii)
+{
+	uint8_t buf[255];
+	int len = mock_control(0x80, USB_REQ_GET_DESCRIPTOR,
+			       USB_DT_STRING << 8 | index, 0x0409, sizeof(buf),
+			       buf);
+
+	if ((len < 2) || (buf[0] != len) || (buf[1] != USB_DT_STRING) ||
+	    ((size_t)len != 2 + 2 * strlen(ascii)))
+		return false;
+	for (int i = 0; ascii[i]; i++)
+		if ((buf[2 + 2 * i] != ascii[i]) || buf[3 + 2 * i])
+			return false;
+
+	return true;
+}
+
+/* Bring the device up like a host would, returns bInterval of HID_EP. */
+static int enumerate(void)
+{
+	uint8_t buf[256];
+	uint8_t leds[2] = { 1, 0x02 };	/* Report ID 1, Caps Lock */
+	int len, interval = -1;
+
+	mock_bus_reset();
+	if (mock_control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0,
+			 USB_DT_DEVICE_SIZE, buf) != USB_DT_DEVICE_SIZE)
+		return -1;
+	if (mock_control(0x00, USB_REQ_SET_ADDRESS, 5, 0, 0, NULL) < 0)
+		return -1;
+	if (!string_ok(1, "Black Sphere Technologies") ||
+	    !string_ok(2, "HID Demo") || !string_ok(3, "DEMO"))
+		return -1;
+
+	/* The header for wTotalLength first, as Linux and Windows do. */
+	config_timed = true;
+	if (mock_control(0x80, USB_REQ_GET_DESCRIPTOR,
+			 USB_DT_CONFIGURATION << 8, 0, USB_DT_CONFIGURATION_SIZE,
+			 buf) != USB_DT_CONFIGURATION_SIZE)
+		len = -1;
+	else
+		len = mock_control(0x80, USB_REQ_GET_DESCRIPTOR,
+				   USB_DT_CONFIGURATION << 8, 0,
+				   buf[2] | buf[3] << 8, buf);
+	config_timed = false;
+	for (int i = 0; i + 1 < len && buf[i]; i += buf[i]) {
+		if (buf[i + 1] == USB_DT_ENDPOINT && buf[i + 2] == HID_EP)
+			interval = buf[i + 6];
+	}
+
+	if (mock_control(0x00, USB_REQ_SET_CONFIGURATION, 1, 0, 0, NULL) < 0)
+		return -1;
+	/* What Linux asks of a keyboard, then the report descriptor. */
+	if (mock_control(0x21, USB_HID_REQ_TYPE_SET_IDLE, 0, 0, 0, NULL) < 0)
+		return -1;
+	if (mock_control(0x21, USB_HID_REQ_TYPE_SET_REPORT,
+			 USB_HID_REPORT_TYPE_OUTPUT << 8 | 1, 0, sizeof(leds),
+			 leds) < 0 || hid_leds != leds[1])
+		return -1;
+	if (mock_control(0x81, USB_REQ_GET_DESCRIPTOR, USB_HID_DT_REPORT << 8,
+			 0, sizeof(buf), buf) <= 0)
+		return -1;
+
+	return interval;
+}
+
+/* Characters the layout can type, as the decoder will spell them. */
+static size_t expected_text(enum keymap_layout layout, const char *corpus,
+			    char *text)
+{
+	size_t len = 0;
+
+	for (; *corpus; corpus++) {
+		const struct keymap_entry *e = keymap_lookup(layout, *corpus);
+
+		if (e->usage || e->modifiers)
+			text[len++] = chord_char(layout, e->usage,
+						 e->modifiers);
+	}
+
+	return len;
+}
+
+struct result {
+	double chars_per_s;
+	double reports_per_char;
+	size_t lost;		/* Expected characters the host never saw */
+	size_t extra;		/* Characters the host saw in excess */
+	uint32_t busy;		/* Writes refused, endpoint full */
+	uint16_t high_water;	/* Deepest keyboard queue */
+	uint32_t worst_wait;	/* Frames from written to collected */
+	uint32_t naks;		/* Bulk packets the device refused */
+};
+
+/* Everything typed and collected, nothing left anywhere. */
+static bool idle(size_t sent, size_t len)
+{
+	return sent == len && !stream_used(&host_text) && !typist.active &&
+	       !typist.waiting && !hid_mux_depth(&hid_reports) &&
+	       !mock_in_pending(HID_EP);
+}
+
+static int run(enum keymap_layout layout, uint16_t rate, const char *corpus,
+	       bool stream, struct result *res)
+{
+	size_t corpus_len = strlen(corpus);
+	char *expected = malloc(corpus_len + 1);
+	char *seen = malloc(4 * corpus_len + 1);
+	struct decoder d = { .layout = layout, .text = seen };
+	struct seq s = { .text = corpus, .start = 0, .rate = rate };
+	uint32_t first = 0, last = 0, reports = 0, naks = 0, period;
+	size_t expected_len, matched = 0, sent = 0;
+	uint8_t buf[64];
+	int interval;
+
+	boot();
+	interval = enumerate();
+	if (interval <= 0 || !mcu_systick_enabled) {
+		fprintf(stderr, "enumeration failed\n");
+		return -1;
+	}
+	period = mcu_systick_period_ms();
+
+	/* Type the corpus instead of the firmware's own texts. */
+	typist.layout = layout;
+	typist.waiting = NULL;
+	if (!stream) {
+		seq_add(&typist, &s);
+		sent = corpus_len;
+	}
+
+	mock_log_clear();
+	memset(&usb_time, 0, sizeof(usb_time));
+	memset(&tick_time, 0, sizeof(tick_time));
+
+	for (mock_frame = 1; mock_frame < FRAME_LIMIT; mock_frame++) {
+		int len;
+
+		for (int i = 0; i < BULK_PER_FRAME && sent < corpus_len; i++) {
+			uint16_t n = corpus_len - sent < 64 ?
+				     corpus_len - sent : 64;
+
+			if (mock_out_token(STREAM_EP, corpus + sent, n) < 0) {
+				naks++;
+				break;
+			}
+			sent += n;
+		}
+
+		if (!(mock_frame % period))
+			timed(&tick_time, sys_tick_handler);
+
+		if (!(mock_frame % interval) &&
+		    (len = mock_in_token(HID_EP, buf)) >= 0) {
+			size_t before = d.len;
+
+			decode(&d, buf, len);
+			reports++;
+			if (d.len != before) {
+				if (!first)
+					first = mock_frame;
+				last = mock_frame;
+			}
+		}
+
+		if (idle(sent, corpus_len))
+			break;
+	}
+
+	/* Characters the host saw in order, greedily. */
+	expected_len = expected_text(layout, corpus, expected);
+	for (size_t i = 0; i < d.len && matched < expected_len; i++)
+		if (seen[i] == expected[matched])
+			matched++;
+
+	memset(res, 0, sizeof(*res));
+	res->chars_per_s = matched * 1000.0 / (last - first + 1);
+	res->reports_per_char = matched ? (double)reports / matched : 0;
+	res->lost = expected_len - matched;
+	res->extra = d.len - matched;
+	res->busy = mock_write_busy;
+	res->naks = naks;
+	res->high_water = hid_reports.queue[HID_SOURCE_KEYBOARD].high_water;
+	for (uint32_t i = 0; i < mock_log_len; i++) {
+		const struct mock_write *w = &mock_log[i];
+
+		if (w->ep == HID_EP && w->collected &&
+		    w->collected - w->written > res->worst_wait)
+			res->worst_wait = w->collected - w->written;
+	}
+
+	free(expected);
+	free(seen);
+	return 0;
+}
+
+/* USB interrupt time of ENUM_RUNS enumerations, and of their config reads. */
+static int time_enumeration(struct isr_time *t, struct isr_time *config)
+{
+	boot();
+	memset(&usb_time, 0, sizeof(usb_time));
+	memset(&config_time, 0, sizeof(config_time));
+	for (int i = 0; i < ENUM_RUNS; i++) {
+		if (enumerate() <= 0) {
+			fprintf(stderr, "enumeration failed\n");
+			return -1;
+		}
+	}
+	*t = usb_time;
+	*config = config_time;
+
+	return 0;
+}
+
+static char *read_file(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char *text;
+	long len;
+
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	text = malloc(len + 1);
+	if (text && fread(text, 1, len, f) != (size_t)len) {
+		free(text);
+		text = NULL;
+	}
+	if (text)
+		text[len] = 0;
+	fclose(f);
+
+	return text;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *layouts[] = { "us", "uk", "de", "cz" };
+	/* Report rates the firmware can run at, HID_INTERVAL_MS 1 to 10. */
+	static const uint16_t sweep[] = { 1, 2, 4, 8, 10 };
+	enum keymap_layout layout = KEYMAP_US;
+	const char *corpus = default_corpus;
+	uint16_t rate = 0;
+	bool stream = false, enumeration = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "esl:r:")) != -1) {
+		switch (opt) {
+		case 'e':
+			enumeration = true;
+			break;
+		case 's':
+			stream = true;
+			break;
+		case 'l':
+			for (layout = 0; layout < KEYMAP_NUM_LAYOUTS; layout++)
+				if (!strcmp(optarg, layouts[layout]))
+					break;
+			if (layout == KEYMAP_NUM_LAYOUTS)
+				goto usage;
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			if (rate < 1 || rate > 10)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind < argc && !(corpus = read_file(argv[optind]))) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (enumeration) {
+		struct isr_time t, config;
+
+		if (time_enumeration(&t, &config))
+			return 1;
+		printf("%d enumerations, usb isr host ns each: %.0f in %.1f"
+		       " calls, config descriptor %.0f in %.1f calls\n",
+		       ENUM_RUNS, t.total_ns / ENUM_RUNS,
+		       (double)t.calls / ENUM_RUNS,
+		       config.total_ns / ENUM_RUNS,
+		       (double)config.calls / ENUM_RUNS);
+		return 0;
+	}
+
+	printf("%zu characters, layout %s, %s; ISR times are host ns\n",
+	       strlen(corpus), layouts[layout],
+	       stream ? "streamed over bulk" : "queued in firmware");
+	printf("rate ms  chars/s  reports/char  lost  extra  ep busy"
+	       "  queue  wait  naks  usb isr worst/mean"
+	       "  tick isr worst/mean\n");
+
+	for (size_t i = 0; i < sizeof(sweep) / sizeof(sweep[0]); i++) {
+		struct result res;
+		uint16_t r = rate ? rate : sweep[i];
+
+		if (run(layout, r, corpus, stream, &res))
+			return 1;
+
+		if (stream)
+			printf("%7s", "fw");
+		else
+			printf("%7u", r);
+		printf("  %7.1f  %12.2f  %4zu  %5zu  %7u  %5u  %4u  %4u"
+		       "  %9.0f %9.0f  %9.0f %9.0f\n",
+		       res.chars_per_s, res.reports_per_char, res.lost,
+		       res.extra, res.busy, res.high_water, res.worst_wait,
+		       res.naks,
+		       usb_time.worst_ns, usb_time.total_ns / usb_time.calls,
+		       tick_time.worst_ns,
+		       tick_time.total_ns / tick_time.calls);
+
+		if (rate || stream)
+			break;
+	}
+
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-e] [-s] [-l us|uk|de|cz] [-r rate_ms]"
+		" [corpus]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,13 @@
+/*
+ * Forced into usbhid.c when it is built for the host simulation, so that
+ * the firmware source itself stays untouched.
+ */
+
+/* Entered from the harness, see mcu_stubs.h */
+#define main usbhid_main
+
+/* scb.h only declares it for ARMv7-M, the stub is in mcu_stubs.c */
+void scb_reset_core(void) __attribute__((noreturn));
+
+/* The idle loop is never reached on the host, but has to assemble. */
+__asm__(".macro wfi\n.endm");
@@ -0,0 +1,51 @@
+#include <stddef.h>
+
+#include "hid_mux.h"
+
+void hid_mux_init(struct hid_mux *m)
+{
+	for (int i = 0; i < HID_NUM_SOURCES; i++)
+		hid_queue_init(&m->queue[i]);
+	m->next = 0;
+	m->peeked = 0;
+}
+
+bool hid_mux_push(struct hid_mux *m, enum hid_source source,
+		  const uint8_t *report, uint16_t len)
+{
+	return hid_queue_push(&m->queue[source], report, len);
+}
+
+const uint8_t *hid_mux_peek(struct hid_mux *m, uint16_t *len)
+{
+	uint8_t source = m->next;
+
+	for (int i = 0; i < HID_NUM_SOURCES; i++) {
+		const uint8_t *report = hid_queue_peek(&m->queue[source], len);
+
+		if (report) {
+			m->peeked = source;
+			return report;
+		}
+		if (++source == HID_NUM_SOURCES)
+			source = 0;
+	}
+
+	return NULL;
+}
+
+void hid_mux_pop(struct hid_mux *m)
+{
+	hid_queue_pop(&m->queue[m->peeked]);
+	m->next = (m->peeked + 1 == HID_NUM_SOURCES) ? 0 : m->peeked + 1;
+}
+
+uint16_t hid_mux_depth(const struct hid_mux *m)
+{
+	uint16_t depth = 0;
+
+	for (int i = 0; i < HID_NUM_SOURCES; i++)
+		depth += hid_queue_depth(&m->queue[i]);
+
+	return depth;
+}
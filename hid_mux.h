@@ -0,0 +1,50 @@
+#ifndef HID_MUX_H
+#define HID_MUX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hid_queue.h"
+
+/* Report types sharing the interrupt IN endpoint. */
+enum hid_source {
+	HID_SOURCE_KEYBOARD,
+	HID_SOURCE_CONSUMER,
+	HID_SOURCE_MOUSE,
+	HID_NUM_SOURCES
+};
+
+/*
+ * One queue per report type, drained round robin: after a report of one
+ * type went out, every other type with something queued gets its turn
+ * before that type comes again.  A burst of typing can then delay a mouse
+ * or media key report by at most HID_NUM_SOURCES - 1 polls, instead of by
+ * the whole keyboard queue.
+ *
+ * Each queue keeps its single producer, single consumer property: pushing
+ * only touches the queue, peek and pop only run on the consumer side.
+ */
+struct hid_mux {
+	struct hid_queue queue[HID_NUM_SOURCES];
+	uint8_t next;		/* Source looked at first by the next peek */
+	uint8_t peeked;		/* Source of the report returned by peek */
+};
+
+void hid_mux_init(struct hid_mux *m);
+
+/* Returns false, leaving the queue untouched, when it is full. */
+bool hid_mux_push(struct hid_mux *m, enum hid_source source,
+		  const uint8_t *report, uint16_t len);
+
+/*
+ * Returns the report to send next and stores its length in len, or returns
+ * NULL when every queue is empty.
+ */
+const uint8_t *hid_mux_peek(struct hid_mux *m, uint16_t *len);
+
+/* Drops the report returned by hid_mux_peek() and moves on to the next type. */
+void hid_mux_pop(struct hid_mux *m);
+
+uint16_t hid_mux_depth(const struct hid_mux *m);
+
+#endif
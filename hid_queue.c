@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "hid_queue.h"
+
+#if HID_QUEUE_LEN & (HID_QUEUE_LEN - 1)
+#error "HID_QUEUE_LEN must be a power of two"
+#endif
+
+void hid_queue_init(struct hid_queue *q)
+{
+	q->head = 0;
+	q->tail = 0;
+	q->high_water = 0;
+}
+
+uint16_t hid_queue_depth(const struct hid_queue *q)
+{
+	/* Indices are free running, unsigned wrap gives the distance. */
+	return (uint16_t)(q->head - q->tail);
+}
+
+bool hid_queue_push(struct hid_queue *q, const uint8_t *report, uint16_t len)
+{
+	uint16_t head = q->head;
+	uint16_t depth = (uint16_t)(head - q->tail);
+
+	if ((depth >= HID_QUEUE_LEN) || (len > HID_REPORT_MAX))
+		return false;
+
+	q->report[head & (HID_QUEUE_LEN - 1)].len = len;
+	memcpy(q->report[head & (HID_QUEUE_LEN - 1)].data, report, len);
+	/* Publish the slot only once its contents are in place. */
+	__asm__ volatile("" ::: "memory");
+	q->head = head + 1;
+
+	if (depth + 1 > q->high_water)
+		q->high_water = depth + 1;
+
+	return true;
+}
+
+const uint8_t *hid_queue_peek(const struct hid_queue *q, uint16_t *len)
+{
+	uint16_t tail = q->tail;
+
+	if (q->head == tail)
+		return NULL;
+
+	*len = q->report[tail & (HID_QUEUE_LEN - 1)].len;
+	return q->report[tail & (HID_QUEUE_LEN - 1)].data;
+}
+
+void hid_queue_pop(struct hid_queue *q)
+{
+	if (q->head != q->tail)
+		q->tail = q->tail + 1;
+}
@@ -0,0 +1,50 @@
+#ifndef HID_QUEUE_H
+#define HID_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Size of a boot keyboard input report. */
+#define HID_REPORT_SIZE 8
+
+/* Size of the N-key rollover input report, modifiers plus key bitmap. */
+#define HID_NKRO_REPORT_SIZE 16
+
+/* Largest report a queue slot can hold, with its report ID. */
+#define HID_REPORT_MAX (HID_NKRO_REPORT_SIZE + 1)
+
+/* Number of queued reports, must be a power of two. */
+#define HID_QUEUE_LEN 64
+
+/*
+ * Single producer, single consumer ring of input reports.  The producer
+ * only ever writes head and the consumer only ever writes tail, so the two
+ * sides may run in different interrupt contexts without locking.
+ */
+struct hid_queue {
+	struct {
+		uint8_t len;
+		uint8_t data[HID_REPORT_MAX];
+	} report[HID_QUEUE_LEN];
+	volatile uint16_t head;
+	volatile uint16_t tail;
+	uint16_t high_water;	/* Largest depth seen since init */
+};
+
+void hid_queue_init(struct hid_queue *q);
+
+/* Returns false, leaving the queue untouched, when it is full. */
+bool hid_queue_push(struct hid_queue *q, const uint8_t *report, uint16_t len);
+
+/*
+ * Returns the oldest report and stores its length in len, or returns NULL
+ * when the queue is empty.
+ */
+const uint8_t *hid_queue_peek(const struct hid_queue *q, uint16_t *len);
+
+/* Drops the report returned by hid_queue_peek(). */
+void hid_queue_pop(struct hid_queue *q);
+
+uint16_t hid_queue_depth(const struct hid_queue *q);
+
+#endif
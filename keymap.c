@@ -0,0 +1,120 @@
+#include <string.h>
+
+#include "keymap.h"
+
+const struct keymap_entry *const keymap_tables[KEYMAP_NUM_LAYOUTS] = {
+	[KEYMAP_US] = keymap_us,
+	[KEYMAP_UK] = keymap_uk,
+	[KEYMAP_DE] = keymap_de,
+	[KEYMAP_CZ] = keymap_cz,
+};
+
+/* Write the report for chord e, or an all keys up report if e is NULL. */
+static uint16_t keymap_report(const struct keymap_entry *e, uint8_t *report,
+			      enum keymap_format format)
+{
+	uint16_t len = (format == KEYMAP_NKRO) ? HID_NKRO_REPORT_SIZE :
+						 HID_REPORT_SIZE;
+
+	memset(report, 0, len);
+	if (!e)
+		return len;
+
+	report[0] = e->modifiers;
+	if (format == KEYMAP_BOOT) {
+		report[2] = e->usage;
+	} else if (e->usage && (e->usage < KEYMAP_NKRO_USAGES)) {
+		report[1 + (e->usage >> 3)] |= 1 << (e->usage & 7);
+	}
+
+	return len;
+}
+
+void keymap_encode_char(enum keymap_layout layout, char c, uint8_t *report)
+{
+	keymap_report(keymap_lookup(layout, c), report, KEYMAP_BOOT);
+}
+
+void keymap_typer_start(struct keymap_typer *t, enum keymap_layout layout,
+			const char *s)
+{
+	t->layout = layout;
+	t->s = s;
+	t->held = NULL;
+	t->dead = false;
+}
+
+/*
+ * Release and press may share a report only for distinct keys under the
+ * same modifiers.  Hosts handle the modifier byte before the keys, so a
+ * modifier change next to a key change could apply to the wrong key, and
+ * a repeated key needs to be seen going up.
+ */
+static bool keymap_can_roll(const struct keymap_entry *from,
+			    const struct keymap_entry *to)
+{
+	return from->usage && to->usage && (from->usage != to->usage) &&
+	       (from->modifiers == to->modifiers);
+}
+
+uint16_t keymap_typer_next(struct keymap_typer *t, uint8_t *report,
+			   enum keymap_format format)
+{
+	const struct keymap_entry *e = NULL;
+
+	if (t->dead) {
+		e = keymap_lookup(t->layout, ' ');
+	} else {
+		/* Skip characters the layout cannot type. */
+		for (; *t->s; t->s++) {
+			e = keymap_lookup(t->layout, *t->s);
+			if (e->usage || e->modifiers)
+				break;
+			e = NULL;
+		}
+	}
+
+	if (t->held && (!e || !keymap_can_roll(t->held, e))) {
+		t->held = NULL;
+		return keymap_report(NULL, report, format);
+	}
+
+	if (!e)
+		return 0;
+
+	if (t->dead) {
+		t->dead = false;
+	} else {
+		t->s++;
+		t->dead = e->flags & KEYMAP_DEAD;
+	}
+	t->held = e;
+
+	return keymap_report(e, report, format);
+}
+
+size_t keymap_encode(enum keymap_layout layout, const char **str,
+		     uint8_t (*reports)[HID_REPORT_SIZE], size_t max)
+{
+	struct keymap_typer t;
+	size_t n = 0;
+
+	keymap_typer_start(&t, layout, *str);
+
+	/*
+	 * A character takes at most five reports: release, press, release
+	 * and space after a dead key, then the final release.  Only start one
+	 * if all of them fit.
+	 */
+	while (t.dead || (max - n >= 5)) {
+		if (!keymap_typer_next(&t, reports[n], KEYMAP_BOOT))
+			break;
+		n++;
+	}
+
+	if (t.held)
+		keymap_report(NULL, reports[n++], KEYMAP_BOOT);
+
+	*str = t.s;
+	return n;
+}
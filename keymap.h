@@ -0,0 +1,106 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid_queue.h"
+
+/* Host keyboard layouts we can type for. */
+enum keymap_layout {
+	KEYMAP_US,
+	KEYMAP_UK,
+	KEYMAP_DE,
+	KEYMAP_CZ,
+	KEYMAP_NUM_LAYOUTS
+};
+
+/* Input report formats the encoder can produce. */
+enum keymap_format {
+	KEYMAP_BOOT,	/* Boot protocol, modifiers and a 6 key array */
+	KEYMAP_NKRO,	/* Modifiers and one bit per key usage */
+};
+
+/* Key usages covered by the NKRO bitmap. */
+#define KEYMAP_NKRO_USAGES	((HID_NKRO_REPORT_SIZE - 1) * 8)
+
+/* Modifier bits, byte 0 of both report formats. */
+#define KEYMAP_MOD_LCTRL	0x01
+#define KEYMAP_MOD_LSHIFT	0x02
+#define KEYMAP_MOD_LALT		0x04
+#define KEYMAP_MOD_LGUI		0x08
+#define KEYMAP_MOD_RALT		0x40
+
+/* The key is a dead key, a space must follow to get the character. */
+#define KEYMAP_DEAD		0x01
+
+/*
+ * Besides printable ASCII the tables map \b, \t, \n, \r, ESC and DEL to
+ * their keys, and the remaining C0 codes to Ctrl+letter ("\x12" is Ctrl+R).
+ * Two codes are taken over for chords without an ASCII meaning:
+ */
+#define KEYMAP_GUI		"\x1c"	/* Tap the GUI (Windows) key */
+#define KEYMAP_CLOSE		"\x1d"	/* Alt+F4 */
+
+#define KEYMAP_TABLE_SIZE	128
+
+struct keymap_entry {
+	uint8_t usage;
+	uint8_t modifiers;
+	uint8_t flags;
+};
+
+/* Generated by scripts/genkeymap.py into generated.keymap.c */
+extern const struct keymap_entry keymap_us[KEYMAP_TABLE_SIZE];
+extern const struct keymap_entry keymap_uk[KEYMAP_TABLE_SIZE];
+extern const struct keymap_entry keymap_de[KEYMAP_TABLE_SIZE];
+extern const struct keymap_entry keymap_cz[KEYMAP_TABLE_SIZE];
+
+extern const struct keymap_entry *const keymap_tables[KEYMAP_NUM_LAYOUTS];
+
+/* Table entry for c, characters outside ASCII give an empty entry. */
+static inline const struct keymap_entry *
+keymap_lookup(enum keymap_layout layout, char c)
+{
+	uint8_t code = (uint8_t)c;
+
+	return &keymap_tables[layout][code < KEYMAP_TABLE_SIZE ? code : 0];
+}
+
+/* Fill report with the key press for c, ignoring any dead key flag. */
+void keymap_encode_char(enum keymap_layout layout, char c, uint8_t *report);
+
+/*
+ * Types a string one report at a time.  When the next character is on a
+ * different key and needs the same modifiers, the release of the previous
+ * key and the press of the next one go out as a single report, so plain
+ * text costs a little over one report per character instead of two.
+ */
+struct keymap_typer {
+	enum keymap_layout layout;
+	const char *s;				/* Next character to type */
+	const struct keymap_entry *held;	/* Chord that is down, or NULL */
+	bool dead;		/* A dead key went down, a space must follow */
+};
+
+void keymap_typer_start(struct keymap_typer *t, enum keymap_layout layout,
+			const char *s);
+
+/*
+ * Write the next report in the given format.  Returns its length, or 0 once
+ * the whole string has been typed and every key released.
+ */
+uint16_t keymap_typer_next(struct keymap_typer *t, uint8_t *report,
+			   enum keymap_format format);
+
+/*
+ * Turn the string at *str into boot protocol reports, at most max of them.
+ * Stops at the terminating NUL or before the first character whose reports
+ * might not fit, always ending with every key released.  Advances *str past
+ * the characters encoded and returns the number of reports written.
+ */
+size_t keymap_encode(enum keymap_layout layout, const char **str,
+		     uint8_t (*reports)[HID_REPORT_SIZE], size_t max);
+
+#endif
@@ -0,0 +1,167 @@
+/** @defgroup udma_defines Micro Direct Memory Access
+ *
+ * @brief <b>Defined Constants and Types for the LM4F Micro Direct Memory Access
+ * controller (uDMA)</b>
+ *
+ * @ingroup LM4Fxx_defines
+ *
+ * @version 1.0.0
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LM4F_UDMA_H
+#define LM4F_UDMA_H
+
+/**@{*/
+
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/lm4f/memorymap.h>
+
+/* =============================================================================
+ * uDMA registers
+ * ---------------------------------------------------------------------------*/
+
+/* DMA Status */
+#define UDMA_STAT			MMIO32(UDMA_BASE + 0x000)
+
+/* DMA Configuration */
+#define UDMA_CFG			MMIO32(UDMA_BASE + 0x004)
+
+/* DMA Channel Control Base Pointer */
+#define UDMA_CTLBASE			MMIO32(UDMA_BASE + 0x008)
+
+/* DMA Alternate Channel Control Base Pointer */
+#define UDMA_ALTBASE			MMIO32(UDMA_BASE + 0x00C)
+
+/* DMA Channel Wait-on-Request Status */
+#define UDMA_WAITSTAT			MMIO32(UDMA_BASE + 0x010)
+
+/* DMA Channel Software Request */
+#define UDMA_SWREQ			MMIO32(UDMA_BASE + 0x014)
+
+/* DMA Channel Useburst Set */
+#define UDMA_USEBURSTSET		MMIO32(UDMA_BASE + 0x018)
+
+/* DMA Channel Useburst Clear */
+#define UDMA_USEBURSTCLR		MMIO32(UDMA_BASE + 0x01C)
+
+/* DMA Channel Request Mask Set */
+#define UDMA_REQMASKSET			MMIO32(UDMA_BASE + 0x020)
+
+/* DMA Channel Request Mask Clear */
+#define UDMA_REQMASKCLR			MMIO32(UDMA_BASE + 0x024)
+
+/* DMA Channel Enable Set */
+#define UDMA_ENASET			MMIO32(UDMA_BASE + 0x028)
+
+/* DMA Channel Enable Clear */
+#define UDMA_ENACLR			MMIO32(UDMA_BASE + 0x02C)
+
+/* DMA Channel Primary Alternate Set */
+#define UDMA_ALTSET			MMIO32(UDMA_BASE + 0x030)
+
+/* DMA Channel Primary Alternate Clear */
+#define UDMA_ALTCLR			MMIO32(UDMA_BASE + 0x034)
+
+/* DMA Channel Priority Set */
+#define UDMA_PRIOSET			MMIO32(UDMA_BASE + 0x038)
+
+/* DMA Channel Priority Clear */
+#define UDMA_PRIOCLR			MMIO32(UDMA_BASE + 0x03C)
+
+/* DMA Bus Error Clear */
+#define UDMA_ERRCLR			MMIO32(UDMA_BASE + 0x04C)
+
+/* DMA Channel Assignment */
+#define UDMA_CHASGN			MMIO32(UDMA_BASE + 0x500)
+
+/* DMA Channel Interrupt Status */
+#define UDMA_CHIS			MMIO32(UDMA_BASE + 0x504)
+
+/* DMA Channel Map Select [0-3] */
+#define UDMA_CHMAP(n)			MMIO32(UDMA_BASE + 0x510 + (n)*4)
+
+/* =============================================================================
+ * UDMA_STAT values
+ * ---------------------------------------------------------------------------*/
+/** Controller master enable status */
+#define UDMA_STAT_MASTEN		(1 << 0)
+
+/* =============================================================================
+ * UDMA_CFG values
+ * ---------------------------------------------------------------------------*/
+/** Controller Master Enable */
+#define UDMA_CFG_MASTEN			(1 << 0)
+
+/* =============================================================================
+ * Channel numbers
+ * ---------------------------------------------------------------------------*/
+/** Channel 30 is dedicated to software requests */
+#define UDMA_CH_SW			30
+
+/* =============================================================================
+ * Channel control word, the third word of a channel control structure
+ * ---------------------------------------------------------------------------*/
+#define UDMA_CHCTL_DSTINC_SHIFT		30
+#define UDMA_CHCTL_DSTSIZE_SHIFT	28
+#define UDMA_CHCTL_SRCINC_SHIFT		26
+#define UDMA_CHCTL_SRCSIZE_SHIFT	24
+
+/** Increment and item sizes, for the DSTINC, DSTSIZE, SRCINC, SRCSIZE fields */
+#define UDMA_CHCTL_SIZE_8		0
+#define UDMA_CHCTL_SIZE_16		1
+#define UDMA_CHCTL_SIZE_32		2
+#define UDMA_CHCTL_INC_NONE		3
+
+#define UDMA_CHCTL_DSTINC(x)		((x) << UDMA_CHCTL_DSTINC_SHIFT)
+#define UDMA_CHCTL_DSTSIZE(x)		((x) << UDMA_CHCTL_DSTSIZE_SHIFT)
+#define UDMA_CHCTL_SRCINC(x)		((x) << UDMA_CHCTL_SRCINC_SHIFT)
+#define UDMA_CHCTL_SRCSIZE(x)		((x) << UDMA_CHCTL_SRCSIZE_SHIFT)
+/** Items between arbitrations, as a power of two, 1 to 1024 */
+#define UDMA_CHCTL_ARBSIZE(log2)	((log2) << 14)
+/** Items to transfer, 1 to 1024 */
+#define UDMA_CHCTL_XFERSIZE(n)		((((n) - 1) & 0x3ff) << 4)
+/** Next Useburst */
+#define UDMA_CHCTL_NXTUSEBURST		(1 << 3)
+#define UDMA_CHCTL_XFERMODE_MASK	(0x7 << 0)
+#define UDMA_CHCTL_XFERMODE_STOP	(0x0 << 0)
+#define UDMA_CHCTL_XFERMODE_BASIC	(0x1 << 0)
+#define UDMA_CHCTL_XFERMODE_AUTO	(0x2 << 0)
+#define UDMA_CHCTL_XFERMODE_PINGPONG	(0x3 << 0)
+
+/* =============================================================================
+ * Channel control table
+ * ---------------------------------------------------------------------------*/
+/**
+ * One entry of the channel control table.  The primary table, one entry per
+ * channel, must be 1024 byte aligned.  The end pointers point at the last
+ * item of a transfer, or at the register itself when it does not increment.
+ */
+struct udma_channel_control {
+	volatile uint32_t src_end;
+	volatile uint32_t dst_end;
+	volatile uint32_t chctl;
+	uint32_t reserved;
+};
+
+/**@}*/
+
+#endif
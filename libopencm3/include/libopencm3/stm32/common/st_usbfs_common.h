@@ -273,6 +273,26 @@ LGPL License Terms @ref lgpl_license
 		GET_REG(USB_EP_REG(EP)) & \
 		(USB_EP_NTOGGLE_MSK | USB_EP_RX_DTOG))
 
+/* Macros for toggling DTOG bits, leaving CTR bits set meanwhile alone */
+#define USB_TOG_EP_TX_DTOG(EP) \
+	SET_REG(USB_EP_REG(EP), \
+		(GET_REG(USB_EP_REG(EP)) & USB_EP_NTOGGLE_MSK) | \
+		USB_EP_RX_CTR | USB_EP_TX_CTR | USB_EP_TX_DTOG)
+
+#define USB_TOG_EP_RX_DTOG(EP) \
+	SET_REG(USB_EP_REG(EP), \
+		(GET_REG(USB_EP_REG(EP)) & USB_EP_NTOGGLE_MSK) | \
+		USB_EP_RX_CTR | USB_EP_TX_CTR | USB_EP_RX_DTOG)
+
+/*
+ * Double buffered bulk endpoints use the DTOG bit of the unused direction
+ * as SW_BUF, the buffer the application holds.
+ */
+#define USB_EP_SW_BUF_TX	USB_EP_RX_DTOG
+#define USB_EP_SW_BUF_RX	USB_EP_TX_DTOG
+#define USB_TOG_EP_SW_BUF_TX(EP)	USB_TOG_EP_RX_DTOG(EP)
+#define USB_TOG_EP_SW_BUF_RX(EP)	USB_TOG_EP_TX_DTOG(EP)
+
 
 /* --- USB BTABLE registers ------------------------------------------------ */
 
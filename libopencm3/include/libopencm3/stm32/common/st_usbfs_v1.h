@@ -36,6 +36,11 @@
 
 #include <libopencm3/stm32/common/st_usbfs_common.h>
 
+/* Bytes of packet memory, buffer table included */
+#ifndef USB_PMA_SIZE
+#define USB_PMA_SIZE		512
+#endif
+
 /* --- USB BTABLE Registers ------------------------------------------------ */
 
 #define USB_EP_TX_ADDR(EP) \
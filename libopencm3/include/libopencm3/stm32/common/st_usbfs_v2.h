@@ -78,6 +78,11 @@
 #define USB_BCDR_DCDEN		(1 << 1)
 #define USB_BCDR_BCDEN		(1 << 0)
 
+/* Bytes of packet memory, buffer table included */
+#ifndef USB_PMA_SIZE
+#define USB_PMA_SIZE		1024
+#endif
+
 /* --- USB BTABLE registers ------------------------------------------------ */
 
 #define USB_EP_TX_ADDR(ep) \
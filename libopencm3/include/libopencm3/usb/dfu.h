@@ -39,6 +39,7 @@ LGPL License Terms @ref lgpl_license
 #define __DFU_H
 
 #include <stdint.h>
+#include <libopencm3/usb/usbdesc.h>
 
 #define USB_CLASS_DFU 0xFE
 
@@ -100,6 +101,13 @@ struct usb_dfu_descriptor {
 	uint16_t bcdDFUVersion;
 } __attribute__((packed));
 
+/** DFU functional descriptor, for usbdesc.h blobs */
+#define USB_DFU_DESC_FUNCTIONAL(attributes, detach_timeout, transfer_size, \
+				bcd_dfu_version) \
+	sizeof(struct usb_dfu_descriptor), DFU_FUNCTIONAL, (attributes), \
+	USB_DESC_U16(detach_timeout), USB_DESC_U16(transfer_size), \
+	USB_DESC_U16(bcd_dfu_version)
+
 #endif
 
 /**@}*/
@@ -81,6 +81,9 @@
 #define OTG_DOEPTSIZ0			0xB10U
 #define OTG_DOEPTSIZ(x)			(0xB10U + 0x20*(x))
 #define OTG_DTXFSTS(x)			(0x918U + 0x20*(x))
+/* Endpoint DMA addresses, only on cores built with DMA (OTG_HS) */
+#define OTG_DIEPDMA(x)			(0x914U + 0x20*(x))
+#define OTG_DOEPDMA(x)			(0xB14U + 0x20*(x))
 
 /* Power and clock gating control and status register */
 #define OTG_PCGCCTL			0xE00U
@@ -116,6 +119,13 @@
 
 /* OTG AHB configuration register (OTG_GAHBCFG) */
 #define OTG_GAHBCFG_GINT		(1U << 0U)
+#define OTG_GAHBCFG_HBSTLEN_SINGLE	(0x0U << 1U)
+#define OTG_GAHBCFG_HBSTLEN_INCR	(0x1U << 1U)
+#define OTG_GAHBCFG_HBSTLEN_INCR4	(0x3U << 1U)
+#define OTG_GAHBCFG_HBSTLEN_INCR8	(0x5U << 1U)
+#define OTG_GAHBCFG_HBSTLEN_INCR16	(0x7U << 1U)
+#define OTG_GAHBCFG_HBSTLEN_MASK	(0xfU << 1U)
+#define OTG_GAHBCFG_DMAEN		(1U << 5U)
 #define OTG_GAHBCFG_TXFELVL		(1U << 7U)
 #define OTG_GAHBCFG_PTXFELVL		(1U << 8U)
 
@@ -265,6 +275,8 @@
 
 /* OTG device status register (OTG_DSTS) */
 #define OTG_DSTS_SUSPSTS	(1U << 0U)
+#define OTG_DSTS_FNSOF_SHIFT	8U
+#define OTG_DSTS_FNSOF_MASK	(0x3fffU << 8U)
 
 /* OTG Device IN Endpoint Common Interrupt Mask Register (OTG_DIEPMSK) */
 /* Bits 31:10 - Reserved */
@@ -314,6 +326,9 @@
 #define OTG_DIEPCTL0_MPSIZ_8		(0x3U << 0U)
 
 /* OTG Device IN Endpoint X Control Register (OTG_DIEPCTLX) */
+#define OTG_DIEPCTLX_SODDFRM		(1U << 29U)
+#define OTG_DIEPCTLX_SEVNFRM		(1U << 28U)
+#define OTG_DIEPCTLX_EONUM			(1U << 16U)
 #define OTG_DIEPCTLX_EPTYP_SHIFT	18U
 #define OTG_DIEPCTLX_TXFNUM_SHIFT	22U
 #define OTG_DIEPCTLX_MPSIZ_MASK     (0x000007ffU)
@@ -341,6 +356,9 @@
 /* OTG Device OUT Endpoint X Control Register (OTG_DOEPCTLX) */
 #define OTG_DOEPCTLX_SD1PID			(1U << 29U)
 #define OTG_DOEPCTLX_SD0PID			(1U << 28U)
+#define OTG_DOEPCTLX_SODDFRM		(1U << 29U)
+#define OTG_DOEPCTLX_SEVNFRM		(1U << 28U)
+#define OTG_DOEPCTLX_EONUM			(1U << 16U)
 #define OTG_DIEPCTLX_EPTYP_SHIFT	18U
 #define OTG_DOEPCTLX_MPSIZ_MASK		(0x000007ffU)
 
@@ -39,6 +39,8 @@ LGPL License Terms @ref lgpl_license
 #define __HID_H
 
 #include <stdint.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/usbdesc.h>
 
 #define USB_CLASS_HID	3
 
@@ -85,6 +87,95 @@ struct usb_hid_descriptor {
 	uint8_t bNumDescriptors;
 } __attribute__((packed));
 
+/** HID descriptor with one report descriptor, for usbdesc.h blobs */
+#define USB_HID_DESC(bcd_hid, country_code, report_descriptor_len) \
+	9, USB_HID_DT_HID, USB_DESC_U16(bcd_hid), (country_code), 1, \
+	USB_HID_DT_REPORT, USB_DESC_U16(report_descriptor_len)
+
+/* USB HID 7.2.4, SET_IDLE duration unit in milliseconds */
+#define USB_HID_IDLE_UNIT_MS 4
+
+/* USB HID 7.2.4, recommended default idle rate for keyboards, 500ms */
+#define USB_HID_IDLE_RATE_KEYBOARD 125
+
+/* Largest input report the class layer caches, a full speed packet */
+#define USB_HID_MAX_REPORT_SIZE 64
+
+/* Report IDs below this are cached and rate limited, 0 is no report ID */
+#define USB_HID_MAX_REPORT_IDS 4
+
+typedef struct _usbd_hid usbd_hid;
+
+/** Result of @ref usb_hid_send_report */
+enum usb_hid_send_status {
+	/** Endpoint busy, retry once the previous report completed */
+	USB_HID_SEND_BUSY = 0,
+	/** Report handed to the endpoint */
+	USB_HID_SEND_QUEUED,
+	/** Identical to the last report and idle rate not due, not sent */
+	USB_HID_SEND_UNCHANGED,
+};
+
+typedef void (*usbd_hid_in_complete_callback)(usbd_hid *hid);
+
+typedef void (*usbd_hid_output_report_callback)(usbd_hid *hid,
+		uint8_t report_id, const uint8_t *report, uint16_t len);
+
+/* Last input report for one report ID */
+struct usb_hid_report_state {
+	uint8_t idle_rate;	/* In USB_HID_IDLE_UNIT_MS, 0 is infinite */
+	uint16_t idle_ms;	/* Time since the report last went out */
+	uint8_t data[USB_HID_MAX_REPORT_SIZE];
+	uint16_t len;
+};
+
+/** One HID interface, allocated by the caller and set up by
+ * @ref usb_hid_init.  The members are private to the class layer. */
+struct _usbd_hid {
+	usbd_device *usbd_dev;
+	uint8_t iface;
+	uint8_t ep_in;
+	uint16_t ep_in_size;
+	const uint8_t *report_descriptor;
+	uint16_t report_descriptor_len;
+	usbd_hid_in_complete_callback in_complete;
+	usbd_hid_output_report_callback output_report;
+
+	uint8_t protocol;
+	uint8_t default_idle;
+	bool report_ids;
+	bool busy;
+
+	/* Indexed by report ID, slot 0 when report IDs are not in use */
+	struct usb_hid_report_state report[USB_HID_MAX_REPORT_IDS];
+
+	/* Next interface set up with usb_hid_init() */
+	usbd_hid *next;
+};
+
+usbd_hid *usb_hid_init(usbd_hid *hid, usbd_device *usbd_dev, uint8_t iface,
+		       uint8_t ep_in, uint16_t ep_in_size,
+		       const uint8_t *report_descriptor,
+		       uint16_t report_descriptor_len,
+		       usbd_hid_in_complete_callback in_complete,
+		       usbd_hid_output_report_callback output_report);
+
+void usb_hid_use_report_ids(usbd_hid *hid, bool report_ids);
+
+void usb_hid_set_default_idle(usbd_hid *hid, uint8_t idle_rate);
+
+enum usb_hid_send_status usb_hid_send_report(usbd_hid *hid,
+					     const uint8_t *report,
+					     uint16_t len);
+
+enum usb_hid_send_status usb_hid_send_event(usbd_hid *hid,
+					    const uint8_t *report,
+					    uint16_t len);
+
+void usb_hid_idle_tick(usbd_hid *hid, uint16_t elapsed_ms);
+
+uint8_t usb_hid_get_protocol(const usbd_hid *hid);
+
 #endif
 
 /**@}*/
@@ -55,15 +55,38 @@ enum usbd_request_return_codes {
 typedef struct _usbd_driver usbd_driver;
 typedef struct _usbd_device usbd_device;
 
+/* Size of usbd_device_storage in pointers, which is enough for the default
+ * USBD_QUEUE_POOL_SIZE.  usb.c refuses to build if it is too small. */
+#ifndef USBD_DEVICE_STORAGE_PTRS
+#define USBD_DEVICE_STORAGE_PTRS 320
+#endif
+
+/** Room for one usbd_device, see @ref usbd_init_with_storage */
+typedef struct {
+	void *opaque[USBD_DEVICE_STORAGE_PTRS];
+} usbd_device_storage;
+
 extern const usbd_driver st_usbfs_v1_usb_driver;
 extern const usbd_driver stm32f107_usb_driver;
 extern const usbd_driver stm32f207_usb_driver;
+/* OTG_HS in buffer DMA mode: word aligned usbd_ep_transfer_in/out() buffers
+ * go straight to the core, and must be in memory its DMA can reach and
+ * coherent with the data cache where there is one. */
+extern const usbd_driver stm32f207_usb_dma_driver;
 extern const usbd_driver st_usbfs_v2_usb_driver;
 #define otgfs_usb_driver stm32f107_usb_driver
 #define otghs_usb_driver stm32f207_usb_driver
+#define otghs_usb_dma_driver stm32f207_usb_dma_driver
 extern const usbd_driver efm32lg_usb_driver;
 extern const usbd_driver efm32hg_usb_driver;
 extern const usbd_driver lm4f_usb_driver;
+/* LM4F with the uDMA moving the whole packets of usbd_ep_transfer_in/out()
+ * on endpoints 1-3, on channels 0-5 of the uDMA the application has set
+ * up before usbd_init(). */
+extern const usbd_driver lm4f_usb_dma_driver;
+/* USB0 of the LPC43xx, high speed: usbd_ep_transfer_in/out() buffers go
+ * straight to the controller, which reads and writes RAM by itself. */
+extern const usbd_driver lpc43xx_usb_driver;
 
 /* <usb.c> */
 /**
@@ -74,7 +97,14 @@ extern const usbd_driver lm4f_usb_driver;
  *
  * It is required that the 48MHz USB clock is already available.
  *
- * @param driver TODO
+ * All state of the device lives in the instance returned, taken from a
+ * small pool with one entry per driver in use: USBD_DEFAULT_DEVICES, two on
+ * parts with both OTG_FS and OTG_HS, which can then run side by side, each
+ * polled with its own handle.  Calling usbd_init() again with the same
+ * driver reinitialises that driver's device.  For storage of your own, see
+ * @ref usbd_init_with_storage.
+ *
+ * @param driver Driver for the USB peripheral to use, e.g. st_usbfs_v1_usb_driver
  * @param dev Pointer to USB device descriptor. This must not be changed while
  *            the device is in use.
  * @param conf Pointer to array of USB configuration descriptors. These must
@@ -90,7 +120,8 @@ extern const usbd_driver lm4f_usb_driver;
  *                       received during control requests with DATA
  *                       stage
  * @param control_buffer_size Size of control_buffer
- * @return the usb device initialized for use. (currently cannot fail).
+ * @return the usb device initialized for use, or NULL if the pool is used up
+ *	or the driver failed to bring up the peripheral.
  *
  * To place @a strings entirely into Flash/read-only memory, use
  * @code static const * const strings[] = { ... }; @endcode
@@ -104,6 +135,23 @@ extern usbd_device * usbd_init(const usbd_driver *driver,
 			       uint8_t *control_buffer,
 			       uint16_t control_buffer_size);
 
+/** Initialization as @ref usbd_init, in storage the caller provides
+ *
+ * For more than one device on the same driver, or to place the device where
+ * the application wants it.  The storage must stay valid while the device
+ * is in use.
+ * @param storage Room for the device, its previous content is discarded
+ * @return the usb device, which lives in @a storage, or NULL if the driver
+ *	failed to bring up the peripheral
+ */
+extern usbd_device *usbd_init_with_storage(usbd_device_storage *storage,
+			       const usbd_driver *driver,
+			       const struct usb_device_descriptor *dev,
+			       const struct usb_config_descriptor *conf,
+			       const char * const *strings, int num_strings,
+			       uint8_t *control_buffer,
+			       uint16_t control_buffer_size);
+
 /** Registers a reset callback */
 extern void usbd_register_reset_callback(usbd_device *usbd_dev,
 					 void (*callback)(void));
@@ -137,6 +185,47 @@ typedef void (*usbd_set_altsetting_callback)(usbd_device *usbd_dev,
 
 typedef void (*usbd_endpoint_callback)(usbd_device *usbd_dev, uint8_t ep);
 
+/** Called once a transfer started with @ref usbd_ep_transfer_in or
+ * @ref usbd_ep_transfer_out is over
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param ep endpoint address, with the direction bit
+ * @param len number of bytes transferred
+ */
+typedef void (*usbd_transfer_complete_callback)(usbd_device *usbd_dev,
+		uint8_t ep, uint16_t len);
+
+/** Supplies part of the data stage of a control IN transfer
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param req the request being answered
+ * @param offset position in the data stage of the first byte wanted
+ * @param buf where to put the bytes
+ * @param len number of bytes wanted, at most bMaxPacketSize0
+ * @return false to stall the transfer
+ */
+typedef bool (*usbd_control_source_callback)(usbd_device *usbd_dev,
+		struct usb_setup_data *req, uint16_t offset, uint8_t *buf,
+		uint16_t len);
+
+/** Takes the data stage of a control OUT transfer as it arrives
+ *
+ * Called once when the SETUP packet arrives, with @a buf NULL and @a len 0,
+ * then once for each packet of the data stage.  On the first call, return
+ * USBD_REQ_NEXT_CALLBACK to leave the request to the next sink or to the
+ * control callbacks, USBD_REQ_NOTSUPP to stall it, or USBD_REQ_HANDLED to
+ * take its data.  Later calls stall the transfer unless they return
+ * USBD_REQ_HANDLED.  The status stage follows the last packet.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param req the request being received
+ * @param offset position in the data stage of the first byte of @a buf
+ * @param buf the packet, at most bMaxPacketSize0 bytes
+ * @param len number of bytes in @a buf
+ * @param complete may be set to a callback run after the status stage
+ */
+typedef enum usbd_request_return_codes (*usbd_control_sink_callback)(
+		usbd_device *usbd_dev, struct usb_setup_data *req,
+		uint16_t offset, const uint8_t *buf, uint16_t len,
+		usbd_control_complete_callback *complete);
+
 /* <usb_control.c> */
 /** Registers a control callback.
  *
@@ -156,6 +245,38 @@ extern int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
 					  uint8_t type_mask,
 					  usbd_control_callback callback);
 
+/** Pulls the data stage of the current IN request from a callback
+ *
+ * Called from a control callback, which then returns USBD_REQ_HANDLED with
+ * @a len set to the length of the data stage and @a buf left alone.  Each
+ * packet is then asked of @a source just before it is sent, into the
+ * control buffer, so responses can be assembled piecewise or streamed from
+ * flash with a control buffer of only bMaxPacketSize0 bytes.  The source
+ * is dropped if the callback returns anything but USBD_REQ_HANDLED.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param source callback filling in each packet
+ */
+extern void usbd_control_set_source(usbd_device *usbd_dev,
+				    usbd_control_source_callback source);
+
+/** Registers a sink for control OUT data stages.
+ *
+ * Requests matched by a sink are handed to it a packet at a time instead
+ * of being collected in the control buffer first, so their wLength is not
+ * limited by the size of that buffer.  Sinks are cleared together with the
+ * control callbacks when the configuration is set, and matched on the
+ * request type in the same way.
+ * @sa usbd_control_sink_callback
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param type Handled request type
+ * @param type_mask Mask to apply before matching request type
+ * @param sink your desired callback function
+ * @return 0 if successful
+ */
+extern int usbd_register_control_sink(usbd_device *usbd_dev, uint8_t type,
+				      uint8_t type_mask,
+				      usbd_control_sink_callback sink);
+
 /* <usb_standard.c> */
 /** Registers a "Set Config" callback
  * @param usbd_dev the usb device handle returned from @ref usbd_init
@@ -172,12 +293,57 @@ extern int usbd_register_set_config_callback(usbd_device *usbd_dev,
 extern void usbd_register_set_altsetting_callback(usbd_device *usbd_dev,
 					usbd_set_altsetting_callback callback);
 
+/** Serializes the configuration descriptors once, for GET_DESCRIPTOR
+ *
+ * Every configuration given to @ref usbd_init is copied into @a buf, one
+ * after the other and with wTotalLength filled in, and GET_DESCRIPTOR
+ * (CONFIGURATION) is then answered straight from there instead of walking
+ * the descriptor tree into the control buffer on every request.  The
+ * descriptors must not change afterwards; call this again if they do.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param buf memory for the serialized descriptors, kept by the stack
+ * @param len size of @a buf
+ * @return bytes of @a buf used, or 0 if the descriptors do not fit, in which
+ * case they go on being built for each request.
+ */
+extern uint16_t usbd_register_config_cache(usbd_device *usbd_dev,
+					   uint8_t *buf, uint16_t len);
+
+/** Registers configuration descriptors serialized at build time
+ *
+ * @a descriptors holds every configuration given to @ref usbd_init, one
+ * after the other, as built with the macros of usbdesc.h.  GET_DESCRIPTOR
+ * (CONFIGURATION) is answered straight from it, so it can stay in flash.
+ * The structures passed to @ref usbd_init are still used to handle
+ * SET_CONFIGURATION and SET_INTERFACE and must describe the same
+ * interfaces.  Unless NDEBUG is defined, each configuration is checked with
+ * cm3_assert() for bNumInterfaces and bNumEndpoints matching the
+ * descriptors that follow, and for interface numbers counting up from 0.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param descriptors the serialized configurations
+ */
+extern void usbd_register_config_descriptors(usbd_device *usbd_dev,
+					     const uint8_t *descriptors);
+
 /** Registers a non-contiguous string descriptor */
 extern void usbd_register_extra_string(usbd_device *usbd_dev, int index, const char* string);
 
 /* Functions to be provided by the hardware abstraction layer */
 extern void usbd_poll(usbd_device *usbd_dev);
 
+/** Sets how many transfer events one call to @ref usbd_poll handles
+ *
+ * By default each call handles at most one completed transfer, leaving the
+ * rest for the next call.  A larger budget lets a single call, or a single
+ * USB interrupt, work through every transfer that completed meanwhile, up
+ * to @a budget of them, which saves re-entering the poll under bulk load.
+ * Bus reset still ends the call early.  Honoured by the st_usbfs and DWC
+ * OTG drivers, others handle one event per call regardless.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param budget transfer events per call, at least 1
+ */
+extern void usbd_set_poll_budget(usbd_device *usbd_dev, uint8_t budget);
+
 /** Disconnect, if supported by the driver
  *
  * This function is implemented as weak function and can be replaced by an
@@ -242,6 +408,121 @@ extern uint8_t usbd_ep_stall_get(usbd_device *usbd_dev, uint8_t addr);
  */
 extern void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak);
 
+/** Ask for a double buffered bulk endpoint
+ *
+ * The hardware can then take the next packet while firmware copies the
+ * last one, rather than NAK the host meanwhile.  Only st_usbfs does it, and
+ * the endpoint takes both halves of its buffer table entry there, so its
+ * number must not be used in the other direction.  Takes effect at the
+ * next @ref usbd_ep_setup of the endpoint.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param addr EP address
+ * @param enable true for double buffering
+ * @return true if the driver can double buffer endpoints
+ */
+extern bool usbd_ep_double_buffer(usbd_device *usbd_dev, uint8_t addr,
+		bool enable);
+
+/** Largest endpoint buffer still free
+ *
+ * On st_usbfs, packet memory is held per endpoint from its
+ * @ref usbd_ep_setup until the next SET_CONFIGURATION or bus reset, and
+ * setting an endpoint up again reuses its memory when the new buffers fit.
+ * An endpoint that does not fit is left disabled.  Double buffered and
+ * isochronous endpoints need twice their packet size.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @return bytes in the largest free block, or 0xffff if the driver does
+ * not keep count
+ */
+extern uint16_t usbd_ep_memory_free(usbd_device *usbd_dev);
+
+/** Send a buffer on an IN endpoint, as many packets as it takes
+ *
+ * The packets are written from the endpoint's callback as each one goes,
+ * or all at once by drivers that can (OTG_HS with DMA), the callback is put
+ * back once the transfer is over, and complete is called.  The
+ * buffer must stay valid until then.  Setting up the endpoint again drops
+ * the transfer without calling complete.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param addr EP address, not 0
+ * @param buf data to send
+ * @param len # of bytes, 0 sends a zero length packet
+ * @param zlp end with a zero length packet if len is a multiple of the
+ *	packet size, for hosts that do not know how much to expect
+ * @param complete called when the last packet has gone, or NULL
+ * @return false if a transfer is already in progress on the endpoint, or
+ *	it is not set up
+ */
+extern bool usbd_ep_transfer_in(usbd_device *usbd_dev, uint8_t addr,
+		const void *buf, uint16_t len, bool zlp,
+		usbd_transfer_complete_callback complete);
+
+/** Receive into a buffer on an OUT endpoint, as many packets as it takes
+ *
+ * The transfer is over once len bytes or a short packet came in.  A packet
+ * that does not fit in what is left of the buffer is cut short, so len
+ * should be a multiple of the packet size.  Otherwise as
+ * @ref usbd_ep_transfer_in, and DWC cores take the packets after the first
+ * one in a single hardware transfer, with DMA straight into buf if it is
+ * word aligned.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param addr EP address, not 0
+ * @param buf where to put the data
+ * @param len size of buf
+ * @param complete called with the number of bytes received, or NULL
+ * @return false if a transfer is already in progress on the endpoint, or
+ *	it is not set up
+ */
+extern bool usbd_ep_transfer_out(usbd_device *usbd_dev, uint8_t addr,
+		void *buf, uint16_t len,
+		usbd_transfer_complete_callback complete);
+
+/** Queue a transfer on an IN endpoint
+ *
+ * The endpoint works through its queue in order, starting each request
+ * with @ref usbd_ep_transfer_in from the completion of the one before, so it
+ * never waits on the caller.  Requests come from a pool of
+ * USBD_QUEUE_POOL_SIZE shared by all endpoints.  Like the rest of the
+ * stack, call this from the context that runs @ref usbd_poll or one that
+ * cannot interrupt it.  Setting up the endpoint again, a bus reset or
+ * SET_CONFIGURATION drops the queue without calling complete.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param addr EP address, not 0
+ * @param buf data to send, valid until complete is called
+ * @param len # of bytes
+ * @param zlp as for @ref usbd_ep_transfer_in
+ * @param complete called when the request is done, or NULL
+ * @return false if the pool is empty, the endpoint's queue is full or not
+ *	set up, or a transfer not from the queue is in progress
+ */
+extern bool usbd_ep_queue_in(usbd_device *usbd_dev, uint8_t addr,
+		const void *buf, uint16_t len, bool zlp,
+		usbd_transfer_complete_callback complete);
+
+/** Queue a transfer on an OUT endpoint
+ *
+ * As @ref usbd_ep_queue_in, each request being a @ref usbd_ep_transfer_out.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param addr EP address, not 0
+ * @param buf where to put the data, valid until complete is called
+ * @param len size of buf
+ * @param complete called with the number of bytes received, or NULL
+ * @return false if the request could not be queued
+ */
+extern bool usbd_ep_queue_out(usbd_device *usbd_dev, uint8_t addr,
+		void *buf, uint16_t len,
+		usbd_transfer_complete_callback complete);
+
+/** Limit the number of requests queued on an endpoint
+ *
+ * Keeps one endpoint from taking the whole pool.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param addr Full EP address (with direction bit)
+ * @param depth most requests queued at once, 0 for no limit
+ */
+extern void usbd_ep_set_queue_depth(usbd_device *usbd_dev, uint8_t addr,
+		uint8_t depth);
+
 END_DECLS
 
 #endif
@@ -0,0 +1,133 @@
+/** @defgroup usb_desc_defines USB Descriptor Blobs
+
+@brief <b>Macros building USB descriptors as constant byte arrays</b>
+
+@ingroup USB_defines
+
+@version 1.0.0
+
+LGPL License Terms @ref lgpl_license
+*/
+
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A configuration written with these macros is a single const uint8_t
+ * array, laid out exactly as it goes on the wire, which the stack sends as
+ * it is once registered with usbd_register_config_descriptors():
+ *
+ *	static const uint8_t config_descriptors[] = {
+ *		USB_DESC_CONFIGURATION(1, 1, 0, 0x80, 50,
+ *			USB_DESC_INTERFACE(0, 0, 1, USB_CLASS_VENDOR, 0, 0, 0),
+ *			USB_DESC_ENDPOINT(0x01, USB_ENDPOINT_ATTR_BULK, 64, 0))
+ *	};
+ *
+ * wTotalLength is worked out by the compiler, and fields that can be
+ * checked on their own are: a bad endpoint address, packet size, interval
+ * or configuration attribute fails the build with a negative bit-field
+ * width.  Interface numbers are best taken from an enum that also gives
+ * bNumInterfaces, so they cannot drift apart.
+ *
+ * Counts across descriptors are not constant expressions over a byte list,
+ * so bNumInterfaces, bNumEndpoints and the interface numbering are checked
+ * when the blob is registered, see usbd_register_config_descriptors().
+ *
+ * Arguments may not contain preprocessor directives.  Optional parts of a
+ * configuration go in a macro that is empty when they are left out, and
+ * starts with a comma otherwise.
+ */
+
+/**@{*/
+
+#ifndef __USBDESC_H
+#define __USBDESC_H
+
+#include <stdint.h>
+#include <libopencm3/usb/usbstd.h>
+
+/** Zero, or a compile error if @a cond is false. */
+#define USB_DESC_CHECK(cond) \
+	(0 * sizeof(struct { int usb_desc_check : (cond) ? 1 : -1; }))
+
+/** A 16 bit field, little endian. */
+#define USB_DESC_U16(x)		((x) & 0xff), (((x) >> 8) & 0xff)
+
+/** Bytes taken by the descriptors given as arguments. */
+#define USB_DESC_SIZE(...)	sizeof((const uint8_t[]){ __VA_ARGS__ })
+
+/** Configuration descriptor followed by everything in it, the variable
+ * arguments. */
+#define USB_DESC_CONFIGURATION(num_interfaces, value, iconfiguration, \
+			       attributes, max_power, ...) \
+	USB_DT_CONFIGURATION_SIZE, USB_DT_CONFIGURATION, \
+	USB_DESC_U16(USB_DT_CONFIGURATION_SIZE + \
+		     USB_DESC_SIZE(__VA_ARGS__) + \
+		     USB_DESC_CHECK(USB_DT_CONFIGURATION_SIZE + \
+				    USB_DESC_SIZE(__VA_ARGS__) <= 0xffff)), \
+	(num_interfaces) + USB_DESC_CHECK((num_interfaces) > 0), \
+	(value) + USB_DESC_CHECK((value) > 0), \
+	(iconfiguration), \
+	/* Bit 7 is reserved and must be set. */ \
+	(attributes) + USB_DESC_CHECK(((attributes) & 0x9f) == 0x80), \
+	(max_power), \
+	__VA_ARGS__
+
+#define USB_DESC_INTERFACE(number, alternate, num_endpoints, class, \
+			   subclass, protocol, iinterface) \
+	USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, \
+	(number), (alternate), \
+	(num_endpoints) + USB_DESC_CHECK((num_endpoints) < 31), \
+	(class), (subclass), (protocol), (iinterface)
+
+#define USB_DESC_IFACE_ASSOC(first_interface, interface_count, class, \
+			     subclass, protocol, ifunction) \
+	USB_DT_INTERFACE_ASSOCIATION_SIZE, USB_DT_INTERFACE_ASSOCIATION, \
+	(first_interface), \
+	(interface_count) + USB_DESC_CHECK((interface_count) > 0), \
+	(class), (subclass), (protocol), (ifunction)
+
+/** Endpoint descriptor.  The address is a number from 1 to 15, ORed with
+ * 0x80 for IN; packet sizes are checked against the limits of the
+ * transfer type and interrupt endpoints need a non zero interval. */
+#define USB_DESC_ENDPOINT(address, attributes, max_packet, interval) \
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, \
+	(address) + USB_DESC_CHECK(((address) & 0x70) == 0 && \
+				   ((address) & 0x0f) != 0), \
+	(attributes), \
+	USB_DESC_U16((max_packet) + \
+		     USB_DESC_CHECK(USB_DESC_PACKET_OK(attributes, \
+						       max_packet))), \
+	(interval) + USB_DESC_CHECK( \
+		((attributes) & USB_ENDPOINT_ATTR_TYPE) != \
+		USB_ENDPOINT_ATTR_INTERRUPT || (interval) > 0)
+
+/* Largest packets: control 64, bulk 512, interrupt 1024, isochronous 1023
+ * (high speed limits, full speed devices must stay below them). */
+#define USB_DESC_PACKET_OK(attributes, max_packet) \
+	((max_packet) > 0 && \
+	 (((attributes) & USB_ENDPOINT_ATTR_TYPE) == \
+	  USB_ENDPOINT_ATTR_CONTROL ? (max_packet) <= 64 : \
+	  ((attributes) & USB_ENDPOINT_ATTR_TYPE) == \
+	  USB_ENDPOINT_ATTR_BULK ? (max_packet) <= 512 : \
+	  ((attributes) & USB_ENDPOINT_ATTR_TYPE) == \
+	  USB_ENDPOINT_ATTR_ISOCHRONOUS ? (max_packet) <= 1023 : \
+	  (max_packet) <= 1024))
+
+#endif
+
+/**@}*/
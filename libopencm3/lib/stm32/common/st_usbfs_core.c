@@ -18,6 +18,7 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include <libopencm3/cm3/common.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/tools.h>
@@ -27,10 +28,6 @@
 #include "../../usb/usb_private.h"
 #include "st_usbfs_core.h"
 
-/* TODO - can't these be inside the impls, not globals from the core? */
-uint8_t st_usbfs_force_nak[8];
-struct _usbd_device st_usbfs_dev;
-
 void st_usbfs_set_address(usbd_device *dev, uint8_t addr)
 {
 	(void)dev;
@@ -78,6 +75,156 @@ uint16_t st_usbfs_set_ep_rx_bufsize(usbd_device *dev, uint8_t ep, uint32_t size)
 	return realsize;
 }
 
+/* Double buffered bulk endpoints have EP_KIND set. */
+static bool st_usbfs_ep_is_double(uint8_t ep)
+{
+	return (*USB_EP_REG(ep) & (USB_EP_TYPE | USB_EP_KIND)) ==
+	       (USB_EP_TYPE_BULK | USB_EP_KIND);
+}
+
+static bool st_usbfs_ep_is_iso(uint8_t ep)
+{
+	return (*USB_EP_REG(ep) & USB_EP_TYPE) == USB_EP_TYPE_ISO;
+}
+
+/*
+ * Packet memory above the buffer table is handed out in one block per
+ * endpoint and direction.  An endpoint set up again keeps its block if the
+ * new buffers fit, so switching alternate settings does not eat into
+ * memory, and otherwise moves to the first gap big enough.  Returns the
+ * block's address, or 0 if there is no room.
+ */
+static uint16_t st_usbfs_pm_alloc(usbd_device *dev, uint8_t ep, uint8_t dir,
+				  uint16_t size)
+{
+	struct usb_pm_block *block = &dev->pm_block[ep][dir];
+	uint16_t addr = USBD_PM_TOP;
+	int i;
+
+	/* Buffers start on a halfword. */
+	size = (size + 1) & ~1;
+	if (block->size >= size) {
+		return block->addr;
+	}
+	block->size = 0;
+
+	/* Move past every block in the way, until none is. */
+	for (i = 0; i < 16; i++) {
+		const struct usb_pm_block *other = &dev->pm_block[i / 2][i % 2];
+
+		if (other->size && addr < other->addr + other->size &&
+		    other->addr < addr + size) {
+			addr = other->addr + other->size;
+			i = -1;
+		}
+	}
+
+	if (addr + size > USB_PMA_SIZE) {
+		return 0;
+	}
+	block->addr = addr;
+	block->size = size;
+	return addr;
+}
+
+/** Largest buffer left in packet memory. */
+uint16_t st_usbfs_ep_memory_free(usbd_device *dev)
+{
+	uint16_t largest = 0;
+	int i, j;
+
+	/* Gaps start at the buffer table or at the end of a block. */
+	for (i = -1; i < 16; i++) {
+		uint16_t start = USBD_PM_TOP;
+		uint16_t end = USB_PMA_SIZE;
+
+		if (i >= 0) {
+			const struct usb_pm_block *block =
+				&dev->pm_block[i / 2][i % 2];
+
+			if (!block->size) {
+				continue;
+			}
+			start = block->addr + block->size;
+		}
+		for (j = 0; j < 16; j++) {
+			const struct usb_pm_block *other =
+				&dev->pm_block[j / 2][j % 2];
+
+			if (!other->size) {
+				continue;
+			}
+			if (other->addr <= start &&
+			    start < other->addr + other->size) {
+				end = start;
+				break;
+			}
+			if (other->addr > start && other->addr < end) {
+				end = other->addr;
+			}
+		}
+		if (end > start && end - start > largest) {
+			largest = end - start;
+		}
+	}
+
+	return largest;
+}
+
+/*
+ * Buffer 0 of a double buffered endpoint is described by the TX half of its
+ * buffer table entry, buffer 1 by the RX half.  Isochronous endpoints are
+ * always double buffered, the same way.
+ */
+static bool st_usbfs_ep_setup_double(usbd_device *dev, uint8_t addr,
+				     uint8_t dir, uint16_t max_size)
+{
+	uint16_t pm;
+
+	if (dir) {
+		const uint16_t size = (max_size + 1) & ~1;
+
+		pm = st_usbfs_pm_alloc(dev, addr, USB_TRANSACTION_IN, 2 * size);
+		if (!pm) {
+			return false;
+		}
+		USB_SET_EP_TX_ADDR(addr, pm);
+		USB_SET_EP_RX_ADDR(addr, pm + size);
+		USB_SET_EP_TX_COUNT(addr, 0);
+		USB_SET_EP_RX_COUNT(addr, 0);
+		/* DTOG equal to SW_BUF: nothing to send yet. */
+		USB_CLR_EP_TX_DTOG(addr);
+		USB_CLR_EP_RX_DTOG(addr);
+		dev->dbuf_pending &= ~(1 << addr);
+		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_DISABLED);
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_VALID);
+	} else {
+		uint16_t realsize = st_usbfs_set_ep_rx_bufsize(dev, addr,
+							       max_size);
+
+		pm = st_usbfs_pm_alloc(dev, addr, USB_TRANSACTION_OUT,
+				       2 * realsize);
+		if (!pm) {
+			return false;
+		}
+		USB_SET_EP_TX_ADDR(addr, pm);
+		USB_SET_EP_TX_COUNT(addr, USB_GET_EP_RX_COUNT(addr));
+		USB_SET_EP_RX_ADDR(addr, pm + realsize);
+		/* The hardware fills buffer 0 first, we hold buffer 1. */
+		USB_CLR_EP_RX_DTOG(addr);
+		USB_CLR_EP_TX_DTOG(addr);
+		USB_TOG_EP_SW_BUF_RX(addr);
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_DISABLED);
+		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
+	}
+
+	return true;
+}
+
+/*
+ * An endpoint whose buffers do not fit in packet memory is left disabled,
+ * without its callback, see st_usbfs_ep_memory_free().
+ */
 void st_usbfs_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
 		uint16_t max_size,
 		void (*callback) (usbd_device *usbd_dev,
@@ -91,32 +238,65 @@ void st_usbfs_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
 		[USB_ENDPOINT_ATTR_INTERRUPT] = USB_EP_TYPE_INTERRUPT,
 	};
 	uint8_t dir = addr & 0x80;
+	uint16_t pm;
 	addr &= 0x7f;
 
 	/* Assign address. */
 	USB_SET_EP_ADDR(addr, addr);
 	USB_SET_EP_TYPE(addr, typelookup[type]);
 
+	if ((type == USB_ENDPOINT_ATTR_ISOCHRONOUS) ||
+	    ((type == USB_ENDPOINT_ATTR_BULK) &&
+	     (dev->double_buffer & (1 << addr)))) {
+		/* EP_KIND is DBL_BUF for bulk, unused for isochronous. */
+		if (type == USB_ENDPOINT_ATTR_BULK) {
+			USB_SET_EP_KIND(addr);
+		} else {
+			USB_CLR_EP_KIND(addr);
+		}
+		if (!st_usbfs_ep_setup_double(dev, addr, dir, max_size)) {
+			USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_DISABLED);
+			USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_DISABLED);
+			return;
+		}
+		if (callback) {
+			dev->user_callback_ctr[addr][dir ? USB_TRANSACTION_IN :
+					       USB_TRANSACTION_OUT] = callback;
+		}
+		return;
+	}
+	if (addr != 0) {
+		USB_CLR_EP_KIND(addr);
+	}
+
 	if (dir || (addr == 0)) {
-		USB_SET_EP_TX_ADDR(addr, dev->pm_top);
+		pm = st_usbfs_pm_alloc(dev, addr, USB_TRANSACTION_IN, max_size);
+		if (!pm) {
+			USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_DISABLED);
+			return;
+		}
+		USB_SET_EP_TX_ADDR(addr, pm);
 		if (callback) {
 			dev->user_callback_ctr[addr][USB_TRANSACTION_IN] = callback;
 		}
 		USB_CLR_EP_TX_DTOG(addr);
 		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_NAK);
-		dev->pm_top += max_size;
 	}
 
 	if (!dir) {
 		uint16_t realsize;
-		USB_SET_EP_RX_ADDR(addr, dev->pm_top);
 		realsize = st_usbfs_set_ep_rx_bufsize(dev, addr, max_size);
+		pm = st_usbfs_pm_alloc(dev, addr, USB_TRANSACTION_OUT, realsize);
+		if (!pm) {
+			USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_DISABLED);
+			return;
+		}
+		USB_SET_EP_RX_ADDR(addr, pm);
 		if (callback) {
 			dev->user_callback_ctr[addr][USB_TRANSACTION_OUT] = callback;
 		}
 		USB_CLR_EP_RX_DTOG(addr);
 		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
-		dev->pm_top += realsize;
 	}
 }
 
@@ -124,18 +304,24 @@ void st_usbfs_endpoints_reset(usbd_device *dev)
 {
 	int i;
 
-	/* Reset all endpoints. */
+	/* Reset all endpoints, keeping only endpoint 0's buffers. */
 	for (i = 1; i < 8; i++) {
 		USB_SET_EP_TX_STAT(i, USB_EP_TX_STAT_DISABLED);
 		USB_SET_EP_RX_STAT(i, USB_EP_RX_STAT_DISABLED);
+		dev->pm_block[i][USB_TRANSACTION_IN].size = 0;
+		dev->pm_block[i][USB_TRANSACTION_OUT].size = 0;
 	}
-	dev->pm_top = USBD_PM_TOP + (2 * dev->desc->bMaxPacketSize0);
+	dev->dbuf_pending = 0;
 }
 
 void st_usbfs_ep_stall_set(usbd_device *dev, uint8_t addr,
 				   uint8_t stall)
 {
-	(void)dev;
+	/* Isochronous endpoints have no handshake, so cannot stall. */
+	if (st_usbfs_ep_is_iso(addr & 0x7F)) {
+		return;
+	}
+
 	if (addr == 0) {
 		USB_SET_EP_TX_STAT(addr, stall ? USB_EP_TX_STAT_STALL :
 				   USB_EP_TX_STAT_NAK);
@@ -144,6 +330,18 @@ void st_usbfs_ep_stall_set(usbd_device *dev, uint8_t addr,
 	if (addr & 0x80) {
 		addr &= 0x7F;
 
+		if (st_usbfs_ep_is_double(addr)) {
+			/* Both buffers empty again, as after setup. */
+			if (!stall) {
+				USB_CLR_EP_TX_DTOG(addr);
+				USB_CLR_EP_RX_DTOG(addr);
+				dev->dbuf_pending &= ~(1 << addr);
+			}
+			USB_SET_EP_TX_STAT(addr, stall ? USB_EP_TX_STAT_STALL :
+					   USB_EP_TX_STAT_VALID);
+			return;
+		}
+
 		USB_SET_EP_TX_STAT(addr, stall ? USB_EP_TX_STAT_STALL :
 				   USB_EP_TX_STAT_NAK);
 
@@ -155,6 +353,10 @@ void st_usbfs_ep_stall_set(usbd_device *dev, uint8_t addr,
 		/* Reset to DATA0 if clearing stall condition. */
 		if (!stall) {
 			USB_CLR_EP_RX_DTOG(addr);
+			if (st_usbfs_ep_is_double(addr)) {
+				USB_CLR_EP_TX_DTOG(addr);
+				USB_TOG_EP_SW_BUF_RX(addr);
+			}
 		}
 
 		USB_SET_EP_RX_STAT(addr, stall ? USB_EP_RX_STAT_STALL :
@@ -181,13 +383,12 @@ uint8_t st_usbfs_ep_stall_get(usbd_device *dev, uint8_t addr)
 
 void st_usbfs_ep_nak_set(usbd_device *dev, uint8_t addr, uint8_t nak)
 {
-	(void)dev;
 	/* It does not make sense to force NAK on IN endpoints. */
 	if (addr & 0x80) {
 		return;
 	}
 
-	st_usbfs_force_nak[addr] = nak;
+	dev->force_nak[addr] = nak;
 
 	if (nak) {
 		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_NAK);
@@ -196,12 +397,114 @@ void st_usbfs_ep_nak_set(usbd_device *dev, uint8_t addr, uint8_t nak)
 	}
 }
 
+/*
+ * Fill the buffer SW_BUF points at.  If the hardware is idle, hand it over
+ * at once, otherwise st_usbfs_poll() does when the other buffer has gone.
+ */
+static uint16_t st_usbfs_ep_write_double(usbd_device *dev, uint8_t ep,
+					 const void *buf, uint16_t len)
+{
+	const uint16_t reg = *USB_EP_REG(ep);
+
+	if (dev->dbuf_pending & (1 << ep)) {
+		return 0;
+	}
+
+	if (reg & USB_EP_SW_BUF_TX) {
+		st_usbfs_copy_to_pm(USB_GET_EP_RX_BUFF(ep), buf, len);
+		USB_SET_EP_RX_COUNT(ep, len);
+	} else {
+		st_usbfs_copy_to_pm(USB_GET_EP_TX_BUFF(ep), buf, len);
+		USB_SET_EP_TX_COUNT(ep, len);
+	}
+
+	if (!(reg & USB_EP_TX_DTOG) == !(reg & USB_EP_SW_BUF_TX)) {
+		USB_TOG_EP_SW_BUF_TX(ep);
+	} else {
+		dev->dbuf_pending |= 1 << ep;
+	}
+
+	return len;
+}
+
+/*
+ * Hand the buffer we hold back to the hardware and take the one it has
+ * just filled, then read it.  The hardware NAKs while it has no buffer.
+ */
+static uint16_t st_usbfs_ep_read_double(uint8_t ep, void *buf, uint16_t len)
+{
+	if (!(*USB_EP_REG(ep) & USB_EP_RX_CTR)) {
+		return 0;
+	}
+
+	USB_CLR_EP_RX_CTR(ep);
+	USB_TOG_EP_SW_BUF_RX(ep);
+
+	if (*USB_EP_REG(ep) & USB_EP_SW_BUF_RX) {
+		len = MIN(USB_GET_EP_RX_COUNT(ep) & 0x3ff, len);
+		st_usbfs_copy_from_pm(buf, USB_GET_EP_RX_BUFF(ep), len);
+	} else {
+		len = MIN(USB_GET_EP_TX_COUNT(ep) & 0x3ff, len);
+		st_usbfs_copy_from_pm(buf, USB_GET_EP_TX_BUFF(ep), len);
+	}
+
+	return len;
+}
+
+/*
+ * The hardware sends whatever the buffer DTOG_TX points at holds in the
+ * next frame, so fill the other one.  It toggles DTOG_TX every frame.
+ */
+static uint16_t st_usbfs_ep_write_iso(uint8_t ep, const void *buf,
+				      uint16_t len)
+{
+	if (*USB_EP_REG(ep) & USB_EP_TX_DTOG) {
+		st_usbfs_copy_to_pm(USB_GET_EP_TX_BUFF(ep), buf, len);
+		USB_SET_EP_TX_COUNT(ep, len);
+	} else {
+		st_usbfs_copy_to_pm(USB_GET_EP_RX_BUFF(ep), buf, len);
+		USB_SET_EP_RX_COUNT(ep, len);
+	}
+
+	return len;
+}
+
+/*
+ * Read the buffer the hardware filled in the last frame, DTOG_RX already
+ * points at the other one.  There is no NAK, a packet not read before the
+ * next one arrives is lost.
+ */
+static uint16_t st_usbfs_ep_read_iso(uint8_t ep, void *buf, uint16_t len)
+{
+	if (!(*USB_EP_REG(ep) & USB_EP_RX_CTR)) {
+		return 0;
+	}
+
+	USB_CLR_EP_RX_CTR(ep);
+
+	if (*USB_EP_REG(ep) & USB_EP_RX_DTOG) {
+		len = MIN(USB_GET_EP_TX_COUNT(ep) & 0x3ff, len);
+		st_usbfs_copy_from_pm(buf, USB_GET_EP_TX_BUFF(ep), len);
+	} else {
+		len = MIN(USB_GET_EP_RX_COUNT(ep) & 0x3ff, len);
+		st_usbfs_copy_from_pm(buf, USB_GET_EP_RX_BUFF(ep), len);
+	}
+
+	return len;
+}
+
 uint16_t st_usbfs_ep_write_packet(usbd_device *dev, uint8_t addr,
 				     const void *buf, uint16_t len)
 {
-	(void)dev;
 	addr &= 0x7F;
 
+	if (st_usbfs_ep_is_double(addr)) {
+		return st_usbfs_ep_write_double(dev, addr, buf, len);
+	}
+	if (st_usbfs_ep_is_iso(addr)) {
+		return st_usbfs_ep_write_iso(addr, buf, len);
+	}
+
 	if ((*USB_EP_REG(addr) & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID) {
 		return 0;
 	}
@@ -213,10 +516,29 @@ uint16_t st_usbfs_ep_write_packet(usbd_device *dev, uint8_t addr,
 	return len;
 }
 
+bool st_usbfs_ep_in_busy(usbd_device *dev, uint8_t addr)
+{
+	addr &= 0x7F;
+
+	if (st_usbfs_ep_is_double(addr)) {
+		return dev->dbuf_pending & (1 << addr);
+	}
+	if (st_usbfs_ep_is_iso(addr)) {
+		return false;
+	}
+	return (*USB_EP_REG(addr) & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID;
+}
+
 uint16_t st_usbfs_ep_read_packet(usbd_device *dev, uint8_t addr,
 					 void *buf, uint16_t len)
 {
-	(void)dev;
+	if (st_usbfs_ep_is_double(addr)) {
+		return st_usbfs_ep_read_double(addr, buf, len);
+	}
+	if (st_usbfs_ep_is_iso(addr)) {
+		return st_usbfs_ep_read_iso(addr, buf, len);
+	}
+
 	if ((*USB_EP_REG(addr) & USB_EP_RX_STAT) == USB_EP_RX_STAT_VALID) {
 		return 0;
 	}
@@ -225,7 +547,7 @@ uint16_t st_usbfs_ep_read_packet(usbd_device *dev, uint8_t addr,
 	st_usbfs_copy_from_pm(buf, USB_GET_EP_RX_BUFF(addr), len);
 	USB_CLR_EP_RX_CTR(addr);
 
-	if (!st_usbfs_force_nak[addr]) {
+	if (!dev->force_nak[addr]) {
 		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
 	}
 
@@ -238,12 +560,14 @@ void st_usbfs_poll(usbd_device *dev)
 
 	if (istr & USB_ISTR_RESET) {
 		USB_CLR_ISTR_RESET();
-		dev->pm_top = USBD_PM_TOP;
+		memset(dev->pm_block, 0, sizeof(dev->pm_block));
 		_usbd_reset(dev);
 		return;
 	}
 
-	if (istr & USB_ISTR_CTR) {
+	/* Work through completed transfers, up to the budget. */
+	for (uint8_t budget = dev->poll_budget;
+	     (istr & USB_ISTR_CTR) && budget; budget--) {
 		uint8_t ep = istr & USB_ISTR_EP_ID;
 		uint8_t type;
 
@@ -258,6 +582,22 @@ void st_usbfs_poll(usbd_device *dev)
 		} else {
 			type = USB_TRANSACTION_IN;
 			USB_CLR_EP_TX_CTR(ep);
+			/* Send the packet waiting for this buffer to go. */
+			if (dev->dbuf_pending & (1 << ep)) {
+				dev->dbuf_pending &= ~(1 << ep);
+				USB_TOG_EP_SW_BUF_TX(ep);
+			}
+			/*
+			 * Empty the isochronous buffer just sent, so it goes
+			 * as a zero length packet unless refilled in time.
+			 */
+			if (st_usbfs_ep_is_iso(ep)) {
+				if (*USB_EP_REG(ep) & USB_EP_TX_DTOG) {
+					USB_SET_EP_TX_COUNT(ep, 0);
+				} else {
+					USB_SET_EP_RX_COUNT(ep, 0);
+				}
+			}
 		}
 
 		if (dev->user_callback_ctr[ep][type]) {
@@ -265,6 +605,9 @@ void st_usbfs_poll(usbd_device *dev)
 		} else {
 			USB_CLR_EP_RX_CTR(ep);
 		}
+
+		/* EP_ID now shows the next endpoint with CTR set, if any. */
+		istr = *USB_ISTR_REG;
 	}
 
 	if (istr & USB_ISTR_SUSP) {
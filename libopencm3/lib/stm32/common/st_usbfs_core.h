@@ -48,7 +48,9 @@ uint16_t st_usbfs_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 				  const void *buf, uint16_t len);
 uint16_t st_usbfs_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 				 void *buf, uint16_t len);
+bool st_usbfs_ep_in_busy(usbd_device *usbd_dev, uint8_t addr);
 void st_usbfs_poll(usbd_device *usbd_dev);
+uint16_t st_usbfs_ep_memory_free(usbd_device *usbd_dev);
 
 /* These must be implemented by the device specific driver */
 
@@ -70,7 +72,4 @@ void st_usbfs_copy_from_pm(void *buf, const volatile void *vPM, uint16_t len);
  */
 void st_usbfs_copy_to_pm(volatile void *vPM, const void *buf, uint16_t len);
 
-extern uint8_t st_usbfs_force_nak[8];
-extern struct _usbd_device st_usbfs_dev;
-
 #endif
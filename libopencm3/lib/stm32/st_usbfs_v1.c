@@ -26,7 +26,7 @@
 #include "../usb/usb_private.h"
 #include "common/st_usbfs_core.h"
 
-static usbd_device *st_usbfs_v1_usbd_init(void);
+static usbd_device *st_usbfs_v1_usbd_init(usbd_device *usbd_dev);
 
 const struct _usbd_driver st_usbfs_v1_usb_driver = {
 	.init = st_usbfs_v1_usbd_init,
@@ -38,11 +38,14 @@ const struct _usbd_driver st_usbfs_v1_usb_driver = {
 	.ep_nak_set = st_usbfs_ep_nak_set,
 	.ep_write_packet = st_usbfs_ep_write_packet,
 	.ep_read_packet = st_usbfs_ep_read_packet,
+	.ep_in_busy = st_usbfs_ep_in_busy,
 	.poll = st_usbfs_poll,
+	.ep_memory_free = st_usbfs_ep_memory_free,
+	.double_buffer = true,
 };
 
 /** Initialize the USB device controller hardware of the STM32. */
-static usbd_device *st_usbfs_v1_usbd_init(void)
+static usbd_device *st_usbfs_v1_usbd_init(usbd_device *usbd_dev)
 {
 	rcc_periph_clock_enable(RCC_USB);
 	SET_REG(USB_CNTR_REG, 0);
@@ -52,16 +55,51 @@ static usbd_device *st_usbfs_v1_usbd_init(void)
 	/* Enable RESET, SUSPEND, RESUME and CTR interrupts. */
 	SET_REG(USB_CNTR_REG, USB_CNTR_RESETM | USB_CNTR_CTRM |
 		USB_CNTR_SUSPM | USB_CNTR_WKUPM);
-	return &st_usbfs_dev;
+	return usbd_dev;
 }
 
+/*
+ * Packet memory is 16 bits wide, but each halfword takes up a 32 bit slot
+ * on the APB bus.  Word aligned buffers are moved 16 bytes at a time, which
+ * covers a 64 byte packet in four rounds; anything else a halfword at a
+ * time, relying on the unaligned halfword accesses the Cortex-M3 and M4
+ * allow.
+ */
 void st_usbfs_copy_to_pm(volatile void *vPM, const void *buf, uint16_t len)
 {
-	const uint16_t *lbuf = buf;
 	volatile uint32_t *PM = vPM;
-	for (len = (len + 1) >> 1; len; len--) {
+	const uint16_t *lbuf = buf;
+	uint16_t n = len >> 1;
+
+	if (((uintptr_t)buf & 0x03) == 0) {
+		const uint32_t *wbuf = buf;
+
+		for (; n >= 8; n -= 8, wbuf += 4, PM += 8) {
+			const uint32_t w0 = wbuf[0];
+			const uint32_t w1 = wbuf[1];
+			const uint32_t w2 = wbuf[2];
+			const uint32_t w3 = wbuf[3];
+
+			PM[0] = w0;
+			PM[1] = w0 >> 16;
+			PM[2] = w1;
+			PM[3] = w1 >> 16;
+			PM[4] = w2;
+			PM[5] = w2 >> 16;
+			PM[6] = w3;
+			PM[7] = w3 >> 16;
+		}
+		lbuf = (const uint16_t *)wbuf;
+	}
+
+	for (; n; n--) {
 		*PM++ = *lbuf++;
 	}
+
+	/* Don't read past the end of the buffer for the last byte. */
+	if (len & 1) {
+		*PM = *(const uint8_t *)lbuf;
+	}
 }
 
 /**
@@ -73,15 +111,27 @@ void st_usbfs_copy_to_pm(volatile void *vPM, const void *buf, uint16_t len)
  */
 void st_usbfs_copy_from_pm(void *buf, const volatile void *vPM, uint16_t len)
 {
-	uint16_t *lbuf = buf;
 	const volatile uint16_t *PM = vPM;
-	uint8_t odd = len & 1;
+	uint16_t *lbuf = buf;
+	uint16_t n = len >> 1;
+
+	if (((uintptr_t)buf & 0x03) == 0) {
+		uint32_t *wbuf = buf;
+
+		for (; n >= 8; n -= 8, wbuf += 4, PM += 16) {
+			wbuf[0] = PM[0] | ((uint32_t)PM[2] << 16);
+			wbuf[1] = PM[4] | ((uint32_t)PM[6] << 16);
+			wbuf[2] = PM[8] | ((uint32_t)PM[10] << 16);
+			wbuf[3] = PM[12] | ((uint32_t)PM[14] << 16);
+		}
+		lbuf = (uint16_t *)wbuf;
+	}
 
-	for (len >>= 1; len; PM += 2, lbuf++, len--) {
+	for (; n; PM += 2, lbuf++, n--) {
 		*lbuf = *PM;
 	}
 
-	if (odd) {
-		*(uint8_t *) lbuf = *(uint8_t *) PM;
+	if (len & 1) {
+		*(uint8_t *) lbuf = *PM;
 	}
 }
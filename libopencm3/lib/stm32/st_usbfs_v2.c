@@ -28,7 +28,7 @@
 #include "common/st_usbfs_core.h"
 
 /** Initialize the USB device controller hardware of the STM32. */
-static usbd_device *st_usbfs_v2_usbd_init(void)
+static usbd_device *st_usbfs_v2_usbd_init(usbd_device *usbd_dev)
 {
 	rcc_periph_clock_enable(RCC_USB);
 	SET_REG(USB_CNTR_REG, 0);
@@ -39,20 +39,56 @@ static usbd_device *st_usbfs_v2_usbd_init(void)
 	SET_REG(USB_CNTR_REG, USB_CNTR_RESETM | USB_CNTR_CTRM |
 		USB_CNTR_SUSPM | USB_CNTR_WKUPM);
 	SET_REG(USB_BCDR_REG, USB_BCDR_DPPU);
-	return &st_usbfs_dev;
+	return usbd_dev;
 }
 
+/*
+ * Packet memory only takes byte and halfword accesses here, so word access
+ * is limited to our side: word aligned buffers are moved 16 bytes at a
+ * time, which covers a 64 byte packet in four rounds.  Other buffers are
+ * copied a halfword or a byte at a time, as the Cortex-M0(+) can't do
+ * unaligned accesses.
+ */
 void st_usbfs_copy_to_pm(volatile void *vPM, const void *buf, uint16_t len)
 {
-	/*
-	 * This is a bytewise copy, so it always works, even on CM0(+)
-	 * that don't support unaligned accesses.
-	 */
-	const uint8_t *lbuf = buf;
 	volatile uint16_t *PM = vPM;
-	uint32_t i;
-	for (i = 0; i < len; i += 2) {
-		*PM++ = (uint16_t)lbuf[i+1] << 8 | lbuf[i];
+	const uint8_t *lbuf = buf;
+	uint16_t n = len >> 1;
+
+	if (((uintptr_t)buf & 0x03) == 0) {
+		const uint32_t *wbuf = buf;
+
+		for (; n >= 8; n -= 8, wbuf += 4, PM += 8) {
+			const uint32_t w0 = wbuf[0];
+			const uint32_t w1 = wbuf[1];
+			const uint32_t w2 = wbuf[2];
+			const uint32_t w3 = wbuf[3];
+
+			PM[0] = w0;
+			PM[1] = w0 >> 16;
+			PM[2] = w1;
+			PM[3] = w1 >> 16;
+			PM[4] = w2;
+			PM[5] = w2 >> 16;
+			PM[6] = w3;
+			PM[7] = w3 >> 16;
+		}
+		lbuf = (const uint8_t *)wbuf;
+	}
+
+	if (((uintptr_t)lbuf & 0x01) == 0) {
+		for (; n; n--, lbuf += 2) {
+			*PM++ = *(const uint16_t *)lbuf;
+		}
+	} else {
+		for (; n; n--, lbuf += 2) {
+			*PM++ = (uint16_t)lbuf[1] << 8 | lbuf[0];
+		}
+	}
+
+	/* Don't read past the end of the buffer for the last byte. */
+	if (len & 1) {
+		*PM = *lbuf;
 	}
 }
 
@@ -66,25 +102,35 @@ void st_usbfs_copy_to_pm(volatile void *vPM, const void *buf, uint16_t len)
 void st_usbfs_copy_from_pm(void *buf, const volatile void *vPM, uint16_t len)
 {
 	const volatile uint16_t *PM = vPM;
-	uint8_t odd = len & 1;
-	len >>= 1;
+	uint8_t *dest = buf;
+	uint16_t n = len >> 1;
 
-	if (((uintptr_t)buf) & 0x01) {
-		uint8_t *dest = (uint8_t *)buf;
-		for (; len; PM++, len--) {
-			uint16_t value = *PM;
-			*(uint8_t *)dest++ = value;
-			*(uint8_t *)dest++ = value >> 8;
+	if (((uintptr_t)buf & 0x03) == 0) {
+		uint32_t *wbuf = buf;
+
+		for (; n >= 8; n -= 8, wbuf += 4, PM += 8) {
+			wbuf[0] = PM[0] | ((uint32_t)PM[1] << 16);
+			wbuf[1] = PM[2] | ((uint32_t)PM[3] << 16);
+			wbuf[2] = PM[4] | ((uint32_t)PM[5] << 16);
+			wbuf[3] = PM[6] | ((uint32_t)PM[7] << 16);
+		}
+		dest = (uint8_t *)wbuf;
+	}
+
+	if (((uintptr_t)dest & 0x01) == 0) {
+		for (; n; PM++, dest += 2, n--) {
+			*(uint16_t *)dest = *PM;
 		}
 	} else {
-		uint16_t *dest = (uint16_t *)buf;
-		for (; len; PM++, dest++, len--) {
-			*dest = *PM;
+		for (; n; PM++, n--) {
+			uint16_t value = *PM;
+			*dest++ = value;
+			*dest++ = value >> 8;
 		}
 	}
 
-	if (odd) {
-		*(uint8_t *)buf = *(uint8_t *)PM;
+	if (len & 1) {
+		*dest = *PM;
 	}
 }
 
@@ -109,6 +155,9 @@ const struct _usbd_driver st_usbfs_v2_usb_driver = {
 	.ep_nak_set = st_usbfs_ep_nak_set,
 	.ep_write_packet = st_usbfs_ep_write_packet,
 	.ep_read_packet = st_usbfs_ep_read_packet,
+	.ep_in_busy = st_usbfs_ep_in_busy,
 	.disconnect = st_usbfs_v2_disconnect,
 	.poll = st_usbfs_poll,
+	.ep_memory_free = st_usbfs_ep_memory_free,
+	.double_buffer = true,
 };
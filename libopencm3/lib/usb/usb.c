@@ -40,25 +40,69 @@ LGPL License Terms @ref lgpl_license
 #include <libopencm3/usb/bos.h>
 #include "usb_private.h"
 
+/* Not enough room in usbd_device_storage: raise USBD_DEVICE_STORAGE_PTRS. */
+typedef char usbd_device_storage_too_small[
+	sizeof(struct _usbd_device) <= sizeof(usbd_device_storage) ? 1 : -1];
+
+/* The devices usbd_init() hands out, each bound to the driver it was first
+ * initialized with. */
+static struct _usbd_device usbd_devices[USBD_DEFAULT_DEVICES];
+
 usbd_device *usbd_init(const usbd_driver *driver,
 		       const struct usb_device_descriptor *dev,
 		       const struct usb_config_descriptor *conf,
 		       const char * const *strings, int num_strings,
 		       uint8_t *control_buffer, uint16_t control_buffer_size)
 {
-	usbd_device *usbd_dev;
+	for (size_t i = 0; i < USBD_DEFAULT_DEVICES; i++) {
+		if (usbd_devices[i].driver && (usbd_devices[i].driver != driver)) {
+			continue;
+		}
+
+		return usbd_init_with_storage(
+				(usbd_device_storage *)&usbd_devices[i],
+				driver, dev, conf, strings, num_strings,
+				control_buffer, control_buffer_size);
+	}
 
-	usbd_dev = driver->init();
+	return NULL;
+}
 
+usbd_device *usbd_init_with_storage(usbd_device_storage *storage,
+				    const usbd_driver *driver,
+				    const struct usb_device_descriptor *dev,
+				    const struct usb_config_descriptor *conf,
+				    const char * const *strings,
+				    int num_strings, uint8_t *control_buffer,
+				    uint16_t control_buffer_size)
+{
+	usbd_device *usbd_dev = (usbd_device *)storage;
+
+	/* Everything not set below starts out zero. */
+	memset(usbd_dev, 0, sizeof(*usbd_dev));
 	usbd_dev->driver = driver;
+	if (!driver->init(usbd_dev)) {
+		usbd_dev->driver = NULL;
+		return NULL;
+	}
+
 	usbd_dev->desc = dev;
 	usbd_dev->config = conf;
 	usbd_dev->strings = strings;
 	usbd_dev->num_strings = num_strings;
-	usbd_dev->extra_string_idx = 0;
-	usbd_dev->extra_string = NULL;
 	usbd_dev->ctrl_buf = control_buffer;
 	usbd_dev->ctrl_buf_len = control_buffer_size;
+	usbd_dev->poll_budget = 1;
+
+	for (size_t i = 0; i < USBD_QUEUE_POOL_SIZE; i++) {
+		usbd_dev->queue_pool[i].next = i + 1 < USBD_QUEUE_POOL_SIZE ?
+					       i + 1 : USBD_QUEUE_END;
+	}
+	for (size_t i = 0; i < 8; i++) {
+		for (size_t dir = 0; dir < 2; dir++) {
+			usbd_dev->queue[i][dir].head = USBD_QUEUE_END;
+		}
+	}
 
 	usbd_dev->user_callback_ctr[0][USB_TRANSACTION_SETUP] =
 	    _usbd_control_setup;
@@ -67,10 +111,6 @@ usbd_device *usbd_init(const usbd_driver *driver,
 	usbd_dev->user_callback_ctr[0][USB_TRANSACTION_IN] =
 	    _usbd_control_in;
 
-	for (size_t i = 0; i < MAX_USER_SET_CONFIG_CALLBACK; i++) {
-		usbd_dev->user_callback_set_config[i] = NULL;
-	}
-
 	return usbd_dev;
 }
 
@@ -121,18 +161,26 @@ void _usbd_reset(usbd_device *usbd_dev)
 	usbd_dev->current_config = 0;
 	usbd_ep_setup(usbd_dev, 0, USB_ENDPOINT_ATTR_CONTROL, usbd_dev->desc->bMaxPacketSize0, NULL);
 	usbd_dev->driver->set_address(usbd_dev, 0);
+	_usbd_ep_transfers_reset(usbd_dev);
 
 	if (usbd_dev->user_callback_reset) {
 		usbd_dev->user_callback_reset();
 	}
 }
 
+static void queue_flush(usbd_device *usbd_dev, uint8_t ep, uint8_t dir);
+
 /* Functions to wrap the low-level driver */
 void usbd_poll(usbd_device *usbd_dev)
 {
 	usbd_dev->driver->poll(usbd_dev);
 }
 
+void usbd_set_poll_budget(usbd_device *usbd_dev, uint8_t budget)
+{
+	usbd_dev->poll_budget = budget ? budget : 1;
+}
+
 __attribute__((weak)) void usbd_disconnect(usbd_device *usbd_dev,
 					   bool disconnected)
 {
@@ -145,6 +193,19 @@ __attribute__((weak)) void usbd_disconnect(usbd_device *usbd_dev,
 void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 		   uint16_t max_size, usbd_endpoint_callback callback)
 {
+	const uint8_t ep = addr & 0x7f;
+	const uint8_t dir = (addr & 0x80) ? USB_TRANSACTION_IN :
+					    USB_TRANSACTION_OUT;
+	struct usb_transfer_state *t = &usbd_dev->transfer[ep][dir];
+
+	/* Drop a transfer in progress, and its hold on the callback. */
+	if (t->busy) {
+		usbd_dev->user_callback_ctr[ep][dir] = t->callback;
+		t->busy = false;
+	}
+	queue_flush(usbd_dev, ep, dir);
+	usbd_dev->ep_max_size[ep][dir] = max_size;
+
 	usbd_dev->driver->ep_setup(usbd_dev, addr, type, max_size, callback);
 }
 
@@ -175,4 +236,343 @@ void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak)
 	usbd_dev->driver->ep_nak_set(usbd_dev, addr, nak);
 }
 
+bool usbd_ep_double_buffer(usbd_device *usbd_dev, uint8_t addr, bool enable)
+{
+	const uint8_t bit = 1 << (addr & 0x07);
+
+	if (enable) {
+		usbd_dev->double_buffer |= bit;
+	} else {
+		usbd_dev->double_buffer &= ~bit;
+	}
+
+	return usbd_dev->driver->double_buffer;
+}
+
+uint16_t usbd_ep_memory_free(usbd_device *usbd_dev)
+{
+	if (!usbd_dev->driver->ep_memory_free) {
+		return 0xffff;
+	}
+	return usbd_dev->driver->ep_memory_free(usbd_dev);
+}
+
+static void transfer_finish(usbd_device *usbd_dev, uint8_t ep, uint8_t dir)
+{
+	struct usb_transfer_state *t = &usbd_dev->transfer[ep][dir];
+
+	/* Done first, so that complete may start the next transfer. */
+	usbd_dev->user_callback_ctr[ep][dir] = t->callback;
+	t->busy = false;
+
+	if (t->complete) {
+		t->complete(usbd_dev,
+			    dir == USB_TRANSACTION_IN ? ep | 0x80 : ep,
+			    t->done);
+	}
+}
+
+/* Write the next packet of an IN transfer, or finish it. */
+static void transfer_in_next(usbd_device *usbd_dev, uint8_t ep)
+{
+	struct usb_transfer_state *t =
+		&usbd_dev->transfer[ep][USB_TRANSACTION_IN];
+	const uint16_t size = usbd_dev->ep_max_size[ep][USB_TRANSACTION_IN];
+	const uint16_t len = MIN(t->len - t->done, size);
+
+	if ((t->done == t->len) && !t->zlp) {
+		transfer_finish(usbd_dev, ep, USB_TRANSACTION_IN);
+		return;
+	}
+
+	/* Drivers that can queue several packets take all that is left. */
+	if ((len == size) && usbd_dev->driver->ep_write_transfer) {
+		const uint16_t rest = t->len - t->done;
+
+		t->pending = usbd_dev->driver->ep_write_transfer(usbd_dev, ep,
+						t->buf.in + t->done, rest);
+		if (t->pending) {
+			if (rest % size) {
+				t->zlp = false;
+			}
+			return;
+		}
+	}
+
+	/*
+	 * Only the first write can find the endpoint busy, with a packet
+	 * queued before the transfer.  Its callback comes back here.  A zero
+	 * length packet returns 0 whether it was taken or not, so ask first.
+	 */
+	if (!len && usbd_dev->driver->ep_in_busy &&
+	    usbd_dev->driver->ep_in_busy(usbd_dev, ep)) {
+		return;
+	}
+	t->pending = usbd_ep_write_packet(usbd_dev, ep, t->buf.in + t->done,
+					  len);
+
+	/* A short packet, once taken, ends the transfer. */
+	if ((len < size) && (t->pending || !len)) {
+		t->zlp = false;
+	}
+}
+
+static void transfer_in_callback(usbd_device *usbd_dev, uint8_t ep)
+{
+	struct usb_transfer_state *t =
+		&usbd_dev->transfer[ep][USB_TRANSACTION_IN];
+
+	t->done += t->pending;
+	t->pending = 0;
+	transfer_in_next(usbd_dev, ep);
+}
+
+static void transfer_out_callback(usbd_device *usbd_dev, uint8_t ep)
+{
+	struct usb_transfer_state *t =
+		&usbd_dev->transfer[ep][USB_TRANSACTION_OUT];
+	const uint16_t size = usbd_dev->ep_max_size[ep][USB_TRANSACTION_OUT];
+	/* Not limited to a packet: a DMA driver may hand over several. */
+	const uint16_t len = usbd_ep_read_packet(usbd_dev, ep,
+						 t->buf.out + t->done,
+						 t->len - t->done);
+
+	t->done += len;
+	if ((len % size) || (len == 0) || (t->done == t->len)) {
+		transfer_finish(usbd_dev, ep, USB_TRANSACTION_OUT);
+	}
+}
+
+static struct usb_transfer_state *transfer_start(usbd_device *usbd_dev,
+		uint8_t ep, uint8_t dir, uint16_t len,
+		usbd_transfer_complete_callback complete,
+		usbd_endpoint_callback callback)
+{
+	struct usb_transfer_state *t;
+
+	if ((ep == 0) || (ep >= 8)) {
+		return NULL;
+	}
+
+	t = &usbd_dev->transfer[ep][dir];
+	/* No packet size, the endpoint is not set up. */
+	if (t->busy || !usbd_dev->ep_max_size[ep][dir]) {
+		return NULL;
+	}
+
+	t->busy = true;
+	t->len = len;
+	t->done = 0;
+	t->pending = 0;
+	t->complete = complete;
+	t->callback = usbd_dev->user_callback_ctr[ep][dir];
+	usbd_dev->user_callback_ctr[ep][dir] = callback;
+
+	return t;
+}
+
+bool usbd_ep_transfer_in(usbd_device *usbd_dev, uint8_t addr,
+			 const void *buf, uint16_t len, bool zlp,
+			 usbd_transfer_complete_callback complete)
+{
+	const uint8_t ep = addr & 0x7f;
+	struct usb_transfer_state *t;
+
+	t = transfer_start(usbd_dev, ep, USB_TRANSACTION_IN, len, complete,
+			   transfer_in_callback);
+	if (!t) {
+		return false;
+	}
+
+	t->buf.in = buf;
+	/* Sending nothing still takes a zero length packet. */
+	t->zlp = zlp || (len == 0);
+	transfer_in_next(usbd_dev, ep);
+
+	return true;
+}
+
+bool usbd_ep_transfer_out(usbd_device *usbd_dev, uint8_t addr, void *buf,
+			  uint16_t len,
+			  usbd_transfer_complete_callback complete)
+{
+	struct usb_transfer_state *t;
+
+	t = transfer_start(usbd_dev, addr & 0x7f, USB_TRANSACTION_OUT, len,
+			   complete, transfer_out_callback);
+	if (!t) {
+		return false;
+	}
+
+	t->buf.out = buf;
+	t->zlp = false;
+
+	return true;
+}
+
+/* Hand all of an endpoint's requests back to the pool. */
+static void queue_flush(usbd_device *usbd_dev, uint8_t ep, uint8_t dir)
+{
+	struct usb_ep_queue *q = &usbd_dev->queue[ep][dir];
+
+	while (q->head != USBD_QUEUE_END) {
+		const uint8_t i = q->head;
+
+		q->head = usbd_dev->queue_pool[i].next;
+		usbd_dev->queue_pool[i].next = usbd_dev->queue_free;
+		usbd_dev->queue_free = i;
+	}
+	q->count = 0;
+}
+
+/* Drop every transfer and queued request, the endpoints are going away. */
+void _usbd_ep_transfers_reset(usbd_device *usbd_dev)
+{
+	for (uint8_t ep = 1; ep < 8; ep++) {
+		for (uint8_t dir = 0; dir < 2; dir++) {
+			struct usb_transfer_state *t =
+				&usbd_dev->transfer[ep][dir];
+
+			if (t->busy) {
+				usbd_dev->user_callback_ctr[ep][dir] =
+					t->callback;
+				t->busy = false;
+			}
+			queue_flush(usbd_dev, ep, dir);
+			usbd_dev->ep_max_size[ep][dir] = 0;
+		}
+	}
+}
+
+static void queue_complete(usbd_device *usbd_dev, uint8_t ep, uint16_t len);
+
+static bool queue_start(usbd_device *usbd_dev, uint8_t ep, uint8_t dir)
+{
+	const struct usb_ep_queue *q = &usbd_dev->queue[ep][dir];
+	const struct usb_queue_entry *e = &usbd_dev->queue_pool[q->head];
+
+	if (dir == USB_TRANSACTION_IN) {
+		return usbd_ep_transfer_in(usbd_dev, ep | 0x80, e->buf.in,
+					   e->len, e->zlp, queue_complete);
+	}
+	return usbd_ep_transfer_out(usbd_dev, ep, e->buf.out, e->len,
+				    queue_complete);
+}
+
+static void queue_complete(usbd_device *usbd_dev, uint8_t ep, uint16_t len)
+{
+	const uint8_t dir = (ep & 0x80) ? USB_TRANSACTION_IN :
+					  USB_TRANSACTION_OUT;
+	struct usb_ep_queue *q = &usbd_dev->queue[ep & 0x7f][dir];
+	const uint8_t i = q->head;
+	const usbd_transfer_complete_callback complete =
+		usbd_dev->queue_pool[i].complete;
+
+	q->head = usbd_dev->queue_pool[i].next;
+	q->count--;
+	usbd_dev->queue_pool[i].next = usbd_dev->queue_free;
+	usbd_dev->queue_free = i;
+
+	/* Keep the endpoint busy before telling anyone. */
+	if (q->head != USBD_QUEUE_END) {
+		queue_start(usbd_dev, ep & 0x7f, dir);
+	}
+
+	if (complete) {
+		complete(usbd_dev, ep, len);
+	}
+}
+
+/* Take a request from the pool and put it at the end of the queue. */
+static struct usb_queue_entry *queue_add(usbd_device *usbd_dev, uint8_t ep,
+		uint8_t dir, uint16_t len,
+		usbd_transfer_complete_callback complete)
+{
+	struct usb_ep_queue *q;
+	struct usb_queue_entry *e;
+	uint8_t i;
+
+	if ((ep == 0) || (ep >= 8) || !usbd_dev->ep_max_size[ep][dir]) {
+		return NULL;
+	}
+
+	q = &usbd_dev->queue[ep][dir];
+	i = usbd_dev->queue_free;
+	if ((i == USBD_QUEUE_END) || (q->depth && (q->count >= q->depth))) {
+		return NULL;
+	}
+	/* Someone else's transfer would never hand over to the queue. */
+	if (!q->count && usbd_dev->transfer[ep][dir].busy) {
+		return NULL;
+	}
+
+	e = &usbd_dev->queue_pool[i];
+	usbd_dev->queue_free = e->next;
+	e->len = len;
+	e->complete = complete;
+	e->next = USBD_QUEUE_END;
+
+	if (q->count++) {
+		usbd_dev->queue_pool[q->tail].next = i;
+	} else {
+		q->head = i;
+	}
+	q->tail = i;
+
+	return e;
+}
+
+bool usbd_ep_queue_in(usbd_device *usbd_dev, uint8_t addr, const void *buf,
+		      uint16_t len, bool zlp,
+		      usbd_transfer_complete_callback complete)
+{
+	const uint8_t ep = addr & 0x7f;
+	struct usb_queue_entry *e;
+
+	e = queue_add(usbd_dev, ep, USB_TRANSACTION_IN, len, complete);
+	if (!e) {
+		return false;
+	}
+
+	e->buf.in = buf;
+	e->zlp = zlp;
+	if (usbd_dev->queue[ep][USB_TRANSACTION_IN].count == 1) {
+		queue_start(usbd_dev, ep, USB_TRANSACTION_IN);
+	}
+
+	return true;
+}
+
+bool usbd_ep_queue_out(usbd_device *usbd_dev, uint8_t addr, void *buf,
+		       uint16_t len,
+		       usbd_transfer_complete_callback complete)
+{
+	const uint8_t ep = addr & 0x7f;
+	struct usb_queue_entry *e;
+
+	e = queue_add(usbd_dev, ep, USB_TRANSACTION_OUT, len, complete);
+	if (!e) {
+		return false;
+	}
+
+	e->buf.out = buf;
+	e->zlp = false;
+	if (usbd_dev->queue[ep][USB_TRANSACTION_OUT].count == 1) {
+		queue_start(usbd_dev, ep, USB_TRANSACTION_OUT);
+	}
+
+	return true;
+}
+
+void usbd_ep_set_queue_depth(usbd_device *usbd_dev, uint8_t addr,
+			     uint8_t depth)
+{
+	const uint8_t dir = (addr & 0x80) ? USB_TRANSACTION_IN :
+					    USB_TRANSACTION_OUT;
+
+	if ((addr & 0x7f) < 8) {
+		usbd_dev->queue[addr & 0x7f][dir].depth = depth;
+	}
+}
+
 /**@}*/
@@ -91,13 +91,57 @@ int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
 	return -1;
 }
 
+int usbd_register_control_sink(usbd_device *usbd_dev, uint8_t type,
+			       uint8_t type_mask,
+			       usbd_control_sink_callback sink)
+{
+	int i;
+
+	for (i = 0; i < MAX_USER_CONTROL_SINK; i++) {
+		if (usbd_dev->user_control_sink[i].cb) {
+			continue;
+		}
+
+		usbd_dev->user_control_sink[i].type = type;
+		usbd_dev->user_control_sink[i].type_mask = type_mask;
+		usbd_dev->user_control_sink[i].cb = sink;
+		return 0;
+	}
+
+	return -1;
+}
+
+void usbd_control_set_source(usbd_device *usbd_dev,
+			     usbd_control_source_callback source)
+{
+	usbd_dev->control_state.source = source;
+	usbd_dev->control_state.source_offset = 0;
+}
+
 static void usb_control_send_chunk(usbd_device *usbd_dev)
 {
+	const uint8_t *data = usbd_dev->control_state.ctrl_buf;
+
+	if (usbd_dev->control_state.source) {
+		/* Pull the next packet into the control buffer. */
+		uint16_t len = MIN(usbd_dev->control_state.ctrl_len,
+				   usbd_dev->desc->bMaxPacketSize0);
+
+		if (len && !usbd_dev->control_state.source(usbd_dev,
+				&usbd_dev->control_state.req,
+				usbd_dev->control_state.source_offset,
+				usbd_dev->ctrl_buf, len)) {
+			stall_transaction(usbd_dev);
+			return;
+		}
+		usbd_dev->control_state.source_offset += len;
+		data = usbd_dev->ctrl_buf;
+	}
+
 	if (usbd_dev->control_state.ctrl_len >
 			usbd_dev->desc->bMaxPacketSize0) {
 		/* Data stage, normal transmission */
-		usbd_ep_write_packet(usbd_dev, 0,
-				     usbd_dev->control_state.ctrl_buf,
+		usbd_ep_write_packet(usbd_dev, 0, data,
 				     usbd_dev->desc->bMaxPacketSize0);
 
 		usbd_dev->control_state.state = DATA_IN;
@@ -107,8 +151,7 @@ static void usb_control_send_chunk(usbd_device *usbd_dev)
 			usbd_dev->desc->bMaxPacketSize0;
 	} else {
 		/* Data stage, end of transmission */
-		usbd_ep_write_packet(usbd_dev, 0,
-				     usbd_dev->control_state.ctrl_buf,
+		usbd_ep_write_packet(usbd_dev, 0, data,
 				     usbd_dev->control_state.ctrl_len);
 
 		usbd_dev->control_state.state =
@@ -125,16 +168,32 @@ static int usb_control_recv_chunk(usbd_device *usbd_dev)
 	uint16_t packetsize = MIN(usbd_dev->desc->bMaxPacketSize0,
 			usbd_dev->control_state.req.wLength -
 			usbd_dev->control_state.ctrl_len);
-	uint16_t size = usbd_ep_read_packet(usbd_dev, 0,
-				       usbd_dev->control_state.ctrl_buf +
-				       usbd_dev->control_state.ctrl_len,
-				       packetsize);
+	uint8_t *dest = usbd_dev->control_state.ctrl_buf +
+			usbd_dev->control_state.ctrl_len;
+	uint16_t size;
+
+	/* A sink takes every packet from the start of the buffer. */
+	if (usbd_dev->control_state.sink) {
+		dest = usbd_dev->ctrl_buf;
+	}
+
+	size = usbd_ep_read_packet(usbd_dev, 0, dest, packetsize);
 
 	if (size != packetsize) {
 		stall_transaction(usbd_dev);
 		return -1;
 	}
 
+	if (usbd_dev->control_state.sink &&
+	    usbd_dev->control_state.sink(usbd_dev,
+				&usbd_dev->control_state.req,
+				usbd_dev->control_state.ctrl_len, dest, size,
+				&usbd_dev->control_state.complete) !=
+	    USBD_REQ_HANDLED) {
+		stall_transaction(usbd_dev);
+		return -1;
+	}
+
 	usbd_dev->control_state.ctrl_len += size;
 
 	return packetsize;
@@ -157,8 +216,13 @@ usb_control_request_dispatch(usbd_device *usbd_dev,
 					  &(usbd_dev->control_state.ctrl_buf),
 					  &(usbd_dev->control_state.ctrl_len),
 					  &(usbd_dev->control_state.complete));
-			if (result == USBD_REQ_HANDLED ||
-			    result == USBD_REQ_NOTSUPP) {
+			if (result == USBD_REQ_HANDLED) {
+				return result;
+			}
+			/* A source set by a callback that passed on the
+			 * request must not feed the data stage. */
+			usbd_dev->control_state.source = NULL;
+			if (result == USBD_REQ_NOTSUPP) {
 				return result;
 			}
 		}
@@ -173,8 +237,11 @@ usb_control_request_dispatch(usbd_device *usbd_dev,
 				  usbd_dev, req,
 				  &(usbd_dev->control_state.ctrl_buf),
 				  &(usbd_dev->control_state.ctrl_len));
-		if (result == USBD_REQ_HANDLED ||
-		    result == USBD_REQ_NOTSUPP) {
+		if (result == USBD_REQ_HANDLED) {
+			return result;
+		}
+		usbd_dev->control_state.source = NULL;
+		if (result == USBD_REQ_NOTSUPP) {
 			return result;
 		}
 	}
@@ -211,12 +278,48 @@ static void usb_control_setup_read(usbd_device *usbd_dev,
 	}
 }
 
+/* Offer an OUT request to the sinks, which one took it is remembered. */
+static enum usbd_request_return_codes
+usb_control_sink_dispatch(usbd_device *usbd_dev, struct usb_setup_data *req)
+{
+	struct user_control_sink *sink = usbd_dev->user_control_sink;
+
+	for (size_t i = 0; i < MAX_USER_CONTROL_SINK; i++) {
+		if (sink[i].cb == NULL) {
+			break;
+		}
+
+		if ((req->bmRequestType & sink[i].type_mask) == sink[i].type) {
+			const enum usbd_request_return_codes result =
+				sink[i].cb(usbd_dev, req, 0, NULL, 0,
+					   &(usbd_dev->control_state.complete));
+			if (result == USBD_REQ_HANDLED) {
+				usbd_dev->control_state.sink = sink[i].cb;
+			}
+			if (result == USBD_REQ_HANDLED ||
+			    result == USBD_REQ_NOTSUPP) {
+				return result;
+			}
+		}
+	}
+
+	return USBD_REQ_NEXT_CALLBACK;
+}
+
 static void usb_control_setup_write(usbd_device *usbd_dev,
 				    struct usb_setup_data *req)
 {
-	if (req->wLength > usbd_dev->ctrl_buf_len) {
+	switch (usb_control_sink_dispatch(usbd_dev, req)) {
+	case USBD_REQ_NOTSUPP:
 		stall_transaction(usbd_dev);
 		return;
+	case USBD_REQ_HANDLED:
+		break;
+	default:
+		if (req->wLength > usbd_dev->ctrl_buf_len) {
+			stall_transaction(usbd_dev);
+			return;
+		}
 	}
 
 	/* Buffer into which to write received data. */
@@ -241,6 +344,8 @@ void _usbd_control_setup(usbd_device *usbd_dev, uint8_t ep)
 	(void)ep;
 
 	usbd_dev->control_state.complete = NULL;
+	usbd_dev->control_state.source = NULL;
+	usbd_dev->control_state.sink = NULL;
 
 	usbd_ep_nak_set(usbd_dev, 0, 1);
 
@@ -272,9 +377,10 @@ void _usbd_control_out(usbd_device *usbd_dev, uint8_t ep)
 		}
 		/*
 		 * We have now received the full data payload.
-		 * Invoke callback to process.
+		 * Invoke callback to process, unless a sink already did.
 		 */
-		if (usb_control_request_dispatch(usbd_dev,
+		if (usbd_dev->control_state.sink ||
+		    usb_control_request_dispatch(usbd_dev,
 					&(usbd_dev->control_state.req))) {
 			/* Go to status stage on success. */
 			usbd_ep_write_packet(usbd_dev, 0, NULL, 0);
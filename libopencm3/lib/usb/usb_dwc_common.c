@@ -31,6 +31,32 @@
 #define dev_base_address (usbd_dev->driver->base_address)
 #define REBASE(x)        MMIO32((x) + (dev_base_address))
 
+static bool dwc_ep_is_iso(uint32_t ctl)
+{
+	return ((ctl & OTG_DIEPCTL0_EPTYP_MASK) >> OTG_DIEPCTLX_EPTYP_SHIFT) == USB_ENDPOINT_ATTR_ISOCHRONOUS;
+}
+
+/*
+ * An isochronous endpoint only takes part in even or odd frames: the
+ * frame parity bit to set in DIEPCTL or DOEPCTL for the next frame.
+ */
+static uint32_t dwc_iso_next_frame(usbd_device *usbd_dev)
+{
+	return (REBASE(OTG_DSTS) & (1U << OTG_DSTS_FNSOF_SHIFT)) ? OTG_DIEPCTLX_SEVNFRM : OTG_DIEPCTLX_SODDFRM;
+}
+
+/* In DMA mode, point an OUT endpoint at its packet buffer. */
+static void dwc_dma_out_buffer(usbd_device *usbd_dev, uint8_t ep)
+{
+	if (!usbd_dev->dma_buf) {
+		return;
+	}
+
+	usbd_dev->dma_out[ep] = (uint8_t *)usbd_dev->dma_buf[ep][USB_TRANSACTION_OUT];
+	usbd_dev->dma_out_len[ep] = usbd_dev->doeptsiz[ep] & OTG_DOEPSIZX_XFRSIZ_MASK;
+	REBASE(OTG_DOEPDMA(ep)) = (uintptr_t)usbd_dev->dma_out[ep];
+}
+
 void dwc_set_address(usbd_device *usbd_dev, uint8_t addr)
 {
 	REBASE(OTG_DCFG) = (REBASE(OTG_DCFG) & ~OTG_DCFG_DAD) | (addr << 4U);
@@ -66,9 +92,11 @@ void dwc_ep_setup(usbd_device *const usbd_dev, const uint8_t addr, const uint8_t
 		REBASE(OTG_DIEPCTL0) |= OTG_DIEPCTL0_SNAK | OTG_DIEPCTL0_USBAEP;
 #endif
 
-		/* Configure OUT part. */
-		usbd_dev->doeptsiz[0] = OTG_DOEPSIZ0_STUPCNT_1 | OTG_DOEPSIZ0_PKTCNT | (max_size & OTG_DOEPSIZ0_XFRSIZ_MASK);
+		/* Configure OUT part.  With DMA, room for back to back SETUPs. */
+		usbd_dev->doeptsiz[0] = (usbd_dev->dma_buf ? OTG_DOEPSIZ0_STUPCNT_3 : OTG_DOEPSIZ0_STUPCNT_1) |
+			OTG_DOEPSIZ0_PKTCNT | (max_size & OTG_DOEPSIZ0_XFRSIZ_MASK);
 		REBASE(OTG_DOEPTSIZ(0)) = usbd_dev->doeptsiz[0];
+		dwc_dma_out_buffer(usbd_dev, 0);
 #if defined(STM32H7)
 		/* However, *do* arm the OUT endpoint so we can receive the first SETUP packet */
 		if (max_size >= 64) {
@@ -92,6 +120,11 @@ void dwc_ep_setup(usbd_device *const usbd_dev, const uint8_t addr, const uint8_t
 		return;
 	}
 
+	/* In DMA mode, packets go through a buffer of a fixed size. */
+	if (usbd_dev->dma_buf && max_size > DWC_DMA_PACKET_SIZE) {
+		return;
+	}
+
 	if (addr & 0x80U) {
 		/* Configure an IN endpoint */
 		REBASE(OTG_DIEPTXF(ep)) = ((max_size / 4) << 16) | usbd_dev->fifo_mem_top;
@@ -109,6 +142,12 @@ void dwc_ep_setup(usbd_device *const usbd_dev, const uint8_t addr, const uint8_t
 			(max_size & OTG_DIEPCTLX_MPSIZ_MASK);
 #endif
 
+		/* Late isochronous packets are dropped, see dwc_iso_in_drop(). */
+		if (type == USB_ENDPOINT_ATTR_ISOCHRONOUS) {
+			REBASE(OTG_GINTMSK) |= OTG_GINTMSK_IISOIXFRM;
+			REBASE(OTG_DIEPMSK) |= OTG_DIEPMSK_EPDM;
+		}
+
 		if (callback) {
 			usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_IN] = (void *)callback;
 		}
@@ -116,10 +155,16 @@ void dwc_ep_setup(usbd_device *const usbd_dev, const uint8_t addr, const uint8_t
 		/* Configure an OUT endpoint */
 		usbd_dev->doeptsiz[ep] = OTG_DOEPSIZX_PKTCNT(1U) | (max_size & OTG_DOEPSIZX_XFRSIZ_MASK);
 		REBASE(OTG_DOEPTSIZ(ep)) = usbd_dev->doeptsiz[ep];
+		dwc_dma_out_buffer(usbd_dev, ep);
 		/* Make sure to arm the endpoint as part of enabling it so we can get the first data from it */
-		REBASE(OTG_DOEPCTL(ep)) = OTG_DOEPCTL0_EPENA | OTG_DIEPCTL0_CNAK | OTG_DOEPCTL0_USBAEP | OTG_DOEPCTLX_SD0PID |
+		REBASE(OTG_DOEPCTL(ep)) = OTG_DOEPCTL0_EPENA | OTG_DIEPCTL0_CNAK | OTG_DOEPCTL0_USBAEP |
+			(type == USB_ENDPOINT_ATTR_ISOCHRONOUS ? dwc_iso_next_frame(usbd_dev) : OTG_DOEPCTLX_SD0PID) |
 			(type << OTG_DIEPCTLX_EPTYP_SHIFT) | (max_size & OTG_DOEPCTLX_MPSIZ_MASK);
 
+		if (type == USB_ENDPOINT_ATTR_ISOCHRONOUS) {
+			REBASE(OTG_GINTMSK) |= OTG_GINTMSK_IPXFRM;
+		}
+
 		if (callback) {
 			usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_OUT] = (void *)callback;
 		}
@@ -130,6 +175,11 @@ void dwc_endpoints_reset(usbd_device *usbd_dev)
 {
 	/* The core resets the endpoints automatically on reset. */
 	usbd_dev->fifo_mem_top = usbd_dev->fifo_mem_top_ep0;
+	usbd_dev->iso_in_dropping = 0;
+
+	/* Only wanted while an isochronous endpoint is set up. */
+	REBASE(OTG_GINTMSK) &= ~(OTG_GINTMSK_IISOIXFRM | OTG_GINTMSK_IPXFRM);
+	REBASE(OTG_DIEPMSK) &= ~OTG_DIEPMSK_EPDM;
 
 	/* Disable any currently active endpoints */
 	for (size_t i = 1; i < ENDPOINT_COUNT; i++) {
@@ -200,9 +250,48 @@ void dwc_ep_nak_set(usbd_device *const usbd_dev, const uint8_t addr, const uint8
 	}
 }
 
+/*
+ * Whether an IN endpoint still has data to send.  Without DMA a packet at a
+ * time goes out, so the low bit of its packet count will do.  A DMA transfer
+ * may span many packets with an even count left: the core clears EPENA once
+ * the whole of it is gone.
+ */
+static bool dwc_ep_in_pending(usbd_device *usbd_dev, uint8_t ep)
+{
+#if !defined(STM32H7)
+	if (!usbd_dev->dma_buf) {
+		return REBASE(OTG_DIEPTSIZ(ep)) & OTG_DIEPSIZ0_PKTCNT;
+	}
+#endif
+	return REBASE(OTG_DIEPCTL(ep)) & OTG_DIEPCTL0_EPENA;
+}
+
 uint16_t dwc_ep_write_packet(usbd_device *const usbd_dev, const uint8_t addr, const void *buf, const uint16_t len)
 {
 	const uint8_t ep = addr & 0x7FU;
+	uint32_t mcnt = 0;
+	uint32_t frame = 0;
+
+	/* Isochronous packets are sent once, in the next frame. */
+	if (ep != 0 && dwc_ep_is_iso(REBASE(OTG_DIEPCTL(ep)))) {
+		mcnt = OTG_DIEPSIZX_MCNT_1;
+		frame = dwc_iso_next_frame(usbd_dev);
+	}
+
+	if (usbd_dev->dma_buf) {
+		if (dwc_ep_in_pending(usbd_dev, ep)) {
+			return 0;
+		}
+
+		/* The core fetches the packet from its buffer as it goes. */
+		if (len) {
+			memcpy(usbd_dev->dma_buf[ep][USB_TRANSACTION_IN], buf, len);
+		}
+		REBASE(OTG_DIEPDMA(ep)) = (uintptr_t)usbd_dev->dma_buf[ep][USB_TRANSACTION_IN];
+		REBASE(OTG_DIEPTSIZ(ep)) = mcnt | OTG_DIEPSIZ0_PKTCNT | (len & OTG_DIEPSIZ0_XFRSIZ_MASK);
+		REBASE(OTG_DIEPCTL(ep)) |= OTG_DIEPCTL0_EPENA | OTG_DIEPCTL0_CNAK | frame;
+		return len;
+	}
 
 	/* Return if endpoint is already enabled. */
 #if defined(STM32H7)
@@ -214,9 +303,9 @@ uint16_t dwc_ep_write_packet(usbd_device *const usbd_dev, const uint8_t addr, co
 	if (ep == 0U) {
 		REBASE(OTG_DIEPTSIZ(ep)) = OTG_DIEPSIZ0_PKTCNT | (len & OTG_DIEPSIZ0_XFRSIZ_MASK);
 	} else {
-		REBASE(OTG_DIEPTSIZ(ep)) = OTG_DIEPSIZX_PKTCNT(1) | (len & OTG_DIEPSIZX_XFRSIZ_MASK);
+		REBASE(OTG_DIEPTSIZ(ep)) = mcnt | OTG_DIEPSIZX_PKTCNT(1) | (len & OTG_DIEPSIZX_XFRSIZ_MASK);
 	}
-	REBASE(OTG_DIEPCTL(ep)) |= OTG_DIEPCTL0_EPENA | OTG_DIEPCTL0_CNAK;
+	REBASE(OTG_DIEPCTL(ep)) |= OTG_DIEPCTL0_EPENA | OTG_DIEPCTL0_CNAK | frame;
 
 	const uint8_t *const buf8 = buf;
 	/* Figure out where to copy the data to */
@@ -234,8 +323,8 @@ uint16_t dwc_ep_write_packet(usbd_device *const usbd_dev, const uint8_t addr, co
 	}
 
 	/* Enable endpoint for transmission. */
-	REBASE(OTG_DIEPTSIZ(ep)) = OTG_DIEPSIZ0_PKTCNT | (len & OTG_DIEPSIZ0_XFRSIZ_MASK);
-	REBASE(OTG_DIEPCTL(ep)) |= OTG_DIEPCTL0_EPENA | OTG_DIEPCTL0_CNAK;
+	REBASE(OTG_DIEPTSIZ(ep)) = mcnt | OTG_DIEPSIZ0_PKTCNT | (len & OTG_DIEPSIZ0_XFRSIZ_MASK);
+	REBASE(OTG_DIEPCTL(ep)) |= OTG_DIEPCTL0_EPENA | OTG_DIEPCTL0_CNAK | frame;
 
 	const uint32_t *buf32 = buf;
 	/* Copy buffer to endpoint FIFO, note - memcpy does not work.
@@ -266,12 +355,55 @@ uint16_t dwc_ep_write_packet(usbd_device *const usbd_dev, const uint8_t addr, co
 	return len;
 }
 
+bool dwc_ep_in_busy(usbd_device *usbd_dev, uint8_t addr)
+{
+	return dwc_ep_in_pending(usbd_dev, addr & 0x7FU);
+}
+
+/*
+ * In DMA mode, send as many packets as fit the transfer registers straight
+ * from buf.  The core only reads word aligned buffers.
+ */
+uint16_t dwc_ep_write_transfer(usbd_device *const usbd_dev, const uint8_t addr, const void *buf, const uint16_t len)
+{
+	const uint8_t ep = addr & 0x7FU;
+	const uint16_t size = usbd_dev->ep_max_size[ep][USB_TRANSACTION_IN];
+
+	if (!usbd_dev->dma_buf || ((uintptr_t)buf & 3U) || size == 0 || dwc_ep_is_iso(REBASE(OTG_DIEPCTL(ep))) ||
+		dwc_ep_in_pending(usbd_dev, ep)) {
+		return 0;
+	}
+
+	/* The packet count field is 10 bits wide. */
+	const uint32_t packets = (len + size - 1U) / size;
+	if (packets > 0x3ffU) {
+		return 0;
+	}
+
+	REBASE(OTG_DIEPDMA(ep)) = (uintptr_t)buf;
+	REBASE(OTG_DIEPTSIZ(ep)) = OTG_DIEPSIZX_PKTCNT(packets) | len;
+	REBASE(OTG_DIEPCTL(ep)) |= OTG_DIEPCTL0_EPENA | OTG_DIEPCTL0_CNAK;
+
+	return len;
+}
+
 uint16_t dwc_ep_read_packet(usbd_device *usbd_dev, uint8_t addr, void *buf, uint16_t len)
 {
 	/* We do not need to know the endpoint address since there is only one
 	 * receive FIFO for all endpoints.
 	 */
 	(void)addr;
+
+	if (usbd_dev->dma_buf) {
+		/* Already in place when the core wrote to a transfer's buffer. */
+		len = MIN(len, usbd_dev->rxbcnt);
+		if (buf != usbd_dev->dma_rx) {
+			memcpy(buf, usbd_dev->dma_rx, len);
+		}
+		usbd_dev->dma_rx += len;
+		usbd_dev->rxbcnt -= len;
+		return len;
+	}
 #if defined(STM32H7)
 	const size_t count = MIN(len, usbd_dev->rxbcnt);
 
@@ -360,6 +492,195 @@ static void dwc_flush_txfifo(usbd_device *usbd_dev, int ep)
 	}
 }
 
+/*
+ * Drop an isochronous IN packet that missed its frame: start disabling the
+ * endpoint.  dwc_iso_in_dropped() finishes once the core reports EPDISD.
+ */
+static void dwc_iso_in_drop(usbd_device *usbd_dev, int ep)
+{
+	REBASE(OTG_DIEPCTL(ep)) |= OTG_DIEPCTL0_SNAK | OTG_DIEPCTL0_EPDIS;
+	usbd_dev->iso_in_dropping |= 1U << ep;
+}
+
+/* The endpoint is disabled: flush what is left of the packet in the FIFO. */
+static void dwc_iso_in_dropped(usbd_device *usbd_dev, int ep)
+{
+	const uint32_t fifo = (REBASE(OTG_DIEPCTL(ep)) & OTG_DIEPCTL0_TXFNUM_MASK) >> 22;
+
+	usbd_dev->iso_in_dropping &= ~(1U << ep);
+	while (!(REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_AHBIDL)) {
+		/* idle */
+	}
+	REBASE(OTG_GRSTCTL) = (fifo << 6) | OTG_GRSTCTL_TXFFLSH;
+	REBASE(OTG_DIEPTSIZ(ep)) = 0;
+	while ((REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_TXFFLSH)) {
+		/* idle */
+	}
+}
+
+/*
+ * Size of the next OUT transfer on an endpoint: one packet, or the rest of a
+ * usbd_ep_transfer_out() so that the core does not stop after each packet.
+ */
+static uint32_t dwc_doeptsiz(usbd_device *usbd_dev, uint8_t ep)
+{
+	const struct usb_transfer_state *t = &usbd_dev->transfer[ep][USB_TRANSACTION_OUT];
+	const uint32_t size = usbd_dev->doeptsiz[ep] & OTG_DOEPSIZX_XFRSIZ_MASK;
+
+	if (ep == 0 || !t->busy || t->done >= t->len || size == 0) {
+		return usbd_dev->doeptsiz[ep];
+	}
+
+	/* The packet count field is 10 bits wide. */
+	const uint32_t packets = MIN((t->len - t->done + size - 1U) / size, 0x3ffU);
+	return OTG_DOEPSIZX_PKTCNT(packets) | (packets * size);
+}
+
+/*
+ * Arm an OUT endpoint again once a packet is in.  In DMA mode the core
+ * writes straight into a transfer's buffer, word aligned, for as many whole
+ * packets as it has room left for, and into the packet buffer otherwise.
+ */
+static void dwc_out_arm(usbd_device *usbd_dev, uint8_t ep)
+{
+	uint32_t doeptsiz = dwc_doeptsiz(usbd_dev, ep);
+
+	if (usbd_dev->dma_buf) {
+		const struct usb_transfer_state *t = &usbd_dev->transfer[ep][USB_TRANSACTION_OUT];
+		const uint32_t size = usbd_dev->doeptsiz[ep] & OTG_DOEPSIZX_XFRSIZ_MASK;
+		const uint32_t packets = ep == 0 || !t->busy || size == 0 ? 0 : MIN((t->len - t->done) / size, 0x3ffU);
+
+		if (packets && !((uintptr_t)(t->buf.out + t->done) & 3U)) {
+			doeptsiz = OTG_DOEPSIZX_PKTCNT(packets) | (packets * size);
+			usbd_dev->dma_out[ep] = t->buf.out + t->done;
+			usbd_dev->dma_out_len[ep] = packets * size;
+			REBASE(OTG_DOEPDMA(ep)) = (uintptr_t)usbd_dev->dma_out[ep];
+		} else {
+			doeptsiz = usbd_dev->doeptsiz[ep];
+			dwc_dma_out_buffer(usbd_dev, ep);
+		}
+	}
+
+	REBASE(OTG_DOEPTSIZ(ep)) = doeptsiz;
+	REBASE(OTG_DOEPCTL(ep)) |=
+		OTG_DOEPCTL0_EPENA | (usbd_dev->force_nak[ep] ? OTG_DOEPCTL0_SNAK : OTG_DOEPCTL0_CNAK) |
+		(ep != 0 && dwc_ep_is_iso(REBASE(OTG_DOEPCTL(ep))) ? dwc_iso_next_frame(usbd_dev) : 0);
+}
+
+/* Handle the entry at the top of the receive FIFO. */
+static void dwc_poll_rx(usbd_device *usbd_dev)
+{
+	const uint32_t rxstsp = REBASE(OTG_GRXSTSP);
+	const uint32_t pktsts = rxstsp & OTG_GRXSTSP_PKTSTS_MASK;
+	const uint8_t ep = rxstsp & OTG_GRXSTSP_EPNUM_MASK;
+
+	if (pktsts == OTG_GRXSTSP_PKTSTS_SETUP_COMP) {
+		usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_SETUP](usbd_dev, ep);
+	}
+
+	if (pktsts == OTG_GRXSTSP_PKTSTS_OUT_COMP || pktsts == OTG_GRXSTSP_PKTSTS_SETUP_COMP) {
+#if defined(STM32H7)
+		if (pktsts == OTG_GRXSTSP_PKTSTS_SETUP_COMP) {
+			REBASE(OTG_DOEPINT(ep)) = OTG_DOEPINTX_STUP;
+		}
+#endif
+		dwc_out_arm(usbd_dev, ep);
+		return;
+	}
+
+	if (pktsts != OTG_GRXSTSP_PKTSTS_OUT && pktsts != OTG_GRXSTSP_PKTSTS_SETUP) {
+		return;
+	}
+
+	const uint8_t type = pktsts == OTG_GRXSTSP_PKTSTS_SETUP ? USB_TRANSACTION_SETUP : USB_TRANSACTION_OUT;
+
+	if (type == USB_TRANSACTION_SETUP && (REBASE(OTG_DIEPTSIZ(ep)) & OTG_DIEPSIZ0_PKTCNT)) {
+		/* SETUP received but there is still something stuck
+		* in the transmit fifo.  Flush it.
+		*/
+		dwc_flush_txfifo(usbd_dev, ep);
+	}
+
+	/* Save packet size for dwc_ep_read_packet(). */
+	usbd_dev->rxbcnt = (rxstsp & OTG_GRXSTSP_BCNT_MASK) >> 4U;
+
+	if (type == USB_TRANSACTION_SETUP) {
+		dwc_ep_read_packet(usbd_dev, ep, &usbd_dev->control_state.req, 8U);
+	} else if (usbd_dev->user_callback_ctr[ep][type]) {
+		usbd_dev->user_callback_ctr[ep][type](usbd_dev, ep);
+	}
+
+	/* Discard unread packet data. */
+#if defined(STM32H7)
+	const size_t total_length = (rxstsp & OTG_GRXSTSP_BCNT_MASK) >> 4U;
+	const size_t consumed = total_length - usbd_dev->rxbcnt;
+	const volatile uint32_t *const fifo = (const volatile uint32_t *)(usbd_dev->driver->base_address + OTG_FIFO(0));
+	for (size_t offset = consumed; offset < total_length; offset += 4) {
+		(void)fifo[offset >> 2U];
+	}
+
+	REBASE(OTG_DOEPINT(ep)) = OTG_DOEPINTX_XFRC;
+#else
+	for (size_t i = 0; i < usbd_dev->rxbcnt; i += 4) {
+		/* There is only one receive FIFO, so use OTG_FIFO(0) */
+		(void)REBASE(OTG_FIFO(0));
+	}
+#endif
+
+	usbd_dev->rxbcnt = 0;
+}
+
+/*
+ * DMA mode: the core has finished writing an OUT endpoint's data to memory,
+ * or ended a SETUP stage on endpoint 0.
+ */
+static void dwc_dma_poll_out(usbd_device *usbd_dev, uint8_t ep)
+{
+	const uint32_t doepint = REBASE(OTG_DOEPINT(ep));
+
+	if (ep == 0 && (doepint & OTG_DOEPINTX_STUP)) {
+		/* The last of up to three SETUPs the core took counts. */
+		const uint32_t left = (REBASE(OTG_DOEPTSIZ(0)) & OTG_DOEPSIZ0_STUPCNT_MASK) >> 29U;
+		const uint32_t setups = left < 3U ? 3U - left : 1U;
+
+		REBASE(OTG_DOEPINT(0)) = OTG_DOEPINTX_STUP | OTG_DOEPINTX_XFRC;
+		if (REBASE(OTG_DIEPTSIZ(0)) & OTG_DIEPSIZ0_PKTCNT) {
+			/* Something still stuck in the transmit fifo. */
+			dwc_flush_txfifo(usbd_dev, 0);
+		}
+		memcpy(&usbd_dev->control_state.req, usbd_dev->dma_out[0] + 8U * (setups - 1U), 8U);
+		usbd_dev->user_callback_ctr[0][USB_TRANSACTION_SETUP](usbd_dev, 0);
+		dwc_out_arm(usbd_dev, 0);
+		return;
+	}
+
+	if (!(doepint & OTG_DOEPINTX_XFRC)) {
+		REBASE(OTG_DOEPINT(ep)) = doepint;
+		return;
+	}
+	REBASE(OTG_DOEPINT(ep)) = OTG_DOEPINTX_XFRC;
+
+	const uint32_t xfrsiz_mask = ep == 0 ? OTG_DOEPSIZ0_XFRSIZ_MASK : OTG_DOEPSIZX_XFRSIZ_MASK;
+	const uint32_t len = usbd_dev->dma_out_len[ep] - (REBASE(OTG_DOEPTSIZ(ep)) & xfrsiz_mask);
+	const uint16_t size = usbd_dev->doeptsiz[ep] & OTG_DOEPSIZX_XFRSIZ_MASK;
+	const usbd_endpoint_callback callback = usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_OUT];
+
+	usbd_dev->rxbcnt = len;
+	usbd_dev->dma_rx = usbd_dev->dma_out[ep];
+	if (callback) {
+		callback(usbd_dev, ep);
+	}
+
+	/* Whole packets cut short by a zero length one: pass that on too. */
+	if (callback && size && len < usbd_dev->dma_out_len[ep] && len && !(len % size)) {
+		usbd_dev->rxbcnt = 0;
+		callback(usbd_dev, ep);
+	}
+	usbd_dev->rxbcnt = 0;
+
+	dwc_out_arm(usbd_dev, ep);
+}
+
 void dwc_poll(usbd_device *usbd_dev)
 {
 	/* Read interrupt status register. */
@@ -389,7 +710,9 @@ void dwc_poll(usbd_device *usbd_dev)
 	if (intsts & OTG_GINTSTS_IEPINT) {
 #endif
 		for (size_t i = 0; i < ENDPOINT_COUNT; i++) {
-			if (REBASE(OTG_DIEPINT(i)) & OTG_DIEPINTX_XFRC) {
+			const uint32_t diepint = REBASE(OTG_DIEPINT(i));
+
+			if (diepint & OTG_DIEPINTX_XFRC) {
 				/* Transfer complete. */
 				REBASE(OTG_DIEPINT(i)) = OTG_DIEPINTX_XFRC;
 
@@ -397,74 +720,82 @@ void dwc_poll(usbd_device *usbd_dev)
 					usbd_dev->user_callback_ctr[i][USB_TRANSACTION_IN](usbd_dev, i);
 				}
 			}
+			if (diepint & OTG_DIEPINTX_EPDISD) {
+				REBASE(OTG_DIEPINT(i)) = OTG_DIEPINTX_EPDISD;
+
+				/* An isochronous packet dropped below is gone:
+				 * the endpoint is free as if it had been sent. */
+				if (usbd_dev->iso_in_dropping & (1U << i)) {
+					dwc_iso_in_dropped(usbd_dev, i);
+					if (usbd_dev->user_callback_ctr[i][USB_TRANSACTION_IN]) {
+						usbd_dev->user_callback_ctr[i][USB_TRANSACTION_IN](usbd_dev, i);
+					}
+				}
+			}
 		}
 #if defined(STM32H7)
 	}
 #endif
 
-	/* Note: RX and TX handled differently in this device. */
-	if (intsts & OTG_GINTSTS_RXFLVL) {
-		/* Receive FIFO non-empty. */
-		const uint32_t rxstsp = REBASE(OTG_GRXSTSP);
-		const uint32_t pktsts = rxstsp & OTG_GRXSTSP_PKTSTS_MASK;
-		const uint8_t ep = rxstsp & OTG_GRXSTSP_EPNUM_MASK;
+	/*
+	 * An isochronous IN packet still waiting at the end of the periodic
+	 * frame it was meant for has missed it.  Only endpoints whose
+	 * even/odd frame bit matches the current frame are late; the others
+	 * are already set up for the next one.  Start dropping the late
+	 * packets, the EPDISD interrupt above finishes and tells the
+	 * application.
+	 */
+	if (intsts & OTG_GINTSTS_IISOIXFR) {
+		const bool odd = REBASE(OTG_DSTS) & (1U << OTG_DSTS_FNSOF_SHIFT);
 
-		if (pktsts == OTG_GRXSTSP_PKTSTS_SETUP_COMP) {
-			usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_SETUP](usbd_dev, ep);
-		}
+		REBASE(OTG_GINTSTS) = OTG_GINTSTS_IISOIXFR;
+		for (size_t i = 1; i < ENDPOINT_COUNT; i++) {
+			const uint32_t ctl = REBASE(OTG_DIEPCTL(i));
 
-		if (pktsts == OTG_GRXSTSP_PKTSTS_OUT_COMP || pktsts == OTG_GRXSTSP_PKTSTS_SETUP_COMP) {
-#if defined(STM32H7)
-			if (pktsts == OTG_GRXSTSP_PKTSTS_SETUP_COMP) {
-				REBASE(OTG_DOEPINT(ep)) = OTG_DOEPINTX_STUP;
+			if (!dwc_ep_is_iso(ctl) || !(ctl & OTG_DIEPCTL0_EPENA) ||
+			    (usbd_dev->iso_in_dropping & (1U << i))) {
+				continue;
+			}
+			if (!(ctl & OTG_DIEPCTLX_EONUM) == !odd) {
+				dwc_iso_in_drop(usbd_dev, i);
 			}
-#endif
-			REBASE(OTG_DOEPTSIZ(ep)) = usbd_dev->doeptsiz[ep];
-			REBASE(OTG_DOEPCTL(ep)) |=
-				OTG_DOEPCTL0_EPENA | (usbd_dev->force_nak[ep] ? OTG_DOEPCTL0_SNAK : OTG_DOEPCTL0_CNAK);
-			return;
-		}
-
-		if (pktsts != OTG_GRXSTSP_PKTSTS_OUT && pktsts != OTG_GRXSTSP_PKTSTS_SETUP) {
-			return;
-		}
-
-		const uint8_t type = pktsts == OTG_GRXSTSP_PKTSTS_SETUP ? USB_TRANSACTION_SETUP : USB_TRANSACTION_OUT;
-
-		if (type == USB_TRANSACTION_SETUP && (REBASE(OTG_DIEPTSIZ(ep)) & OTG_DIEPSIZ0_PKTCNT)) {
-			/* SETUP received but there is still something stuck
-			* in the transmit fifo.  Flush it.
-			*/
-			dwc_flush_txfifo(usbd_dev, ep);
 		}
+	}
 
-		/* Save packet size for dwc_ep_read_packet(). */
-		usbd_dev->rxbcnt = (rxstsp & OTG_GRXSTSP_BCNT_MASK) >> 4U;
+	/*
+	 * An isochronous OUT endpoint armed for a frame whose packet never
+	 * came: wait for the next frame instead.
+	 */
+	if (intsts & OTG_GINTSTS_INCOMPISOOUT) {
+		REBASE(OTG_GINTSTS) = OTG_GINTSTS_INCOMPISOOUT;
+		for (size_t i = 1; i < ENDPOINT_COUNT; i++) {
+			const uint32_t ctl = REBASE(OTG_DOEPCTL(i));
 
-		if (type == USB_TRANSACTION_SETUP) {
-			dwc_ep_read_packet(usbd_dev, ep, &usbd_dev->control_state.req, 8U);
-		} else if (usbd_dev->user_callback_ctr[ep][type]) {
-			usbd_dev->user_callback_ctr[ep][type](usbd_dev, ep);
+			if (dwc_ep_is_iso(ctl) && (ctl & OTG_DOEPCTL0_EPENA)) {
+				REBASE(OTG_DOEPCTL(i)) |= dwc_iso_next_frame(usbd_dev);
+			}
 		}
+	}
 
-		/* Discard unread packet data. */
-#if defined(STM32H7)
-		const size_t total_length = (rxstsp & OTG_GRXSTSP_BCNT_MASK) >> 4U;
-		const size_t consumed = total_length - usbd_dev->rxbcnt;
-		const volatile uint32_t *const fifo = (const volatile uint32_t *)(usbd_dev->driver->base_address + OTG_FIFO(0));
-		for (size_t offset = consumed; offset < total_length; offset += 4) {
-			(void)fifo[offset >> 2U];
-		}
+	/* In DMA mode the core empties the receive FIFO itself. */
+	if (usbd_dev->dma_buf && (intsts & OTG_GINTSTS_OEPINT)) {
+		const uint32_t daint = REBASE(OTG_DAINT);
 
-		REBASE(OTG_DOEPINT(ep)) = OTG_DOEPINTX_XFRC;
-#else
-		for (size_t i = 0; i < usbd_dev->rxbcnt; i += 4) {
-			/* There is only one receive FIFO, so use OTG_FIFO(0) */
-			(void)REBASE(OTG_FIFO(0));
+		for (uint8_t i = 0; i < ENDPOINT_COUNT; i++) {
+			if (daint & (1U << (16U + i))) {
+				dwc_dma_poll_out(usbd_dev, i);
+			}
 		}
-#endif
+	}
 
-		usbd_dev->rxbcnt = 0;
+	/*
+	 * Note: RX and TX handled differently in this device.  Each receive
+	 * FIFO entry is one event, take them up to the budget.
+	 */
+	for (uint8_t budget = usbd_dev->poll_budget;
+	     !usbd_dev->dma_buf && (intsts & OTG_GINTSTS_RXFLVL) && budget; budget--) {
+		dwc_poll_rx(usbd_dev);
+		intsts = REBASE(OTG_GINTSTS);
 	}
 
 	if (intsts & OTG_GINTSTS_USBSUSP) {
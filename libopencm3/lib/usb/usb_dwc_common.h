@@ -34,8 +34,11 @@ uint8_t dwc_ep_stall_get(usbd_device *usbd_dev, uint8_t addr);
 void dwc_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak);
 uint16_t dwc_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 				   const void *buf, uint16_t len);
+bool dwc_ep_in_busy(usbd_device *usbd_dev, uint8_t addr);
 uint16_t dwc_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 				  void *buf, uint16_t len);
+uint16_t dwc_ep_write_transfer(usbd_device *usbd_dev, uint8_t addr,
+			       const void *buf, uint16_t len);
 void dwc_poll(usbd_device *usbd_dev);
 void dwc_disconnect(usbd_device *usbd_dev, bool disconnected);
 
@@ -50,10 +50,8 @@
 
 #define ENDPOINT_COUNT 4
 
-static struct _usbd_device _usbd_dev;
-
 /** Initialize the USB_FS device controller hardware of the STM32. */
-static usbd_device *efm32lg_usbd_init(void)
+static usbd_device *efm32lg_usbd_init(usbd_device *usbd_dev)
 {
 	/* Enable clock */
 	CMU_HFCORECLKEN0 |= CMU_HFCORECLKEN0_USB | CMU_HFCORECLKEN0_USBC;
@@ -83,7 +81,7 @@ static usbd_device *efm32lg_usbd_init(void)
 	USB_PCGCCTL = 0;
 
 	USB_GRXFSIZ = efm32lg_usb_driver.rx_fifo_size;
-	_usbd_dev.fifo_mem_top = efm32lg_usb_driver.rx_fifo_size;
+	usbd_dev->fifo_mem_top = efm32lg_usb_driver.rx_fifo_size;
 
 	/* Unmask interrupts for TX and RX. */
 	USB_GAHBCFG |= USB_GAHBCFG_GLBLINTRMSK;
@@ -95,7 +93,7 @@ static usbd_device *efm32lg_usbd_init(void)
 	USB_DAINTMSK = 0xF;
 	USB_DIEPMSK = USB_DIEPMSK_XFRCM;
 
-	return &_usbd_dev;
+	return usbd_dev;
 }
 
 static void efm32lg_set_address(usbd_device *usbd_dev, uint8_t addr)
@@ -249,6 +247,13 @@ static void efm32lg_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak)
 	}
 }
 
+static bool efm32lg_ep_in_busy(usbd_device *usbd_dev, uint8_t addr)
+{
+	(void)usbd_dev;
+
+	return USB_DIEPx_TSIZ(addr & 0x7F) & USB_DIEP0TSIZ_PKTCNT;
+}
+
 static uint16_t efm32lg_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 			      const void *buf, uint16_t len)
 {
@@ -427,6 +432,7 @@ const struct _usbd_driver efm32lg_usb_driver = {
 	.ep_nak_set = efm32lg_ep_nak_set,
 	.ep_write_packet = efm32lg_ep_write_packet,
 	.ep_read_packet = efm32lg_ep_read_packet,
+	.ep_in_busy = efm32lg_ep_in_busy,
 	.poll = efm32lg_poll,
 	.disconnect = efm32lg_disconnect,
 	.base_address = USB_BASE,
@@ -49,10 +49,8 @@
 
 #define ENDPOINT_COUNT 4
 
-static struct _usbd_device _usbd_dev;
-
 /** Initialize the USB device controller hardware of the EFM32HG. */
-static usbd_device *efm32hg_usbd_init(void)
+static usbd_device *efm32hg_usbd_init(usbd_device *usbd_dev)
 {
 	/* Enable peripheral clocks required for USB */
 	cmu_periph_clock_enable(CMU_USB);
@@ -106,7 +104,7 @@ static usbd_device *efm32hg_usbd_init(void)
 	OTG_FS_PCGCCTL = 0;
 
 	OTG_FS_GRXFSIZ = efm32hg_usb_driver.rx_fifo_size;
-	_usbd_dev.fifo_mem_top = efm32hg_usb_driver.rx_fifo_size;
+	usbd_dev->fifo_mem_top = efm32hg_usb_driver.rx_fifo_size;
 
 	/* Unmask interrupts for TX and RX. */
 	OTG_FS_GAHBCFG |= OTG_GAHBCFG_GINT;
@@ -118,7 +116,7 @@ static usbd_device *efm32hg_usbd_init(void)
 	OTG_FS_DAINTMSK = 0xF;
 	OTG_FS_DIEPMSK = OTG_DIEPMSK_XFRCM;
 
-	return &_usbd_dev;
+	return usbd_dev;
 }
 
 const struct _usbd_driver efm32hg_usb_driver = {
@@ -131,6 +129,7 @@ const struct _usbd_driver efm32hg_usb_driver = {
 	.ep_nak_set = dwc_ep_nak_set,
 	.ep_write_packet = dwc_ep_write_packet,
 	.ep_read_packet = dwc_ep_read_packet,
+	.ep_in_busy = dwc_ep_in_busy,
 	.poll = dwc_poll,
 	.disconnect = dwc_disconnect,
 	.base_address = USB_OTG_FS_BASE,
@@ -30,9 +30,7 @@
 /* Receive FIFO size in 32-bit words. */
 #define RX_FIFO_SIZE 128
 
-static usbd_device *stm32f107_usbd_init(void);
-
-static struct _usbd_device usbd_dev;
+static usbd_device *stm32f107_usbd_init(usbd_device *usbd_dev);
 
 const struct _usbd_driver stm32f107_usb_driver = {
 	.init = stm32f107_usbd_init,
@@ -44,6 +42,7 @@ const struct _usbd_driver stm32f107_usb_driver = {
 	.ep_nak_set = dwc_ep_nak_set,
 	.ep_write_packet = dwc_ep_write_packet,
 	.ep_read_packet = dwc_ep_read_packet,
+	.ep_in_busy = dwc_ep_in_busy,
 	.poll = dwc_poll,
 	.disconnect = dwc_disconnect,
 	.base_address = USB_OTG_FS_BASE,
@@ -52,7 +51,7 @@ const struct _usbd_driver stm32f107_usb_driver = {
 };
 
 /** Initialize the USB device controller hardware of the STM32. */
-static usbd_device *stm32f107_usbd_init(void)
+static usbd_device *stm32f107_usbd_init(usbd_device *usbd_dev)
 {
 	rcc_periph_clock_enable(RCC_OTGFS);
 	OTG_FS_GUSBCFG |= OTG_GUSBCFG_PHYSEL;
@@ -85,7 +84,7 @@ static usbd_device *stm32f107_usbd_init(void)
 	OTG_FS_PCGCCTL = 0;
 
 	OTG_FS_GRXFSIZ = stm32f107_usb_driver.rx_fifo_size;
-	usbd_dev.fifo_mem_top = stm32f107_usb_driver.rx_fifo_size;
+	usbd_dev->fifo_mem_top = stm32f107_usb_driver.rx_fifo_size;
 
 	/* Unmask interrupts for TX and RX. */
 	OTG_FS_GAHBCFG |= OTG_GAHBCFG_GINT;
@@ -97,5 +96,5 @@ static usbd_device *stm32f107_usbd_init(void)
 	OTG_FS_DAINTMSK = 0xF;
 	OTG_FS_DIEPMSK = OTG_DIEPMSK_XFRCM;
 
-	return &usbd_dev;
+	return usbd_dev;
 }
@@ -26,13 +26,9 @@
 #include <libopencm3/usb/dwc/otg_hs.h>
 #include "usb_private.h"
 #include "usb_dwc_common.h"
+#include "usb_f207.h"
 
-/* Receive FIFO size in 32-bit words. */
-#define RX_FIFO_SIZE 512
-
-static usbd_device *stm32f207_usbd_init(void);
-
-static struct _usbd_device usbd_dev;
+static usbd_device *stm32f207_usbd_init(usbd_device *usbd_dev);
 
 const struct _usbd_driver stm32f207_usb_driver = {
 	.init = stm32f207_usbd_init,
@@ -44,6 +40,7 @@ const struct _usbd_driver stm32f207_usb_driver = {
 	.ep_nak_set = dwc_ep_nak_set,
 	.ep_write_packet = dwc_ep_write_packet,
 	.ep_read_packet = dwc_ep_read_packet,
+	.ep_in_busy = dwc_ep_in_busy,
 	.poll = dwc_poll,
 	.disconnect = dwc_disconnect,
 	.base_address = USB_OTG_HS_BASE,
@@ -51,8 +48,11 @@ const struct _usbd_driver stm32f207_usb_driver = {
 	.rx_fifo_size = RX_FIFO_SIZE,
 };
 
-/** Initialize the USB device controller hardware of the STM32. */
-static usbd_device *stm32f207_usbd_init(void)
+/*
+ * Reset the core and bring it up as a device, interrupts still masked.
+ * Shared with the DMA mode driver in usb_f207_dma.c.
+ */
+void stm32f207_core_init(usbd_device *usbd_dev)
 {
 	rcc_periph_clock_enable(RCC_OTGHS);
 	OTG_HS_GINTSTS = OTG_GINTSTS_MMIS;
@@ -76,8 +76,15 @@ static usbd_device *stm32f207_usbd_init(void)
 	/* Restart the PHY clock. */
 	OTG_HS_PCGCCTL = 0;
 
-	OTG_HS_GRXFSIZ = stm32f207_usb_driver.rx_fifo_size;
-	usbd_dev.fifo_mem_top = stm32f207_usb_driver.rx_fifo_size;
+	OTG_HS_GRXFSIZ = RX_FIFO_SIZE;
+	usbd_dev->fifo_mem_top = RX_FIFO_SIZE;
+}
+
+/** Initialize the USB device controller hardware of the STM32. */
+static usbd_device *stm32f207_usbd_init(usbd_device *usbd_dev)
+{
+	stm32f207_core_init(usbd_dev);
+	usbd_dev->dma_buf = NULL;
 
 	/* Unmask interrupts for TX and RX. */
 	OTG_HS_GAHBCFG |= OTG_GAHBCFG_GINT;
@@ -89,5 +96,5 @@ static usbd_device *stm32f207_usbd_init(void)
 	OTG_HS_DAINTMSK = 0xF;
 	OTG_HS_DIEPMSK = OTG_DIEPMSK_XFRCM;
 
-	return &usbd_dev;
+	return usbd_dev;
 }
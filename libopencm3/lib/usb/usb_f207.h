@@ -0,0 +1,38 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shared by the OTG_HS drivers: the plain one in usb_f207.c and the buffer
+ * DMA one in usb_f207_dma.c, which is a separate object so that only
+ * applications using it link its packet buffers.
+ */
+
+#ifndef USB_F207_H
+#define USB_F207_H
+
+#include <libopencm3/cm3/common.h>
+
+BEGIN_DECLS
+
+/* Receive FIFO size in 32-bit words. */
+#define RX_FIFO_SIZE 512
+
+void stm32f207_core_init(usbd_device *usbd_dev);
+
+END_DECLS
+
+#endif /* USB_F207_H */
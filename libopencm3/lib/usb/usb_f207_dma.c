@@ -0,0 +1,74 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/tools.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/bos.h>
+#include <libopencm3/usb/dwc/otg_hs.h>
+#include "usb_private.h"
+#include "usb_dwc_common.h"
+#include "usb_f207.h"
+
+static usbd_device *stm32f207_usbd_dma_init(usbd_device *usbd_dev);
+
+/* Packet buffers for DMA mode, not in CCM RAM which the core cannot reach. */
+static uint32_t dma_buf[ENDPOINT_COUNT][2][DWC_DMA_PACKET_SIZE / 4];
+
+const struct _usbd_driver stm32f207_usb_dma_driver = {
+	.init = stm32f207_usbd_dma_init,
+	.set_address = dwc_set_address,
+	.ep_setup = dwc_ep_setup,
+	.ep_reset = dwc_endpoints_reset,
+	.ep_stall_set = dwc_ep_stall_set,
+	.ep_stall_get = dwc_ep_stall_get,
+	.ep_nak_set = dwc_ep_nak_set,
+	.ep_write_packet = dwc_ep_write_packet,
+	.ep_read_packet = dwc_ep_read_packet,
+	.ep_in_busy = dwc_ep_in_busy,
+	.ep_write_transfer = dwc_ep_write_transfer,
+	.poll = dwc_poll,
+	.disconnect = dwc_disconnect,
+	.base_address = USB_OTG_HS_BASE,
+	.set_address_before_status = 1,
+	.rx_fifo_size = RX_FIFO_SIZE,
+};
+
+/*
+ * Initialize the core in buffer DMA mode: it moves packets between its
+ * FIFOs and memory itself, and interrupts once a transfer is complete.
+ */
+static usbd_device *stm32f207_usbd_dma_init(usbd_device *usbd_dev)
+{
+	stm32f207_core_init(usbd_dev);
+	usbd_dev->dma_buf = dma_buf;
+
+	OTG_HS_GAHBCFG |= OTG_GAHBCFG_GINT | OTG_GAHBCFG_HBSTLEN_INCR4 | OTG_GAHBCFG_DMAEN;
+	OTG_HS_GINTMSK = OTG_GINTMSK_ENUMDNEM |
+			 OTG_GINTMSK_IEPINT |
+			 OTG_GINTMSK_OEPINT |
+			 OTG_GINTMSK_USBSUSPM |
+			 OTG_GINTMSK_WUIM;
+	OTG_HS_DAINTMSK = 0xF | (0xF << 16);
+	OTG_HS_DIEPMSK = OTG_DIEPMSK_XFRCM;
+	OTG_HS_DOEPMSK = OTG_DOEPMSK_XFRCM | OTG_DOEPMSK_STUPM;
+
+	return usbd_dev;
+}
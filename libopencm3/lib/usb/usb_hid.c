@@ -1,3 +1,26 @@
+/** @defgroup usb_hid_file Generic USB HID class
+
+@ingroup USB
+
+@brief <b>Generic USB HID class</b>
+
+Handles the HID class requests for interrupt IN interfaces, each kept in a
+usbd_hid the application provides: report descriptor, boot/report protocol,
+idle rate, GET_REPORT from the last input report and output reports
+(keyboard LEDs) through SET_REPORT.
+
+An input report identical to the previous one is only sent again when the
+idle rate the host asked for runs out, so unchanged state costs no bus
+traffic with an idle rate of zero.  The idle rate starts at zero, or at the
+default set with @ref usb_hid_set_default_idle, until the host sets one.
+
+Several reports may share the endpoint through report IDs, see
+@ref usb_hid_use_report_ids.  The last report and the idle rate are then
+kept per report ID.
+
+LGPL License Terms @ref lgpl_license
+*/
+
 /*
  * This file is part of the libopencm3 project.
  *
@@ -15,6 +38,434 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/**@{*/
+
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/bos.h>
 #include <libopencm3/usb/hid.h>
+#include "usb_private.h"
+
+/* Interfaces set up with usb_hid_init(), the storage is the caller's. */
+static usbd_hid *hid_list;
+
+
+/* The interface usbd_dev has on iface, NULL if it is not ours. */
+static usbd_hid *hid_by_iface(usbd_device *usbd_dev, uint16_t iface)
+{
+	usbd_hid *hid;
+
+	for (hid = hid_list; hid; hid = hid->next) {
+		if ((hid->usbd_dev == usbd_dev) && (hid->iface == iface)) {
+			return hid;
+		}
+	}
+	return NULL;
+}
+
+static usbd_hid *hid_by_ep(usbd_device *usbd_dev, uint8_t ep)
+{
+	usbd_hid *hid;
+
+	for (hid = hid_list; hid; hid = hid->next) {
+		if ((hid->usbd_dev == usbd_dev) && ((hid->ep_in & 0x7f) == ep)) {
+			return hid;
+		}
+	}
+	return NULL;
+}
+
+static bool hid_idle_due(const struct usb_hid_report_state *state)
+{
+	return state->idle_rate &&
+	       (state->idle_ms >= state->idle_rate * USB_HID_IDLE_UNIT_MS);
+}
+
+/* Report IDs are only sent in report protocol, USB HID appendix B. */
+static bool hid_has_report_ids(const usbd_hid *hid)
+{
+	return hid->report_ids && (hid->protocol == USB_HID_PROTOCOL_REPORT);
+}
+
+/* State kept for report_id, NULL for IDs too large to be cached. */
+static struct usb_hid_report_state *hid_report_state(usbd_hid *hid,
+						 uint8_t report_id)
+{
+	if (!hid_has_report_ids(hid)) {
+		report_id = 0;
+	}
+	if (report_id >= USB_HID_MAX_REPORT_IDS) {
+		return NULL;
+	}
+
+	return &hid->report[report_id];
+}
+
+static void hid_reset_reports(usbd_hid *hid)
+{
+	for (int i = 0; i < USB_HID_MAX_REPORT_IDS; i++) {
+		hid->report[i].idle_rate = hid->default_idle;
+		hid->report[i].idle_ms = 0;
+		hid->report[i].len = 0;
+	}
+}
+
+static enum usb_hid_send_status hid_write(usbd_hid *hid,
+					  struct usb_hid_report_state *state,
+					  const uint8_t *report, uint16_t len)
+{
+	if (!usbd_ep_write_packet(hid->usbd_dev, hid->ep_in, report, len)) {
+		return USB_HID_SEND_BUSY;
+	}
+
+	hid->busy = true;
+	if (state) {
+		state->idle_ms = 0;
+	}
+	return USB_HID_SEND_QUEUED;
+}
+
+static void hid_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	usbd_hid *hid = hid_by_ep(usbd_dev, ep);
+
+	if (!hid) {
+		return;
+	}
+	hid->busy = false;
+	if (hid->in_complete) {
+		hid->in_complete(hid);
+	}
+}
+
+/** @brief Standard GET_DESCRIPTOR for the HID report descriptor. */
+static enum usbd_request_return_codes
+hid_standard_request(usbd_device *usbd_dev,
+		     struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
+		     usbd_control_complete_callback *complete)
+{
+	usbd_hid *hid = hid_by_iface(usbd_dev, req->wIndex);
+
+	(void)complete;
+
+	if (!hid ||
+	    (req->bRequest != USB_REQ_GET_DESCRIPTOR) ||
+	    (req->wValue != (USB_HID_DT_REPORT << 8))) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+
+	*buf = (uint8_t *)hid->report_descriptor;
+	*len = MIN(*len, hid->report_descriptor_len);
+
+	return USBD_REQ_HANDLED;
+}
+
+/** @brief HID class requests, USB HID 7.2. */
+static enum usbd_request_return_codes
+hid_class_request(usbd_device *usbd_dev,
+		  struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
+		  usbd_control_complete_callback *complete)
+{
+	usbd_hid *hid = hid_by_iface(usbd_dev, req->wIndex);
+	struct usb_hid_report_state *state;
+	uint8_t report_id = req->wValue & 0xff;
+
+	(void)complete;
+
+	if (!hid) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+
+	switch (req->bRequest) {
+	case USB_HID_REQ_TYPE_GET_REPORT:
+		state = hid_report_state(hid, report_id);
+		if (((req->wValue >> 8) != USB_HID_REPORT_TYPE_INPUT) ||
+		    !state || !state->len) {
+			return USBD_REQ_NOTSUPP;
+		}
+		*buf = state->data;
+		*len = MIN(*len, state->len);
+		return USBD_REQ_HANDLED;
+	case USB_HID_REQ_TYPE_SET_REPORT:
+		if ((req->wValue >> 8) != USB_HID_REPORT_TYPE_OUTPUT) {
+			return USBD_REQ_NOTSUPP;
+		}
+		if (!hid->output_report) {
+			return USBD_REQ_HANDLED;
+		}
+		/* The report ID leads the data, report_id already carries it. */
+		if (hid_has_report_ids(hid)) {
+			if (!*len || ((*buf)[0] != report_id)) {
+				return USBD_REQ_NOTSUPP;
+			}
+			hid->output_report(hid, report_id, *buf + 1, *len - 1);
+		} else {
+			hid->output_report(hid, 0, *buf, *len);
+		}
+		return USBD_REQ_HANDLED;
+	case USB_HID_REQ_TYPE_GET_IDLE:
+		state = hid_report_state(hid, report_id);
+		(*buf)[0] = state ? state->idle_rate : 0;
+		*len = 1;
+		return USBD_REQ_HANDLED;
+	case USB_HID_REQ_TYPE_SET_IDLE:
+		/* Report ID 0 sets the rate of every report. */
+		for (int i = 0; i < USB_HID_MAX_REPORT_IDS; i++) {
+			if (report_id && (report_id != i)) {
+				continue;
+			}
+			hid->report[i].idle_rate = req->wValue >> 8;
+			hid->report[i].idle_ms = 0;
+		}
+		return USBD_REQ_HANDLED;
+	case USB_HID_REQ_TYPE_GET_PROTOCOL:
+		(*buf)[0] = hid->protocol;
+		*len = 1;
+		return USBD_REQ_HANDLED;
+	case USB_HID_REQ_TYPE_SET_PROTOCOL:
+		if (req->wValue > USB_HID_PROTOCOL_REPORT) {
+			return USBD_REQ_NOTSUPP;
+		}
+		if (hid->protocol != req->wValue) {
+			/* Cached reports are in the other format. */
+			hid->protocol = req->wValue;
+			hid_reset_reports(hid);
+		}
+		return USBD_REQ_HANDLED;
+	}
+
+	return USBD_REQ_NOTSUPP;
+}
+
+/** @brief Setup the endpoints of the device's HID interfaces and register
+the request handlers. */
+static void hid_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+	usbd_hid *hid;
+
+	(void)wValue;
+
+	for (hid = hid_list; hid; hid = hid->next) {
+		if (hid->usbd_dev != usbd_dev) {
+			continue;
+		}
+
+		/* USB HID 7.2.6: report protocol and no cached state after
+		 * config */
+		hid->protocol = USB_HID_PROTOCOL_REPORT;
+		hid->busy = false;
+		hid_reset_reports(hid);
+
+		usbd_ep_setup(usbd_dev, hid->ep_in,
+			      USB_ENDPOINT_ATTR_INTERRUPT, hid->ep_in_size,
+			      hid_data_tx_cb);
+	}
+
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				hid_standard_request);
+	usbd_register_control_callback(
+				usbd_dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				hid_class_request);
+}
+
+/** @addtogroup usb_hid */
+/** @{ */
+
+/** @brief Initializes the USB HID class layer.
+
+Each HID interface needs its own usbd_hid, which must stay valid while the
+device is in use.  Call this before registering your own set config
+callback, so that the HID request handlers are consulted before yours.
+
+@param[in] hid Storage for the interface.
+@param[in] usbd_dev The USB device to associate the HID interface with.
+@param[in] iface The bInterfaceNumber of the HID interface.
+@param[in] ep_in The interrupt IN endpoint address.
+@param[in] ep_in_size The endpoint wMaxPacketSize.
+@param[in] report_descriptor The report descriptor, must stay valid.
+@param[in] report_descriptor_len Length of the report descriptor.
+@param[in] in_complete Called when the host has collected a report, may be
+		NULL.
+@param[in] output_report Called with each output report received through
+		SET_REPORT, without its report ID byte, may be NULL.  The
+		report ID is 0 in boot protocol or without report IDs.
+
+@return hid
+*/
+usbd_hid *usb_hid_init(usbd_hid *hid, usbd_device *usbd_dev, uint8_t iface,
+		       uint8_t ep_in, uint16_t ep_in_size,
+		       const uint8_t *report_descriptor,
+		       uint16_t report_descriptor_len,
+		       usbd_hid_in_complete_callback in_complete,
+		       usbd_hid_output_report_callback output_report)
+{
+	usbd_hid *h;
+
+	hid->usbd_dev = usbd_dev;
+	hid->iface = iface;
+	hid->ep_in = ep_in;
+	hid->ep_in_size = ep_in_size;
+	hid->report_descriptor = report_descriptor;
+	hid->report_descriptor_len = report_descriptor_len;
+	hid->in_complete = in_complete;
+	hid->output_report = output_report;
+	hid->protocol = USB_HID_PROTOCOL_REPORT;
+	hid->default_idle = 0;
+	hid->report_ids = false;
+	hid->busy = false;
+	hid_reset_reports(hid);
+
+	/* Linked once, even when initialized again. */
+	h = hid_list;
+	while (h && (h != hid)) {
+		h = h->next;
+	}
+	if (!h) {
+		hid->next = hid_list;
+		hid_list = hid;
+	}
+
+	usbd_register_set_config_callback(usbd_dev, hid_set_config);
+
+	return hid;
+}
+
+/** @brief Declare that the report descriptor uses report IDs.
+
+Input reports then start with their report ID while the host has selected
+the report protocol, and are cached and rate limited per report ID.  In
+boot protocol there are no report IDs and everything shares one slot.
+
+@param[in] hid The HID interface from @ref usb_hid_init.
+@param[in] report_ids true if the report descriptor declares report IDs.
+*/
+void usb_hid_use_report_ids(usbd_hid *hid, bool report_ids)
+{
+	hid->report_ids = report_ids;
+	hid_reset_reports(hid);
+}
+
+/** @brief Set the idle rate reports start with, after reset and until the
+host sends SET_IDLE.
+
+HID 7.2.4 recommends @ref USB_HID_IDLE_RATE_KEYBOARD for keyboards and zero
+(infinite), the default here, for mice and joysticks.
+
+@param[in] hid The HID interface from @ref usb_hid_init.
+@param[in] idle_rate In units of @ref USB_HID_IDLE_UNIT_MS, 0 is infinite.
+*/
+void usb_hid_set_default_idle(usbd_hid *hid, uint8_t idle_rate)
+{
+	hid->default_idle = idle_rate;
+	hid_reset_reports(hid);
+}
+
+/** @brief Send an input report.
+
+A report identical to the last one sent with the same report ID is dropped,
+unless the idle rate has run out, so callers may submit their current state
+freely.
+
+@param[in] hid The HID interface from @ref usb_hid_init.
+@param[in] report The report, starting with its report ID if report IDs are
+		in use, copied before returning.
+@param[in] len Length of the report, at most the endpoint size.
+
+@return @ref USB_HID_SEND_BUSY if the endpoint still holds a report, retry
+	from the in_complete callback.
+*/
+enum usb_hid_send_status usb_hid_send_report(usbd_hid *hid,
+					     const uint8_t *report,
+					     uint16_t len)
+{
+	struct usb_hid_report_state *state;
+	enum usb_hid_send_status status;
+
+	if ((len > USB_HID_MAX_REPORT_SIZE) || (len > hid->ep_in_size)) {
+		len = MIN(hid->ep_in_size, USB_HID_MAX_REPORT_SIZE);
+	}
+
+	state = hid_report_state(hid, len ? report[0] : 0);
+	if (state && (len == state->len) && !hid_idle_due(state) &&
+	    !memcmp(report, state->data, len)) {
+		return USB_HID_SEND_UNCHANGED;
+	}
+
+	status = hid_write(hid, state, report, len);
+	if (state && (status == USB_HID_SEND_QUEUED)) {
+		memcpy(state->data, report, len);
+		state->len = len;
+	}
+
+	return status;
+}
+
+/** @brief Send an input report that must never be dropped.
+
+For reports holding relative data, like mouse motion, where two identical
+reports are two events.  The report is neither compared with nor cached as
+the last report.
+
+@param[in] hid The HID interface from @ref usb_hid_init.
+@param[in] report The report, as for @ref usb_hid_send_report.
+@param[in] len Length of the report, at most the endpoint size.
+
+@return @ref USB_HID_SEND_BUSY or @ref USB_HID_SEND_QUEUED.
+*/
+enum usb_hid_send_status usb_hid_send_event(usbd_hid *hid,
+					    const uint8_t *report,
+					    uint16_t len)
+{
+	if ((len > USB_HID_MAX_REPORT_SIZE) || (len > hid->ep_in_size)) {
+		len = MIN(hid->ep_in_size, USB_HID_MAX_REPORT_SIZE);
+	}
+
+	return hid_write(hid, NULL, report, len);
+}
+
+/** @brief Account for elapsed time and repeat the last report if the idle
+rate the host asked for has run out.  With report IDs, at most one report
+is repeated per call, the lowest due report ID first.
+
+@param[in] hid The HID interface from @ref usb_hid_init.
+@param[in] elapsed_ms Milliseconds since the previous call.
+*/
+void usb_hid_idle_tick(usbd_hid *hid, uint16_t elapsed_ms)
+{
+	struct usb_hid_report_state *due = NULL;
+
+	for (int i = 0; i < USB_HID_MAX_REPORT_IDS; i++) {
+		struct usb_hid_report_state *state = &hid->report[i];
+
+		if (!state->idle_rate) {
+			continue;
+		}
+		/* Stop counting once due, the repeat may wait. */
+		if (!hid_idle_due(state)) {
+			state->idle_ms += elapsed_ms;
+		}
+		if (!due && state->len && hid_idle_due(state)) {
+			due = state;
+		}
+	}
+
+	if (!hid->busy && due) {
+		hid_write(hid, due, due->data, due->len);
+	}
+}
+
+/** @brief Current protocol, @ref USB_HID_PROTOCOL_BOOT or
+@ref USB_HID_PROTOCOL_REPORT. */
+uint8_t usb_hid_get_protocol(const usbd_hid *hid)
+{
+	return hid->protocol;
+}
+
+/** @} */
 
-/* This stub exists just to trick doxygen. */
\ No newline at end of file
+/**@}*/
@@ -41,6 +41,19 @@
  * usbd_dev = usbd_init(&lm4f_usb_driver, ...);
  * @endcode
  *
+ * <b>uDMA</b>
+ *
+ * lm4f_usb_dma_driver is the same driver, but the whole packets of
+ * usbd_ep_transfer_in() and usbd_ep_transfer_out() on endpoints 1 to 3 are
+ * moved between SRAM and the endpoint FIFOs by the uDMA, on the endpoints' own
+ * channels 0 to 5.  The endpoint requests each packet from the uDMA itself, so
+ * the CPU is only interrupted once the transfer is done or cut short.  The
+ * application owns the uDMA: it must enable it and set its channel control
+ * table before usbd_init(), or the driver works as lm4f_usb_driver.  Single
+ * packets, short last packets, buffers that are not word aligned or not in
+ * SRAM, and packet sizes that are not a power of two number of words still go
+ * through the CPU.
+ *
  * <b>Polling or interrupt-driven? </b>
  *
  * The LM4F USB driver will work fine regardless of whether it is called from an
@@ -88,8 +101,8 @@
 /*
  * TODO list:
  *
- * 1) Driver works by reading and writing to the FIFOs one byte at a time. It
- * has no knowledge of DMA.
+ * 1) The uDMA only moves whole packets of transfers. The first packet of an
+ * OUT transfer, and short last packets, are still copied by the CPU.
  * 2) Double-buffering is supported. How can we take advantage of it to speed
  * up endpoint transfers.
  * 3) No benchmarks as to the endpoint's performance has been done.
@@ -102,6 +115,7 @@
 #include <libopencm3/cm3/common.h>
 #include <libopencm3/lm4f/usb.h>
 #include <libopencm3/lm4f/rcc.h>
+#include <libopencm3/lm4f/udma.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/bos.h>
 #include "../../lib/usb/usb_private.h"
@@ -111,7 +125,22 @@
 
 #define MAX_FIFO_RAM	(4 * 1024)
 
+/* The uDMA can only reach SRAM, and only moves whole words here */
+#define LM4F_UDMA_REACHABLE(p)	(((uintptr_t)(p) & 0xE0000003U) == 0x20000000U)
+
+/*
+ * uDMA channels of endpoints 1 to 3 in their default assignment: OUT on the
+ * even channel, IN on the odd one after it.
+ */
+#define LM4F_UDMA_EP_LAST	3
+#define LM4F_UDMA_CH_RX(ep)	(((ep) - 1) * 2)
+#define LM4F_UDMA_CH_TX(ep)	(((ep) - 1) * 2 + 1)
+#define LM4F_UDMA_CHANNELS	0x3f
+/* Words one uDMA transfer can move */
+#define LM4F_UDMA_MAX_WORDS	1024
+
 const struct _usbd_driver lm4f_usb_driver;
+const struct _usbd_driver lm4f_usb_dma_driver;
 
 /**
  * \brief Enable Specific USB Interrupts
@@ -295,6 +324,18 @@ static void lm4f_endpoints_reset(usbd_device *usbd_dev)
 	 * The first 64 bytes are always reserved for EP0
 	 */
 	usbd_dev->fifo_mem_top = 64;
+
+	/* Drop any transfers the uDMA was moving */
+	if (usbd_dev->udma) {
+		UDMA_ENACLR = LM4F_UDMA_CHANNELS;
+		for (uint8_t ep = 1; ep <= LM4F_UDMA_EP_LAST; ep++) {
+			USB_TXCSRH(ep) &= ~(USB_TXCSRH_DMAEN | USB_TXCSRH_AUTOSET);
+			USB_RXCSRH(ep) &= ~(USB_RXCSRH_DMAEN | USB_RXCSRH_AUTOCL);
+		}
+	}
+	usbd_dev->udma_in = 0;
+	usbd_dev->udma_out = 0;
+	usbd_dev->udma_rx = 0;
 }
 
 static void lm4f_ep_stall_set(usbd_device *usbd_dev, uint8_t addr,
@@ -356,19 +397,63 @@ static void lm4f_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak)
 	/* NAK's are handled automatically by hardware. Move along. */
 }
 
+/*
+ * Whether the uDMA can move whole packets between an endpoint and buf: an
+ * endpoint with channels, packets of a power of two number of words so that
+ * each request moves one, and a word aligned buffer in SRAM.
+ */
+static bool lm4f_udma_usable(usbd_device *usbd_dev, uint8_t ep, uint16_t size,
+			     const void *buf)
+{
+	return usbd_dev->udma && (ep >= 1) && (ep <= LM4F_UDMA_EP_LAST) &&
+	       (size >= 4) && !(size & (size - 1)) && LM4F_UDMA_REACHABLE(buf);
+}
+
+/*
+ * Start an endpoint channel on words between buf and the endpoint FIFO, one
+ * packet per request from the endpoint.
+ */
+static void lm4f_udma_start(usbd_device *usbd_dev, uint8_t ch, uint8_t ep,
+			    const void *buf, uint16_t words, uint16_t size,
+			    bool to_fifo)
+{
+	struct udma_channel_control *const cc = &usbd_dev->udma[ch];
+	const uint32_t last = (uint32_t)(uintptr_t)buf + (words - 1) * 4;
+	const uint32_t fifo = (uint32_t)(uintptr_t)&USB_FIFO32(ep);
+
+	if (to_fifo) {
+		cc->src_end = last;
+		cc->dst_end = fifo;
+		cc->chctl = UDMA_CHCTL_DSTINC(UDMA_CHCTL_INC_NONE) |
+			    UDMA_CHCTL_SRCINC(UDMA_CHCTL_SIZE_32);
+	} else {
+		cc->src_end = fifo;
+		cc->dst_end = last;
+		cc->chctl = UDMA_CHCTL_DSTINC(UDMA_CHCTL_SIZE_32) |
+			    UDMA_CHCTL_SRCINC(UDMA_CHCTL_INC_NONE);
+	}
+	cc->chctl |= UDMA_CHCTL_DSTSIZE(UDMA_CHCTL_SIZE_32) |
+		     UDMA_CHCTL_SRCSIZE(UDMA_CHCTL_SIZE_32) |
+		     UDMA_CHCTL_ARBSIZE(__builtin_ctz(size / 4)) |
+		     UDMA_CHCTL_XFERSIZE(words) | UDMA_CHCTL_XFERMODE_BASIC;
+
+	UDMA_CHIS = 1 << ch;
+	UDMA_ENASET = 1 << ch;
+}
+
 static uint16_t lm4f_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 			      const void *buf, uint16_t len)
 {
 	const uint8_t ep = addr & 0xf;
 	uint16_t i;
 
-	(void)usbd_dev;
-
 	/* Don't touch the FIFO if there is still a packet being transmitted */
 	if (ep == 0 && (USB_CSRL0 & USB_CSRL0_TXRDY)) {
 		return 0;
 	} else if (USB_TXCSRL(ep) & USB_TXCSRL_TXRDY) {
 		return 0;
+	} else if (usbd_dev->udma_in & (1 << ep)) {
+		return 0;
 	}
 
 	/*
@@ -408,14 +493,79 @@ static uint16_t lm4f_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 	return i;
 }
 
+static bool lm4f_ep_in_busy(usbd_device *usbd_dev, uint8_t addr)
+{
+	const uint8_t ep = addr & 0xf;
+
+	if (ep == 0) {
+		return USB_CSRL0 & USB_CSRL0_TXRDY;
+	}
+	return (USB_TXCSRL(ep) & USB_TXCSRL_TXRDY) ||
+	       (usbd_dev->udma_in & (1 << ep));
+}
+
+/*
+ * Have the uDMA feed the whole packets of buf to the endpoint FIFO, each set
+ * ready by AUTOSET as soon as it is complete.  A short last packet is left
+ * to lm4f_ep_write_packet().
+ */
+static uint16_t lm4f_ep_write_transfer(usbd_device *usbd_dev, uint8_t addr,
+				       const void *buf, uint16_t len)
+{
+	const uint8_t ep = addr & 0xf;
+	const uint16_t size = usbd_dev->ep_max_size[ep][USB_TRANSACTION_IN];
+
+	if (!lm4f_udma_usable(usbd_dev, ep, size, buf) ||
+	    (USB_TXCSRH(ep) & USB_TXCSRH_ISO) ||
+	    (USB_TXCSRL(ep) & USB_TXCSRL_TXRDY) ||
+	    (usbd_dev->udma_in & (1 << ep))) {
+		return 0;
+	}
+
+	len = MIN(len, LM4F_UDMA_MAX_WORDS * 4);
+	len -= len % size;
+
+	usbd_dev->udma_in |= 1 << ep;
+	lm4f_udma_start(usbd_dev, LM4F_UDMA_CH_TX(ep), ep, buf, len / 4, size,
+			true);
+	USB_TXCSRH(ep) |= USB_TXCSRH_AUTOSET | USB_TXCSRH_DMAMOD;
+	USB_TXCSRH(ep) |= USB_TXCSRH_DMAEN;
+
+	return len;
+}
+
+/*
+ * An IN transfer on the uDMA is done once the channel has stopped and the
+ * last packet has gone.  The endpoint leaves DMA mode as soon as the channel
+ * stops, so that packet interrupts as usual.
+ */
+static bool lm4f_udma_in_done(usbd_device *usbd_dev, uint8_t ep)
+{
+	if (UDMA_ENASET & (1 << LM4F_UDMA_CH_TX(ep))) {
+		return false;
+	}
+	USB_TXCSRH(ep) &= ~USB_TXCSRH_DMAEN;
+	USB_TXCSRH(ep) &= ~(USB_TXCSRH_AUTOSET | USB_TXCSRH_DMAMOD);
+	if (USB_TXCSRL(ep) & USB_TXCSRL_TXRDY) {
+		return false;
+	}
+	usbd_dev->udma_in &= ~(1 << ep);
+	return true;
+}
+
 static uint16_t lm4f_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 				    void *buf, uint16_t len)
 {
-	(void)usbd_dev;
-
 	uint16_t rlen;
 	uint8_t ep = addr & 0xf;
 
+	/* Already in buf, landed by the uDMA: see lm4f_udma_poll_out() */
+	if (usbd_dev->udma_rx) {
+		rlen = MIN(len, usbd_dev->udma_rx);
+		usbd_dev->udma_rx = 0;
+		return rlen;
+	}
+
 	uint16_t fifoin = USB_RXCOUNT(ep);
 
 	rlen = (fifoin > len) ? len : fifoin;
@@ -456,6 +606,82 @@ static uint16_t lm4f_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 	return rlen;
 }
 
+/*
+ * Once a packet of an OUT transfer has been read, have the uDMA take the
+ * whole packets still to come straight into the transfer buffer, each
+ * cleared by AUTOCL as soon as it is read.  The endpoint only interrupts for
+ * a short packet, which the uDMA does not take.
+ */
+static void lm4f_udma_out_arm(usbd_device *usbd_dev, uint8_t ep)
+{
+	const struct usb_transfer_state *t =
+		&usbd_dev->transfer[ep][USB_TRANSACTION_OUT];
+	const uint16_t size = usbd_dev->ep_max_size[ep][USB_TRANSACTION_OUT];
+	uint16_t len;
+
+	if (!t->busy || !lm4f_udma_usable(usbd_dev, ep, size, t->buf.out + t->done) ||
+	    (USB_RXCSRH(ep) & USB_RXCSRH_ISO)) {
+		return;
+	}
+
+	len = MIN(t->len - t->done, LM4F_UDMA_MAX_WORDS * 4);
+	len -= len % size;
+	if (!len) {
+		return;
+	}
+
+	usbd_dev->udma_out |= 1 << ep;
+	usbd_dev->udma_out_len[ep] = len;
+	lm4f_udma_start(usbd_dev, LM4F_UDMA_CH_RX(ep), ep, t->buf.out + t->done,
+			len / 4, size, false);
+	USB_RXCSRH(ep) |= USB_RXCSRH_AUTOCL | USB_RXCSRH_DMAMOD;
+	USB_RXCSRH(ep) |= USB_RXCSRH_DMAEN;
+}
+
+/*
+ * An OUT transfer on the uDMA: once the channel has stopped after the last
+ * packet it was armed for, or a short packet waits in the FIFO, hand what the
+ * uDMA landed to the endpoint callback.  A packet left in the FIFO, short or
+ * beyond the transfer, is then read as usual.
+ */
+static void lm4f_udma_poll_out(usbd_device *usbd_dev, uint8_t ep)
+{
+	const uint8_t ch = LM4F_UDMA_CH_RX(ep);
+	const uint16_t size = usbd_dev->ep_max_size[ep][USB_TRANSACTION_OUT];
+	const bool short_packet = (USB_RXCSRL(ep) & USB_RXCSRL_RXRDY) &&
+				  (USB_RXCOUNT(ep) < size);
+	usbd_endpoint_callback callback;
+	uint16_t left = 0;
+
+	if (UDMA_ENASET & (1 << ch)) {
+		if (!short_packet) {
+			return;
+		}
+		/* Cut short: what the channel still had to move */
+		UDMA_ENACLR = 1 << ch;
+		if ((usbd_dev->udma[ch].chctl & UDMA_CHCTL_XFERMODE_MASK) !=
+		    UDMA_CHCTL_XFERMODE_STOP) {
+			left = (((usbd_dev->udma[ch].chctl >> 4) & 0x3ff) + 1) * 4;
+		}
+	}
+	USB_RXCSRH(ep) &= ~USB_RXCSRH_DMAEN;
+	USB_RXCSRH(ep) &= ~(USB_RXCSRH_AUTOCL | USB_RXCSRH_DMAMOD);
+	usbd_dev->udma_out &= ~(1 << ep);
+
+	usbd_dev->udma_rx = usbd_dev->udma_out_len[ep] - left;
+	callback = usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_OUT];
+	if (usbd_dev->udma_rx && callback) {
+		callback(usbd_dev, ep);
+	}
+	usbd_dev->udma_rx = 0;
+
+	callback = usbd_dev->user_callback_ctr[ep][USB_TRANSACTION_OUT];
+	if ((USB_RXCSRL(ep) & USB_RXCSRL_RXRDY) && callback) {
+		callback(usbd_dev, ep);
+	}
+	lm4f_udma_out_arm(usbd_dev, ep);
+}
+
 static void lm4f_poll(usbd_device *usbd_dev)
 {
 	void (*tx_cb)(usbd_device *usbd_dev, uint8_t ea);
@@ -472,6 +698,11 @@ static void lm4f_poll(usbd_device *usbd_dev)
 	const uint8_t usb_txis = USB_TXIS;
 	const uint8_t usb_csrl0 = USB_CSRL0;
 
+	/* The endpoint channels also interrupt here when they finish. */
+	if (usbd_dev->udma) {
+		UDMA_CHIS = LM4F_UDMA_CHANNELS;
+	}
+
 	if ((usb_is & USB_IM_SUSPEND) && (usbd_dev->user_callback_suspend)) {
 		usbd_dev->user_callback_suspend();
 	}
@@ -548,12 +779,26 @@ static void lm4f_poll(usbd_device *usbd_dev)
 		tx_cb = usbd_dev->user_callback_ctr[i][USB_TRANSACTION_IN];
 		rx_cb = usbd_dev->user_callback_ctr[i][USB_TRANSACTION_OUT];
 
-		if ((usb_txis & (1 << i)) && tx_cb) {
+		/*
+		 * Packets of a transfer on the uDMA are not reported one by
+		 * one: only the whole transfer is.  Their interrupts can still
+		 * come late, for a packet already handled, and are ignored.
+		 */
+		if (usbd_dev->udma_in & (1 << i)) {
+			if (lm4f_udma_in_done(usbd_dev, i) && tx_cb) {
+				tx_cb(usbd_dev, i);
+			}
+		} else if ((usb_txis & (1 << i)) && tx_cb &&
+			   !(usbd_dev->udma && (USB_TXCSRL(i) & USB_TXCSRL_TXRDY))) {
 			tx_cb(usbd_dev, i);
 		}
 
-		if ((usb_rxis & (1 << i)) && rx_cb) {
+		if (usbd_dev->udma_out & (1 << i)) {
+			lm4f_udma_poll_out(usbd_dev, i);
+		} else if ((usb_rxis & (1 << i)) && rx_cb &&
+			   !(usbd_dev->udma && !(USB_RXCSRL(i) & USB_RXCSRL_RXRDY))) {
 			rx_cb(usbd_dev, i);
+			lm4f_udma_out_arm(usbd_dev, i);
 		}
 	}
 
@@ -576,14 +821,8 @@ static void lm4f_disconnect(usbd_device *usbd_dev, bool disconnected)
 	}
 }
 
-/*
- * A static struct works as long as we have only one USB peripheral. If we
- * meet LM4Fs with more than one USB, then we need to rework this approach.
- */
-static struct _usbd_device usbd_dev;
-
 /** Initialize the USB device controller hardware of the LM4F. */
-static usbd_device *lm4f_usbd_init(void)
+static usbd_device *lm4f_usbd_init(usbd_device *usbd_dev)
 {
 	int i;
 
@@ -621,9 +860,34 @@ static usbd_device *lm4f_usbd_init(void)
 	lm4f_usb_soft_connect();
 
 	/* No FIFO allocated yet, but the first 64 bytes are still reserved */
-	usbd_dev.fifo_mem_top = 64;
+	usbd_dev->fifo_mem_top = 64;
+	usbd_dev->udma = NULL;
+
+	return usbd_dev;
+}
+
+/**
+ * Initialize the controller as above, and the endpoint channels of the uDMA
+ * the application has set up.
+ */
+static usbd_device *lm4f_usbd_dma_init(usbd_device *usbd_dev)
+{
+	if (!lm4f_usbd_init(usbd_dev)) {
+		return NULL;
+	}
+	if (!(SYSCTL_PRDMA & 1) || !(UDMA_STAT & UDMA_STAT_MASTEN)) {
+		return usbd_dev;
+	}
 
-	return &usbd_dev;
+	/* Channels 0-5 to USB0, endpoints 1-3 on DMA A-C, primary control */
+	UDMA_CHMAP(0) &= ~0x00ffffff;
+	USB_DMASEL = 0x00332211;
+	UDMA_ALTCLR = LM4F_UDMA_CHANNELS;
+	UDMA_USEBURSTCLR = LM4F_UDMA_CHANNELS;
+	UDMA_REQMASKCLR = LM4F_UDMA_CHANNELS;
+	usbd_dev->udma = (struct udma_channel_control *)(uintptr_t)UDMA_CTLBASE;
+
+	return usbd_dev;
 }
 
 /* What is this thing even good for */
@@ -639,6 +903,26 @@ const struct _usbd_driver lm4f_usb_driver = {
 	.ep_nak_set = lm4f_ep_nak_set,
 	.ep_write_packet = lm4f_ep_write_packet,
 	.ep_read_packet = lm4f_ep_read_packet,
+	.ep_in_busy = lm4f_ep_in_busy,
+	.poll = lm4f_poll,
+	.disconnect = lm4f_disconnect,
+	.base_address = USB_BASE,
+	.set_address_before_status = false,
+	.rx_fifo_size = RX_FIFO_SIZE,
+};
+
+const struct _usbd_driver lm4f_usb_dma_driver = {
+	.init = lm4f_usbd_dma_init,
+	.set_address = lm4f_set_address,
+	.ep_setup = lm4f_ep_setup,
+	.ep_reset = lm4f_endpoints_reset,
+	.ep_stall_set = lm4f_ep_stall_set,
+	.ep_stall_get = lm4f_ep_stall_get,
+	.ep_nak_set = lm4f_ep_nak_set,
+	.ep_write_packet = lm4f_ep_write_packet,
+	.ep_read_packet = lm4f_ep_read_packet,
+	.ep_in_busy = lm4f_ep_in_busy,
+	.ep_write_transfer = lm4f_ep_write_transfer,
 	.poll = lm4f_poll,
 	.disconnect = lm4f_disconnect,
 	.base_address = USB_BASE,
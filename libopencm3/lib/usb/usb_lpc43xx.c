@@ -0,0 +1,547 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Device driver for USB0 of the LPC43xx, the high speed controller with the
+ * on chip PHY.
+ *
+ * The controller does not have packet memory: it moves data to and from RAM
+ * by itself, following a transfer descriptor (dTD) queued on the queue head
+ * (dQH) of each endpoint and direction.  Every endpoint gets one dTD, which
+ * covers up to five 4 KiB pages:
+ *
+ * - Packets written with usbd_ep_write_packet() are copied into a buffer of
+ *   the endpoint first, so the caller may reuse its own at once.
+ * - IN transfers started with usbd_ep_transfer_in() are sent straight from
+ *   the caller's buffer, at least 16 KiB per dTD.
+ * - OUT endpoints take one packet into their buffer, or while a transfer
+ *   is running, as many whole packets as fit straight into its buffer.
+ *
+ * PLL0USB must run at 480 MHz before usbd_init(), see the gadget-zero test
+ * firmware for an example from a 12 MHz crystal.  Enable NVIC_USB0_IRQ and
+ * call usbd_poll() from usb0_isr(), or call it from the main loop.
+ */
+
+#include <string.h>
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/lpc43xx/ccu.h>
+#include <libopencm3/lpc43xx/cgu.h>
+#include <libopencm3/lpc43xx/creg.h>
+#include <libopencm3/lpc43xx/rgu.h>
+#include <libopencm3/lpc43xx/usb.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/bos.h>
+#include "usb_private.h"
+
+/* Largest packet an endpoint may use: a high speed bulk packet. */
+#define LPC43XX_PACKET_SIZE	512U
+
+/* A dTD holds five page pointers, the first one at an offset. */
+#define LPC43XX_DTD_PAGES	5U
+#define LPC43XX_PAGE_SIZE	0x1000U
+
+/* RUN bit of the CCU branch clock configuration registers */
+#define LPC43XX_CCU_CFG_RUN	(1 << 0)
+
+static usbd_device *lpc43xx_usbd_init(usbd_device *usbd_dev);
+
+/*
+ * Endpoint list, OUT then IN for each endpoint: the controller wants it on
+ * a 2 KiB boundary.  The dTDs must not cross a 4 KiB page.
+ */
+static usb_queue_head_t qh[ENDPOINT_COUNT * 2] __attribute__((aligned(2048)));
+static usb_transfer_descriptor_t dtd[ENDPOINT_COUNT * 2] __attribute__((aligned(32)));
+static uint8_t packet_buf[ENDPOINT_COUNT * 2][LPC43XX_PACKET_SIZE] __attribute__((aligned(4)));
+
+/* Index of an endpoint in the lists above. */
+static inline uint8_t lpc43xx_ep_index(uint8_t ep, bool in)
+{
+	return ep * 2 + (in ? 1 : 0);
+}
+
+/* Bit of an endpoint in ENDPTPRIME, ENDPTFLUSH, ENDPTSTAT and ENDPTCOMPLETE */
+static inline uint32_t lpc43xx_ep_bit(uint8_t ep, bool in)
+{
+	return in ? USB0_ENDPTPRIME_PETB(1U << ep) : USB0_ENDPTPRIME_PERB(1U << ep);
+}
+
+/* Primed, or done and not handled by lpc43xx_poll() yet. */
+static bool lpc43xx_ep_busy(uint8_t ep, bool in)
+{
+	return (USB0_ENDPTPRIME | USB0_ENDPTSTAT | USB0_ENDPTCOMPLETE) & lpc43xx_ep_bit(ep, in);
+}
+
+static void lpc43xx_ep_flush(uint32_t bits)
+{
+	do {
+		USB0_ENDPTFLUSH = bits;
+		while (USB0_ENDPTFLUSH & bits);
+	} while (USB0_ENDPTSTAT & bits);
+}
+
+/* Bytes a single dTD can take from buf on. */
+static uint32_t lpc43xx_dtd_room(const void *buf)
+{
+	return LPC43XX_DTD_PAGES * LPC43XX_PAGE_SIZE - ((uintptr_t)buf & (LPC43XX_PAGE_SIZE - 1U));
+}
+
+/* Queue len bytes at buf on an idle endpoint. */
+static void lpc43xx_ep_prime(uint8_t ep, bool in, const void *buf, uint32_t len)
+{
+	const uint8_t i = lpc43xx_ep_index(ep, in);
+	const uint32_t addr = (uintptr_t)buf;
+
+	dtd[i].next_dtd_pointer = USB_TD_NEXT_DTD_POINTER_TERMINATE;
+	dtd[i].total_bytes = USB_TD_DTD_TOKEN_TOTAL_BYTES(len) | USB_TD_DTD_TOKEN_IOC | USB_TD_DTD_TOKEN_STATUS_ACTIVE;
+	dtd[i].buffer_pointer_page[0] = addr;
+	for (uint8_t page = 1; page < LPC43XX_DTD_PAGES; page++) {
+		dtd[i].buffer_pointer_page[page] = (addr & ~(LPC43XX_PAGE_SIZE - 1U)) + page * LPC43XX_PAGE_SIZE;
+	}
+
+	qh[i].next_dtd_pointer = &dtd[i];
+	qh[i].total_bytes &= ~(USB_TD_DTD_TOKEN_STATUS_ACTIVE | USB_TD_DTD_TOKEN_STATUS_HALTED);
+
+	USB0_ENDPTPRIME = lpc43xx_ep_bit(ep, in);
+}
+
+/* Bytes still owed by the last dTD of an endpoint. */
+static uint32_t lpc43xx_dtd_left(uint8_t ep, bool in)
+{
+	const uint8_t i = lpc43xx_ep_index(ep, in);
+
+	return (dtd[i].total_bytes & USB_TD_DTD_TOKEN_TOTAL_BYTES_MASK) >> USB_TD_DTD_TOKEN_TOTAL_BYTES_SHIFT;
+}
+
+/*
+ * Arm an OUT endpoint: for one packet in its own buffer, or for as many
+ * whole packets of a running transfer as one dTD takes, straight into the
+ * transfer's buffer.
+ */
+static void lpc43xx_out_prime(usbd_device *dev, uint8_t ep)
+{
+	const struct usb_transfer_state *t = &dev->transfer[ep][USB_TRANSACTION_OUT];
+	const uint16_t size = dev->ep_max_size[ep][USB_TRANSACTION_OUT];
+	uint8_t *buf = packet_buf[lpc43xx_ep_index(ep, false)];
+	uint32_t len = size;
+
+	if (dev->force_nak[ep]) {
+		return;
+	}
+
+	if (t->busy && size && (uint32_t)(t->len - t->done) >= size) {
+		buf = t->buf.out + t->done;
+		len = MIN((uint32_t)(t->len - t->done), lpc43xx_dtd_room(buf));
+		len -= len % size;
+	}
+
+	dev->dma_out[ep] = buf;
+	dev->dma_out_len[ep] = len;
+	lpc43xx_ep_prime(ep, false, buf, len);
+}
+
+/* Endpoint 0 is only armed for OUT when the control transfer wants it. */
+static void lpc43xx_ep0_out_prime(usbd_device *dev)
+{
+	switch (dev->control_state.state) {
+	case DATA_OUT:
+	case LAST_DATA_OUT:
+	case STATUS_OUT:
+		if (!lpc43xx_ep_busy(0, false)) {
+			lpc43xx_out_prime(dev, 0);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void lpc43xx_set_address(usbd_device *dev, uint8_t addr)
+{
+	(void)dev;
+
+	/* Takes effect once the status stage has gone. */
+	USB0_DEVICEADDR = USB0_DEVICEADDR_USBADR(addr) | USB0_DEVICEADDR_USBADRA;
+}
+
+static void lpc43xx_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
+			     uint16_t max_size, usbd_endpoint_callback callback)
+{
+	const uint8_t ep = addr & 0x7f;
+	const bool in = addr & 0x80;
+	const uint8_t i = lpc43xx_ep_index(ep, in);
+	/* Zero length packets are left to the stack. */
+	const uint32_t capabilities = USB_QH_CAPABILITIES_MPL(max_size) | USB_QH_CAPABILITIES_ZLT;
+
+	type &= USB_ENDPOINT_ATTR_TYPE;
+
+	if (ep == 0) {
+		qh[0].capabilities = capabilities | USB_QH_CAPABILITIES_IOS;
+		qh[1].capabilities = capabilities;
+		qh[0].next_dtd_pointer = USB_TD_NEXT_DTD_POINTER_TERMINATE;
+		qh[1].next_dtd_pointer = USB_TD_NEXT_DTD_POINTER_TERMINATE;
+		return;
+	}
+
+	if ((ep >= ENDPOINT_COUNT) || (max_size > LPC43XX_PACKET_SIZE)) {
+		return;
+	}
+
+	qh[i].capabilities = capabilities |
+		(type == USB_ENDPOINT_ATTR_ISOCHRONOUS ? USB_QH_CAPABILITIES_MULT(1) : 0);
+	qh[i].next_dtd_pointer = USB_TD_NEXT_DTD_POINTER_TERMINATE;
+	qh[i].total_bytes = 0;
+
+	/*
+	 * Endpoints 1 to 5 share the layout of ENDPTCTRL1.  A direction left
+	 * disabled must not stay a control endpoint, make it bulk.
+	 */
+	uint32_t ctrl = USB0_ENDPTCTRL(ep);
+	if (in) {
+		ctrl &= ~(USB0_ENDPTCTRL1_TXS | USB0_ENDPTCTRL1_TXT1_0_MASK);
+		ctrl |= USB0_ENDPTCTRL1_TXT1_0(type) | USB0_ENDPTCTRL1_TXR | USB0_ENDPTCTRL1_TXE;
+		if (!(ctrl & USB0_ENDPTCTRL1_RXE)) {
+			ctrl = (ctrl & ~USB0_ENDPTCTRL1_RXT_MASK) | USB0_ENDPTCTRL1_RXT(USB_ENDPOINT_ATTR_BULK);
+		}
+		if (callback) {
+			dev->user_callback_ctr[ep][USB_TRANSACTION_IN] = callback;
+		}
+		USB0_ENDPTCTRL(ep) = ctrl;
+	} else {
+		ctrl &= ~(USB0_ENDPTCTRL1_RXS | USB0_ENDPTCTRL1_RXT_MASK);
+		ctrl |= USB0_ENDPTCTRL1_RXT(type) | USB0_ENDPTCTRL1_RXR | USB0_ENDPTCTRL1_RXE;
+		if (!(ctrl & USB0_ENDPTCTRL1_TXE)) {
+			ctrl = (ctrl & ~USB0_ENDPTCTRL1_TXT1_0_MASK) |
+				USB0_ENDPTCTRL1_TXT1_0(USB_ENDPOINT_ATTR_BULK);
+		}
+		if (callback) {
+			dev->user_callback_ctr[ep][USB_TRANSACTION_OUT] = callback;
+		}
+		USB0_ENDPTCTRL(ep) = ctrl;
+		lpc43xx_out_prime(dev, ep);
+	}
+}
+
+/* Every endpoint but 0, both directions */
+#define LPC43XX_EP_BITS_NONZERO \
+	(USB0_ENDPTPRIME_PERB(0x3e) | USB0_ENDPTPRIME_PETB(0x3e))
+
+static void lpc43xx_endpoints_reset(usbd_device *dev)
+{
+	(void)dev;
+
+	for (uint8_t ep = 1; ep < ENDPOINT_COUNT; ep++) {
+		USB0_ENDPTCTRL(ep) = 0;
+	}
+	lpc43xx_ep_flush(LPC43XX_EP_BITS_NONZERO);
+	USB0_ENDPTCOMPLETE = LPC43XX_EP_BITS_NONZERO;
+}
+
+static void lpc43xx_ep_stall_set(usbd_device *dev, uint8_t addr, uint8_t stall)
+{
+	const uint8_t ep = addr & 0x7f;
+	(void)dev;
+
+	/* Endpoint 0 stalls both ways, until the next SETUP. */
+	if (ep == 0) {
+		if (stall) {
+			USB0_ENDPTCTRL0 |= USB0_ENDPTCTRL0_RXS | USB0_ENDPTCTRL0_TXS;
+		} else {
+			USB0_ENDPTCTRL0 &= ~(USB0_ENDPTCTRL0_RXS | USB0_ENDPTCTRL0_TXS);
+		}
+		return;
+	}
+
+	const uint32_t stall_bit = (addr & 0x80) ? USB0_ENDPTCTRL1_TXS : USB0_ENDPTCTRL1_RXS;
+	const uint32_t reset_bit = (addr & 0x80) ? USB0_ENDPTCTRL1_TXR : USB0_ENDPTCTRL1_RXR;
+
+	if (stall) {
+		USB0_ENDPTCTRL(ep) |= stall_bit;
+	} else {
+		/* Clearing a halt starts over from DATA0. */
+		USB0_ENDPTCTRL(ep) = (USB0_ENDPTCTRL(ep) & ~stall_bit) | reset_bit;
+	}
+}
+
+static uint8_t lpc43xx_ep_stall_get(usbd_device *dev, uint8_t addr)
+{
+	const uint8_t ep = addr & 0x7f;
+	(void)dev;
+
+	if (ep == 0) {
+		return (USB0_ENDPTCTRL0 & (USB0_ENDPTCTRL0_RXS | USB0_ENDPTCTRL0_TXS)) ? 1 : 0;
+	}
+	return (USB0_ENDPTCTRL(ep) & ((addr & 0x80) ? USB0_ENDPTCTRL1_TXS : USB0_ENDPTCTRL1_RXS)) ? 1 : 0;
+}
+
+static void lpc43xx_ep_nak_set(usbd_device *dev, uint8_t addr, uint8_t nak)
+{
+	/* An IN endpoint NAKs until something is written anyway. */
+	if ((addr & 0x80) || (addr == 0)) {
+		return;
+	}
+
+	dev->force_nak[addr] = nak;
+
+	if (nak) {
+		/* A packet that came in meanwhile is still handed over. */
+		lpc43xx_ep_flush(lpc43xx_ep_bit(addr, false));
+	} else if (!lpc43xx_ep_busy(addr, false)) {
+		lpc43xx_out_prime(dev, addr);
+	}
+}
+
+static bool lpc43xx_ep_in_busy(usbd_device *dev, uint8_t addr)
+{
+	(void)dev;
+
+	return lpc43xx_ep_busy(addr & 0x7f, true);
+}
+
+static uint16_t lpc43xx_ep_write_packet(usbd_device *dev, uint8_t addr,
+					const void *buf, uint16_t len)
+{
+	const uint8_t ep = addr & 0x7f;
+	uint8_t *const packet = packet_buf[lpc43xx_ep_index(ep, true)];
+	(void)dev;
+
+	if (lpc43xx_ep_busy(ep, true)) {
+		return 0;
+	}
+
+	len = MIN(len, LPC43XX_PACKET_SIZE);
+	if (len) {
+		memcpy(packet, buf, len);
+	}
+	lpc43xx_ep_prime(ep, true, packet, len);
+
+	return len;
+}
+
+/*
+ * Send whole packets straight from buf, as many as one dTD takes.  The
+ * stack comes back for the rest once they have gone.
+ */
+static uint16_t lpc43xx_ep_write_transfer(usbd_device *dev, uint8_t addr,
+					  const void *buf, uint16_t len)
+{
+	const uint8_t ep = addr & 0x7f;
+	const uint16_t size = dev->ep_max_size[ep][USB_TRANSACTION_IN];
+	const uint32_t room = lpc43xx_dtd_room(buf);
+
+	if ((size == 0) || lpc43xx_ep_busy(ep, true)) {
+		return 0;
+	}
+
+	if (len > room) {
+		len = room - room % size;
+	}
+	lpc43xx_ep_prime(ep, true, buf, len);
+
+	return len;
+}
+
+static uint16_t lpc43xx_ep_read_packet(usbd_device *dev, uint8_t addr,
+				       void *buf, uint16_t len)
+{
+	(void)addr;
+
+	/* Already in place when the controller wrote to a transfer's buffer. */
+	len = MIN(len, dev->rxbcnt);
+	if (len && (buf != dev->dma_rx)) {
+		memcpy(buf, dev->dma_rx, len);
+	}
+	dev->dma_rx += len;
+	dev->rxbcnt -= len;
+
+	return len;
+}
+
+static void lpc43xx_poll_setup(usbd_device *dev)
+{
+	volatile uint8_t *const setup = qh[0].setup;
+	uint8_t *const req = (uint8_t *)&dev->control_state.req;
+
+	USB0_ENDPTSETUPSTAT = 1;
+
+	/* The tripwire drops if another SETUP overwrote this one meanwhile. */
+	do {
+		USB0_USBCMD_D |= USB0_USBCMD_D_SUTW;
+		for (uint8_t i = 0; i < 8; i++) {
+			req[i] = setup[i];
+		}
+	} while (!(USB0_USBCMD_D & USB0_USBCMD_D_SUTW));
+	USB0_USBCMD_D &= ~USB0_USBCMD_D_SUTW;
+
+	/* Anything still queued belongs to a control transfer cut short. */
+	lpc43xx_ep_flush(lpc43xx_ep_bit(0, false) | lpc43xx_ep_bit(0, true));
+	USB0_ENDPTCOMPLETE = lpc43xx_ep_bit(0, false) | lpc43xx_ep_bit(0, true);
+
+	dev->user_callback_ctr[0][USB_TRANSACTION_SETUP](dev, 0);
+	lpc43xx_ep0_out_prime(dev);
+}
+
+static void lpc43xx_poll_out(usbd_device *dev, uint8_t ep)
+{
+	const uint32_t len = dev->dma_out_len[ep] - lpc43xx_dtd_left(ep, false);
+	const uint16_t size = dev->ep_max_size[ep][USB_TRANSACTION_OUT];
+	const usbd_endpoint_callback callback = dev->user_callback_ctr[ep][USB_TRANSACTION_OUT];
+
+	dev->rxbcnt = len;
+	dev->dma_rx = dev->dma_out[ep];
+	if (callback) {
+		callback(dev, ep);
+	}
+
+	/* Whole packets cut short by a zero length one: pass that on too. */
+	if (callback && size && len && (len < dev->dma_out_len[ep]) && !(len % size)) {
+		dev->rxbcnt = 0;
+		callback(dev, ep);
+	}
+	dev->rxbcnt = 0;
+
+	if (ep == 0) {
+		lpc43xx_ep0_out_prime(dev);
+	} else if (!lpc43xx_ep_busy(ep, false)) {
+		lpc43xx_out_prime(dev, ep);
+	}
+}
+
+static void lpc43xx_poll(usbd_device *dev)
+{
+	const uint32_t sts = USB0_USBSTS_D;
+
+	USB0_USBSTS_D = sts;
+
+	if (sts & USB0_USBSTS_D_URI) {
+		USB0_ENDPTSETUPSTAT = USB0_ENDPTSETUPSTAT;
+		USB0_ENDPTCOMPLETE = USB0_ENDPTCOMPLETE;
+		lpc43xx_ep_flush(USB0_ENDPTPRIME_PERB(0x3f) | USB0_ENDPTPRIME_PETB(0x3f));
+		dev->suspended = false;
+		_usbd_reset(dev);
+		return;
+	}
+
+	if (sts & USB0_USBSTS_D_SLI) {
+		dev->suspended = true;
+		if (dev->user_callback_suspend) {
+			dev->user_callback_suspend();
+		}
+	}
+
+	if ((sts & USB0_USBSTS_D_PCI) && dev->suspended && !(USB0_PORTSC1_D & USB0_PORTSC1_D_SUSP)) {
+		dev->suspended = false;
+		if (dev->user_callback_resume) {
+			dev->user_callback_resume();
+		}
+	}
+
+	if ((sts & USB0_USBSTS_D_SRI) && dev->user_callback_sof) {
+		dev->user_callback_sof();
+	}
+
+	/*
+	 * Finished dTDs before a new SETUP: the status stage of the last
+	 * control transfer may have gone just before it.
+	 */
+	const uint32_t complete = USB0_ENDPTCOMPLETE;
+	USB0_ENDPTCOMPLETE = complete;
+	for (uint8_t ep = 0; ep < ENDPOINT_COUNT; ep++) {
+		if ((complete & lpc43xx_ep_bit(ep, true)) && dev->user_callback_ctr[ep][USB_TRANSACTION_IN]) {
+			dev->user_callback_ctr[ep][USB_TRANSACTION_IN](dev, ep);
+			if (ep == 0) {
+				lpc43xx_ep0_out_prime(dev);
+			}
+		}
+		if (complete & lpc43xx_ep_bit(ep, false)) {
+			lpc43xx_poll_out(dev, ep);
+		}
+	}
+
+	if (USB0_ENDPTSETUPSTAT & 1) {
+		lpc43xx_poll_setup(dev);
+	}
+
+	if (dev->user_callback_sof) {
+		USB0_USBINTR_D |= USB0_USBINTR_D_SRE;
+	} else {
+		USB0_USBINTR_D &= ~USB0_USBINTR_D_SRE;
+	}
+}
+
+static void lpc43xx_disconnect(usbd_device *dev, bool disconnected)
+{
+	(void)dev;
+
+	if (disconnected) {
+		USB0_USBCMD_D &= ~USB0_USBCMD_D_RS;
+	} else {
+		USB0_USBCMD_D |= USB0_USBCMD_D_RS;
+	}
+}
+
+const struct _usbd_driver lpc43xx_usb_driver = {
+	.init = lpc43xx_usbd_init,
+	.set_address = lpc43xx_set_address,
+	.ep_setup = lpc43xx_ep_setup,
+	.ep_reset = lpc43xx_endpoints_reset,
+	.ep_stall_set = lpc43xx_ep_stall_set,
+	.ep_stall_get = lpc43xx_ep_stall_get,
+	.ep_nak_set = lpc43xx_ep_nak_set,
+	.ep_write_packet = lpc43xx_ep_write_packet,
+	.ep_read_packet = lpc43xx_ep_read_packet,
+	.ep_in_busy = lpc43xx_ep_in_busy,
+	.ep_write_transfer = lpc43xx_ep_write_transfer,
+	.poll = lpc43xx_poll,
+	.disconnect = lpc43xx_disconnect,
+	.base_address = USB0_BASE,
+	.set_address_before_status = 1,
+};
+
+/** Initialize USB0 of the LPC43xx, at high speed on the on chip PHY. */
+static usbd_device *lpc43xx_usbd_init(usbd_device *usbd_dev)
+{
+	/* Clock the controller from PLL0USB, and power up the PHY. */
+	CGU_BASE_USB0_CLK = CGU_BASE_USB0_CLK_CLK_SEL(CGU_SRC_PLL0USB) | CGU_BASE_USB0_CLK_AUTOBLOCK;
+	CCU1_CLK_M4_USB0_CFG |= LPC43XX_CCU_CFG_RUN;
+	CCU1_CLK_USB0_CFG |= LPC43XX_CCU_CFG_RUN;
+	CREG_CREG0 &= ~CREG_CREG0_USB0PHY;
+
+	RESET_CTRL0 = RESET_CTRL0_USB0_RST;
+	while (!(RESET_ACTIVE_STATUS0 & RESET_ACTIVE_STATUS0_USB0_RST));
+
+	USB0_USBCMD_D &= ~USB0_USBCMD_D_RS;
+	USB0_USBCMD_D = USB0_USBCMD_D_RST;
+	while (USB0_USBCMD_D & USB0_USBCMD_D_RST);
+
+	/* Device mode, SETUPs read under the tripwire instead of locked out. */
+	USB0_USBMODE_D = USB0_USBMODE_D_CM1_0(2) | USB0_USBMODE_D_SLOM;
+
+	memset(qh, 0, sizeof(qh));
+	memset(dtd, 0, sizeof(dtd));
+	for (uint8_t i = 0; i < ENDPOINT_COUNT * 2; i++) {
+		qh[i].next_dtd_pointer = USB_TD_NEXT_DTD_POINTER_TERMINATE;
+	}
+	USB0_ENDPOINTLISTADDR = (uintptr_t)qh;
+
+	USB0_USBINTR_D = USB0_USBINTR_D_UE | USB0_USBINTR_D_UEE | USB0_USBINTR_D_PCE |
+		USB0_USBINTR_D_URE | USB0_USBINTR_D_SLE;
+
+	usbd_dev->suspended = false;
+	USB0_USBCMD_D |= USB0_USBCMD_D_RS;
+
+	return usbd_dev;
+}
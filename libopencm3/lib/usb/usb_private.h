@@ -39,17 +39,39 @@ LGPL License Terms @ref lgpl_license
 #define __USB_PRIVATE_H
 
 #define MAX_USER_CONTROL_CALLBACK	4
+#define MAX_USER_CONTROL_SINK		2
 #define MAX_USER_SET_CONFIG_CALLBACK	4
 
+/* Requests usbd_ep_queue_in/out() can hold, all endpoints together */
+#ifndef USBD_QUEUE_POOL_SIZE
+#define USBD_QUEUE_POOL_SIZE		8
+#endif
+#define USBD_QUEUE_END			0xff
+
+/* Devices usbd_init() hands out, one per driver: parts with both OTG_FS and
+ * OTG_HS may run the two side by side */
+#ifndef USBD_DEFAULT_DEVICES
+#if defined(STM32F2) || defined(STM32F4) || defined(STM32F7) || defined(STM32H7)
+#define USBD_DEFAULT_DEVICES		2
+#else
+#define USBD_DEFAULT_DEVICES		1
+#endif
+#endif
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 /* The max number of endpoints is core-dependant - for the F4 it's 4, for the H7 it's 8 */
 #if defined(STM32H7)
 #define ENDPOINT_COUNT 8U
+#elif defined(LPC43XX)
+#define ENDPOINT_COUNT 6U
 #else
 #define ENDPOINT_COUNT 4U
 #endif
 
+/* Largest packet of a DWC endpoint in buffer DMA mode */
+#define DWC_DMA_PACKET_SIZE 512U
+
 /** Internal collection of device information. */
 struct _usbd_device {
 	const struct usb_device_descriptor *desc;
@@ -61,10 +83,17 @@ struct _usbd_device {
 	uint8_t *ctrl_buf;  /**< Internal buffer used for control transfers */
 	uint16_t ctrl_buf_len;
 
+	/** Serialized configuration descriptors, back to back, or NULL */
+	const uint8_t *config_cache;
+
 	uint8_t current_address;
 	uint8_t current_config;
 
-	uint16_t pm_top;    /**< Top of allocated endpoint buffer memory */
+	/** Endpoint buffer memory held per endpoint and direction */
+	struct usb_pm_block {
+		uint16_t addr;
+		uint16_t size;	/**< 0 if none */
+	} pm_block[8][2];
 
 	/* User callback functions for various USB events */
 	void (*user_callback_reset)(void);
@@ -83,6 +112,11 @@ struct _usbd_device {
 		uint16_t ctrl_len;
 		usbd_control_complete_callback complete;
 		bool needs_zlp;
+		/* Data stage pulled from or pushed to these instead of
+		 * ctrl_buf, if set */
+		usbd_control_source_callback source;
+		usbd_control_sink_callback sink;
+		uint16_t source_offset;
 	} control_state;
 
 	usbd_microsoft_os_req_callback microsoft_os_req_callback;
@@ -95,8 +129,66 @@ struct _usbd_device {
 		uint8_t type_mask;
 	} user_control_callback[MAX_USER_CONTROL_CALLBACK];
 
+	struct user_control_sink {
+		usbd_control_sink_callback cb;
+		uint8_t type;
+		uint8_t type_mask;
+	} user_control_sink[MAX_USER_CONTROL_SINK];
+
 	usbd_endpoint_callback user_callback_ctr[8][3];
 
+	/* Packet size of each endpoint, by number and USB_TRANSACTION_IN/OUT */
+	uint16_t ep_max_size[8][2];
+
+	/* Endpoint numbers to set up double buffered, one bit each */
+	uint8_t double_buffer;
+
+	/* OUT endpoints held at NAK by usbd_ep_nak_set(), by number */
+	uint8_t force_nak[8];
+
+	/* st_usbfs: double buffered IN endpoints with a packet waiting for
+	 * the other buffer, one bit each */
+	uint8_t dbuf_pending;
+
+	/* lpc43xx: the bus is suspended, so the resume is reported once */
+	bool suspended;
+
+	/* Transfers started with usbd_ep_transfer_in/out() */
+	struct usb_transfer_state {
+		bool busy;
+		bool zlp;	/* IN: a short packet must still end it */
+		union {
+			const uint8_t *in;
+			uint8_t *out;
+		} buf;
+		uint16_t len;
+		uint16_t done;
+		uint16_t pending;	/* IN: bytes in the packets on their way */
+		usbd_transfer_complete_callback complete;
+		/* Endpoint callback to put back once the transfer is over */
+		usbd_endpoint_callback callback;
+	} transfer[8][2];
+
+	/* Requests queued with usbd_ep_queue_in/out(), linked by index.  The
+	 * head of an endpoint's queue is the transfer in progress. */
+	struct usb_queue_entry {
+		union {
+			const uint8_t *in;
+			uint8_t *out;
+		} buf;
+		uint16_t len;
+		bool zlp;
+		uint8_t next;
+		usbd_transfer_complete_callback complete;
+	} queue_pool[USBD_QUEUE_POOL_SIZE];
+	uint8_t queue_free;
+	struct usb_ep_queue {
+		uint8_t head;
+		uint8_t tail;
+		uint8_t count;
+		uint8_t depth;	/* 0 for as many as the pool has */
+	} queue[8][2];
+
 	/* User callback function for some standard USB function hooks */
 	usbd_set_config_callback user_callback_set_config[MAX_USER_SET_CONFIG_CALLBACK];
 
@@ -104,6 +196,10 @@ struct _usbd_device {
 
 	const struct _usbd_driver *driver;
 
+	/* Transfer events a driver's poll may handle per call, see
+	 * usbd_set_poll_budget() */
+	uint8_t poll_budget;
+
 	/* Extra, non-contiguous user string descriptor index and value */
 	int extra_string_idx;
 	const char* extra_string;
@@ -112,7 +208,6 @@ struct _usbd_device {
 
 	uint16_t fifo_mem_top;
 	uint16_t fifo_mem_top_ep0;
-	uint8_t force_nak[ENDPOINT_COUNT];
 	/*
 	 * We keep a backup copy of the out endpoint size registers to restore
 	 * them after a transaction.
@@ -124,6 +219,37 @@ struct _usbd_device {
 	 * for use in stm32f107_ep_read_packet().
 	 */
 	uint16_t rxbcnt;
+	/*
+	 * Isochronous IN endpoints being disabled after missing their frame,
+	 * one bit each, until the core reports EPDISD for them.
+	 */
+	uint16_t iso_in_dropping;
+
+	/*
+	 * Buffer DMA mode, on cores that have it: a word aligned packet buffer
+	 * per endpoint and direction, by number and USB_TRANSACTION_IN/OUT.
+	 * NULL when the FIFOs are read and written by the CPU.  The LPC43xx
+	 * controller always works this way, and shares the fields below.
+	 */
+	uint32_t (*dma_buf)[2][DWC_DMA_PACKET_SIZE / 4];
+	/* Where the core puts the data of each OUT endpoint, and how much it
+	 * was armed for: its packet buffer, or straight into a transfer */
+	uint8_t *dma_out[ENDPOINT_COUNT];
+	uint32_t dma_out_len[ENDPOINT_COUNT];
+	/* Next byte of the received data for dwc_ep_read_packet() */
+	const uint8_t *dma_rx;
+
+	/*
+	 * lm4f: the application's uDMA channel control table, NULL when the
+	 * CPU moves all packets.  Endpoints with a transfer on the uDMA, one
+	 * bit each, the OUT bytes each was armed for, and those landed for
+	 * lm4f_ep_read_packet() to hand over.
+	 */
+	struct udma_channel_control *udma;
+	uint8_t udma_in;
+	uint8_t udma_out;
+	uint16_t udma_out_len[ENDPOINT_COUNT];
+	uint16_t udma_rx;
 };
 
 enum _usbd_transaction {
@@ -152,10 +278,12 @@ enum usbd_request_return_codes _usbd_standard_request(usbd_device *usbd_dev, str
 			   uint8_t **buf, uint16_t *len);
 
 void _usbd_reset(usbd_device *usbd_dev);
+void _usbd_ep_transfers_reset(usbd_device *usbd_dev);
 
 /* Functions provided by the hardware abstraction. */
 struct _usbd_driver {
-	usbd_device *(*init)(void);
+	/* Bring up the peripheral for the cleared usbd_dev, return it or NULL */
+	usbd_device *(*init)(usbd_device *usbd_dev);
 	void (*set_address)(usbd_device *usbd_dev, uint8_t addr);
 	void (*ep_setup)(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 			 uint16_t max_size, usbd_endpoint_callback cb);
@@ -168,10 +296,20 @@ struct _usbd_driver {
 				    const void *buf, uint16_t len);
 	uint16_t (*ep_read_packet)(usbd_device *usbd_dev, uint8_t addr,
 				   void *buf, uint16_t len);
+	/* Optional: queue the packets of buf back to back, like
+	 * ep_write_packet, and return the bytes taken: whole packets if not
+	 * all of buf, 0 to have them written one at a time */
+	uint16_t (*ep_write_transfer)(usbd_device *usbd_dev, uint8_t addr,
+				      const void *buf, uint16_t len);
+	/* Optional: true while ep_write_packet would refuse a packet, the
+	 * only way to know whether a zero length one was taken */
+	bool (*ep_in_busy)(usbd_device *usbd_dev, uint8_t addr);
 	void (*poll)(usbd_device *usbd_dev);
 	void (*disconnect)(usbd_device *usbd_dev, bool disconnected);
+	uint16_t (*ep_memory_free)(usbd_device *usbd_dev);
 	uint32_t base_address;
 	bool set_address_before_status;
+	bool double_buffer;	/* Bulk endpoints can be double buffered */
 	uint16_t rx_fifo_size;
 };
 
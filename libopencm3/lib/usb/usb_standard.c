@@ -36,6 +36,7 @@ LGPL License Terms @ref lgpl_license
 /**@{*/
 
 #include <string.h>
+#include <libopencm3/cm3/assert.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/bos.h>
 #include <libopencm3/usb/microsoft.h>
@@ -70,19 +71,56 @@ void usbd_register_set_altsetting_callback(usbd_device *usbd_dev,
 	usbd_dev->user_callback_set_altsetting = callback;
 }
 
+/*
+ * The part of a descriptor being serialized that lands in buf: len bytes
+ * from offset on.  Everything before and after is only counted, so a
+ * descriptor can be produced one packet at a time.
+ */
+struct desc_window {
+	uint8_t *buf;
+	uint16_t offset;
+	uint16_t len;
+	uint16_t pos;		/* Bytes of the descriptor walked so far */
+};
+
+static void window_write(struct desc_window *w, uint16_t at,
+			 const void *src, uint16_t n)
+{
+	uint32_t start = at, end = (uint32_t)at + n;
+	uint32_t win_end = (uint32_t)w->offset + w->len;
+
+	if ((end <= w->offset) || (start >= win_end)) {
+		return;
+	}
+	if (start < w->offset) {
+		start = w->offset;
+	}
+	if (end > win_end) {
+		end = win_end;
+	}
+	memcpy(w->buf + (start - w->offset),
+	       (const uint8_t *)src + (start - at), end - start);
+}
+
+static void window_append(struct desc_window *w, const void *src, uint16_t n)
+{
+	window_write(w, w->pos, src, n);
+	w->pos += n;
+}
+
+/* Serialize bytes offset to offset + len of configuration index into buf,
+ * as far as the descriptor goes, and return its wTotalLength. */
 static uint16_t build_config_descriptor(usbd_device *usbd_dev,
-				   uint8_t index, uint8_t *buf, uint16_t len)
+				   uint8_t index, uint8_t *buf,
+				   uint16_t offset, uint16_t len)
 {
-	uint8_t *tmpbuf = buf;
 	const struct usb_config_descriptor *cfg = &usbd_dev->config[index];
-	uint16_t count, total = 0, totallen = 0;
+	struct desc_window w = {
+		.buf = buf, .offset = offset, .len = len, .pos = 0,
+	};
 	uint16_t i, j, k;
 
-	memcpy(buf, cfg, count = MIN(len, cfg->bLength));
-	buf += count;
-	len -= count;
-	total += count;
-	totallen += cfg->bLength;
+	window_append(&w, cfg, cfg->bLength);
 
 	/* For each interface... */
 	for (i = 0; i < cfg->bNumInterfaces; i++) {
@@ -90,60 +128,144 @@ static uint16_t build_config_descriptor(usbd_device *usbd_dev,
 		if (cfg->interface[i].iface_assoc) {
 			const struct usb_iface_assoc_descriptor *assoc =
 					cfg->interface[i].iface_assoc;
-			memcpy(buf, assoc, count = MIN(len, assoc->bLength));
-			buf += count;
-			len -= count;
-			total += count;
-			totallen += assoc->bLength;
+			window_append(&w, assoc, assoc->bLength);
 		}
 		/* For each alternate setting... */
 		for (j = 0; j < cfg->interface[i].num_altsetting; j++) {
 			const struct usb_interface_descriptor *iface =
 					&cfg->interface[i].altsetting[j];
 			/* Copy interface descriptor. */
-			memcpy(buf, iface, count = MIN(len, iface->bLength));
-			buf += count;
-			len -= count;
-			total += count;
-			totallen += iface->bLength;
+			window_append(&w, iface, iface->bLength);
 			/* Copy extra bytes (function descriptors). */
 			if (iface->extra) {
-				memcpy(buf, iface->extra,
-				       count = MIN(len, iface->extralen));
-				buf += count;
-				len -= count;
-				total += count;
-				totallen += iface->extralen;
+				window_append(&w, iface->extra,
+					      iface->extralen);
 			}
 			/* For each endpoint... */
 			for (k = 0; k < iface->bNumEndpoints; k++) {
 				const struct usb_endpoint_descriptor *ep =
 				    &iface->endpoint[k];
-				memcpy(buf, ep, count = MIN(len, ep->bLength));
-				buf += count;
-				len -= count;
-				total += count;
-				totallen += ep->bLength;
+				window_append(&w, ep, ep->bLength);
 				/* Copy extra bytes (class specific). */
 				if (ep->extra) {
-					memcpy(buf, ep->extra,
-					       count = MIN(len, ep->extralen));
-					buf += count;
-					len -= count;
-					total += count;
-					totallen += ep->extralen;
+					window_append(&w, ep->extra,
+						      ep->extralen);
 				}
 			}
 		}
 	}
 
-	/* Fill in wTotalLength.
-	 * Note that tmpbuf is sometimes not halfword-aligned */
-	memcpy((tmpbuf + 2), &totallen, sizeof(uint16_t));
+	/* Fill in wTotalLength, now that it is known.
+	 * Note that buf is sometimes not halfword-aligned */
+	window_write(&w, 2, &w.pos, sizeof(uint16_t));
+
+	return w.pos;
+}
+
+uint16_t usbd_register_config_cache(usbd_device *usbd_dev,
+				    uint8_t *buf, uint16_t len)
+{
+	uint16_t total = 0;
+	uint8_t i;
+
+	usbd_dev->config_cache = NULL;
+
+	for (i = 0; i < usbd_dev->desc->bNumConfigurations; i++) {
+		uint16_t totallen = build_config_descriptor(usbd_dev, i,
+						buf + total, 0, len - total);
+
+		/* A truncated copy is no use, keep building on request. */
+		if (totallen > len - total)
+			return 0;
+		total += totallen;
+	}
 
+	usbd_dev->config_cache = buf;
 	return total;
 }
 
+/*
+ * What the usbdesc.h macros cannot check field by field: bNumInterfaces and
+ * bNumEndpoints against the descriptors that follow, and interface numbers
+ * counting up from 0 with alternate settings in order after them.
+ */
+static bool config_descriptor_valid(const uint8_t *cfg)
+{
+	const uint16_t totallen = cfg[2] | (cfg[3] << 8);
+	int interfaces = 0, iface = -1, alt = -1, endpoints = 0;
+	uint16_t i;
+
+	if ((cfg[0] != USB_DT_CONFIGURATION_SIZE) ||
+	    (cfg[1] != USB_DT_CONFIGURATION) ||
+	    (totallen < USB_DT_CONFIGURATION_SIZE)) {
+		return false;
+	}
+
+	for (i = cfg[0]; i < totallen; i += cfg[i]) {
+		if ((cfg[i] < 2) || (i + cfg[i] > totallen)) {
+			return false;
+		}
+
+		if (cfg[i + 1] == USB_DT_ENDPOINT) {
+			if (iface < 0) {
+				return false;
+			}
+			endpoints--;
+		} else if (cfg[i + 1] == USB_DT_INTERFACE) {
+			if (endpoints) {
+				return false;
+			}
+			if (cfg[i + 3] == 0) {
+				/* A new interface, the next number. */
+				if (cfg[i + 2] != interfaces) {
+					return false;
+				}
+				interfaces++;
+			} else if ((cfg[i + 2] != iface) ||
+				   (cfg[i + 3] != alt + 1)) {
+				return false;
+			}
+			iface = cfg[i + 2];
+			alt = cfg[i + 3];
+			endpoints = cfg[i + 4];
+		}
+	}
+
+	return !endpoints && (interfaces == cfg[4]);
+}
+
+void usbd_register_config_descriptors(usbd_device *usbd_dev,
+				      const uint8_t *descriptors)
+{
+	const uint8_t *cfg = descriptors;
+	uint8_t i;
+
+	for (i = 0; i < usbd_dev->desc->bNumConfigurations; i++) {
+		cm3_assert(config_descriptor_valid(cfg));
+		cfg += cfg[2] | (cfg[3] << 8);
+	}
+
+	usbd_dev->config_cache = descriptors;
+}
+
+/* Configuration index in the cache, NULL if there is no such one. */
+static const uint8_t *cached_config_descriptor(usbd_device *usbd_dev,
+					       uint8_t index)
+{
+	const uint8_t *cfg = usbd_dev->config_cache;
+	uint16_t totallen;
+
+	if (index >= usbd_dev->desc->bNumConfigurations)
+		return NULL;
+
+	while (index--) {
+		memcpy(&totallen, cfg + 2, sizeof(uint16_t));
+		cfg += totallen;
+	}
+
+	return cfg;
+}
+
 /* This can return 0 to indicate an error in the descriptor */
 static uint16_t build_devcap_platform(const usb_platform_device_capability_descriptor *const plat,
 					uint8_t *const buf, uint16_t len)
@@ -208,12 +330,64 @@ static int usb_descriptor_index(uint16_t wValue)
 	return wValue & 0xFF;
 }
 
+static bool config_descriptor_source(usbd_device *usbd_dev,
+				     struct usb_setup_data *req,
+				     uint16_t offset, uint8_t *buf,
+				     uint16_t len)
+{
+	build_config_descriptor(usbd_dev, usb_descriptor_index(req->wValue),
+				buf, offset, len);
+	return true;
+}
+
+/* String descriptor descr_idx, which must exist and not be the LANGIDs. */
+static const char *usb_string(usbd_device *usbd_dev, int descr_idx)
+{
+	if (descr_idx == usbd_dev->extra_string_idx) {
+		return usbd_dev->extra_string;
+	}
+	return usbd_dev->strings[descr_idx - 1];
+}
+
+static uint16_t string_descriptor_length(const char *str)
+{
+	/* This string is returned as UTF16, hence the multiplication.
+	 * bLength is a byte, longer strings are cut short. */
+	size_t len = strlen(str) * 2 + 2;
+
+	return MIN(len, 254);
+}
+
+static bool string_descriptor_source(usbd_device *usbd_dev,
+				     struct usb_setup_data *req,
+				     uint16_t offset, uint8_t *buf,
+				     uint16_t len)
+{
+	const char *str = usb_string(usbd_dev,
+				     usb_descriptor_index(req->wValue));
+	uint16_t i;
+
+	for (i = 0; i < len; i++) {
+		uint16_t pos = offset + i;
+
+		if (pos == 0) {
+			buf[i] = string_descriptor_length(str);
+		} else if (pos == 1) {
+			buf[i] = USB_DT_STRING;
+		} else {
+			/* Low byte from the ASCII string, high byte 0. */
+			buf[i] = (pos & 1) ? 0 : str[(pos - 2) / 2];
+		}
+	}
+	return true;
+}
+
 static enum usbd_request_return_codes
 usb_standard_get_descriptor(usbd_device *usbd_dev,
 			    struct usb_setup_data *req,
 			    uint8_t **buf, uint16_t *len)
 {
-	int i, array_idx, descr_idx;
+	int array_idx, descr_idx;
 	struct usb_string_descriptor *sd;
 
 	descr_idx = usb_descriptor_index(req->wValue);
@@ -224,8 +398,24 @@ usb_standard_get_descriptor(usbd_device *usbd_dev,
 		*len = MIN(*len, usbd_dev->desc->bLength);
 		return USBD_REQ_HANDLED;
 	case USB_DT_CONFIGURATION:
-		*buf = usbd_dev->ctrl_buf;
-		*len = build_config_descriptor(usbd_dev, descr_idx, *buf, *len);
+		if (usbd_dev->config_cache) {
+			const uint8_t *cfg =
+				cached_config_descriptor(usbd_dev, descr_idx);
+			uint16_t totallen;
+
+			if (!cfg)
+				return USBD_REQ_NOTSUPP;
+			memcpy(&totallen, cfg + 2, sizeof(uint16_t));
+			*buf = (uint8_t *)cfg;
+			*len = MIN(*len, totallen);
+			return USBD_REQ_HANDLED;
+		}
+		if (descr_idx >= usbd_dev->desc->bNumConfigurations)
+			return USBD_REQ_NOTSUPP;
+		/* Built a packet at a time as the host takes it. */
+		*len = MIN(*len, build_config_descriptor(usbd_dev, descr_idx,
+							  NULL, 0, 0));
+		usbd_control_set_source(usbd_dev, config_descriptor_source);
 		return USBD_REQ_HANDLED;
 	case USB_DT_BOS:
 		if (!usbd_dev->bos || descr_idx != 0)
@@ -234,31 +424,21 @@ usb_standard_get_descriptor(usbd_device *usbd_dev,
 		*len = build_bos_descriptor(usbd_dev, *buf, *len);
 		return *len ? USBD_REQ_HANDLED : USBD_REQ_NOTSUPP;
 	case USB_DT_STRING:
-		sd = (struct usb_string_descriptor *)usbd_dev->ctrl_buf;
-
 		if (descr_idx == 0) {
 			/* Send sane Language ID descriptor... */
+			sd = (struct usb_string_descriptor *)usbd_dev->ctrl_buf;
 			sd->wData[0] = USB_LANGID_ENGLISH_US;
 			sd->bLength = sizeof(sd->bLength) +
 				      sizeof(sd->bDescriptorType) +
 				      sizeof(sd->wData[0]);
+			sd->bDescriptorType = USB_DT_STRING;
 
+			*buf = (uint8_t *)sd;
 			*len = MIN(*len, sd->bLength);
-		} else if (descr_idx == usbd_dev->extra_string_idx) {
-			/* This string is returned as UTF16, hence the
-			 * multiplication
-			 */
-			sd->bLength = strlen(usbd_dev->extra_string) * 2 +
-				      sizeof(sd->bLength) +
-				      sizeof(sd->bDescriptorType);
-
-			*len = MIN(*len, sd->bLength);
+			return USBD_REQ_HANDLED;
+		}
 
-			for (i = 0; i < (*len / 2) - 1; i++) {
-				sd->wData[i] =
-					usbd_dev->extra_string[i];
-			}
-        } else {
+		if (descr_idx != usbd_dev->extra_string_idx) {
 			array_idx = descr_idx - 1;
 
 			if (!usbd_dev->strings) {
@@ -276,25 +456,12 @@ usb_standard_get_descriptor(usbd_device *usbd_dev,
 			if (req->wIndex != USB_LANGID_ENGLISH_US) {
 				return USBD_REQ_NOTSUPP;
 			}
-
-			/* This string is returned as UTF16, hence the
-			 * multiplication
-			 */
-			sd->bLength = strlen(usbd_dev->strings[array_idx]) * 2 +
-				      sizeof(sd->bLength) +
-				      sizeof(sd->bDescriptorType);
-
-			*len = MIN(*len, sd->bLength);
-
-			for (i = 0; i < (*len / 2) - 1; i++) {
-				sd->wData[i] =
-					usbd_dev->strings[array_idx][i];
-			}
 		}
 
-		sd->bDescriptorType = USB_DT_STRING;
-		*buf = (uint8_t *)sd;
-
+		/* Converted to UTF16 a packet at a time. */
+		*len = MIN(*len, string_descriptor_length(
+				usb_string(usbd_dev, descr_idx)));
+		usbd_control_set_source(usbd_dev, string_descriptor_source);
 		return USBD_REQ_HANDLED;
 	}
 	return USBD_REQ_NOTSUPP;
@@ -365,6 +532,7 @@ usb_standard_set_configuration(usbd_device *usbd_dev,
 	}
 
 	/* Reset all endpoints. */
+	_usbd_ep_transfers_reset(usbd_dev);
 	usbd_dev->driver->ep_reset(usbd_dev);
 
 	if (usbd_dev->user_callback_set_config[0]) {
@@ -375,6 +543,9 @@ usb_standard_set_configuration(usbd_device *usbd_dev,
 		for (i = 0; i < MAX_USER_CONTROL_CALLBACK; i++) {
 			usbd_dev->user_control_callback[i].cb = NULL;
 		}
+		for (i = 0; i < MAX_USER_CONTROL_SINK; i++) {
+			usbd_dev->user_control_sink[i].cb = NULL;
+		}
 
 		for (i = 0; i < MAX_USER_SET_CONFIG_CALLBACK; i++) {
 			if (usbd_dev->user_callback_set_config[i]) {
@@ -0,0 +1,81 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libopencm3/lpc43xx/cgu.h>
+
+#include <stdio.h>
+#include "delay.h"
+#include "usb-gadget0.h"
+
+#define ER_DEBUG
+#ifdef ER_DEBUG
+#define ER_DPRINTF(fmt, ...) \
+	do { printf(fmt, ## __VA_ARGS__); } while (0)
+#else
+#define ER_DPRINTF(fmt, ...) \
+	do { } while (0)
+#endif
+
+
+/* FIXME - implement delay functionality for better test coverage */
+void delay_setup(void) {
+}
+
+void delay_us(uint16_t us) {
+	(void)us;
+}
+
+/* From a 12MHz crystal: the core at 96MHz on PLL1, PLL0USB at 480MHz. */
+static void clock_setup(void)
+{
+	int i;
+
+	CGU_XTAL_OSC_CTRL &= ~(CGU_XTAL_OSC_CTRL_ENABLE | CGU_XTAL_OSC_CTRL_BYPASS |
+			       CGU_XTAL_OSC_CTRL_HF);
+	for (i = 0; i < 10000; i++) {
+		__asm__("nop");
+	}
+
+	/* 96MHz out, 192MHz CCO */
+	CGU_PLL1_CTRL = CGU_PLL1_CTRL_CLK_SEL(CGU_SRC_XTAL) | CGU_PLL1_CTRL_AUTOBLOCK |
+		CGU_PLL1_CTRL_FBSEL | CGU_PLL1_CTRL_MSEL(7) | CGU_PLL1_CTRL_NSEL(0) |
+		CGU_PLL1_CTRL_PSEL(0);
+	while (!(CGU_PLL1_STAT & CGU_PLL1_STAT_LOCK));
+	CGU_BASE_M4_CLK = CGU_BASE_M4_CLK_CLK_SEL(CGU_SRC_PLL1) | CGU_BASE_M4_CLK_AUTOBLOCK;
+
+	/* The user manual's 480MHz setting for a 12MHz input */
+	CGU_PLL0USB_CTRL = CGU_PLL0USB_CTRL_CLK_SEL(CGU_SRC_XTAL) | CGU_PLL0USB_CTRL_AUTOBLOCK |
+		CGU_PLL0USB_CTRL_PD;
+	CGU_PLL0USB_MDIV = 0x06167FFA;
+	CGU_PLL0USB_NP_DIV = 0x00302062;
+	CGU_PLL0USB_CTRL = CGU_PLL0USB_CTRL_CLK_SEL(CGU_SRC_XTAL) | CGU_PLL0USB_CTRL_AUTOBLOCK |
+		CGU_PLL0USB_CTRL_DIRECTI | CGU_PLL0USB_CTRL_DIRECTO | CGU_PLL0USB_CTRL_CLKEN;
+	while (!(CGU_PLL0USB_STAT & CGU_PLL0USB_STAT_LOCK));
+}
+
+int main(void)
+{
+	clock_setup();
+
+	usbd_device *usbd_dev = gadget0_init(&lpc43xx_usb_driver, "lpc4357-generic");
+
+	ER_DPRINTF("bootup complete\n");
+	while (1) {
+		gadget0_run(usbd_dev);
+	}
+
+}
@@ -21,6 +21,7 @@
 #include <libopencm3/lm4f/gpio.h>
 #include <libopencm3/lm4f/rcc.h>
 #include <libopencm3/lm4f/systemcontrol.h>
+#include <libopencm3/lm4f/udma.h>
 
 #include <stdio.h>
 #include "delay.h"
@@ -36,6 +37,10 @@
 #endif
 
 
+#ifdef GZ_DMA
+static struct udma_channel_control udma_table[32] __attribute__((aligned(1024)));
+#endif
+
 /* FIXME - implement delay functionality for better test coverage */
 void delay_setup(void) {
 }
@@ -57,7 +62,17 @@ int main(void)
 	gpio_mode_setup(GPIOF, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO2);
 	gpio_set_output_config(GPIOF, GPIO_OTYPE_PP, GPIO_DRIVE_2MA, GPIO2);
 
+#ifdef GZ_DMA
+	/* The usb driver only uses the uDMA the application has set up. */
+	periph_clock_enable(RCC_DMA);
+	while (!(SYSCTL_PRDMA & 1));
+	UDMA_CFG = UDMA_CFG_MASTEN;
+	UDMA_CTLBASE = (uint32_t)(uintptr_t)udma_table;
+
+	usbd_device *usbd_dev = gadget0_init(&lm4f_usb_dma_driver, "tilm4f120xl");
+#else
 	usbd_device *usbd_dev = gadget0_init(&lm4f_usb_driver, "tilm4f120xl");
+#endif
 
 	ER_DPRINTF("bootup complete\n");
 	while (1) {
@@ -16,6 +16,7 @@ import usb.core
 import usb.control
 import usb.util as uu
 import random
+import struct
 import sys
 
 import unittest
@@ -37,6 +38,10 @@ GZ_REQ_SET_PATTERN=1
 GZ_REQ_PRODUCE=2
 GZ_REQ_SET_ALIGNED=3
 GZ_REQ_SET_UNALIGNED=4
+GZ_REQ_CONSUME=5
+GZ_REQ_SET_POLL_BUDGET=6
+GZ_REQ_GET_CYCLES=7
+GZ_REQ_SET_TRANSFERS=8
 GZ_REQ_WRITE_LOOPBACK_BUFFER=10
 GZ_REQ_READ_LOOPBACK_BUFFER=11
 GZ_REQ_INTEL_WRITE=0x5b
@@ -81,7 +86,7 @@ class TestGadget0(unittest.TestCase):
         uu.dispose_resources(self.dev)
 
     def test_sanity(self):
-        self.assertEqual(2, self.dev.bNumConfigurations, "Should have 2 configs")
+        self.assertEqual(3, self.dev.bNumConfigurations, "Should have 3 configs")
 
     def test_config_switch_2(self):
         """
@@ -154,6 +159,41 @@ class TestIntelCompliance(unittest.TestCase):
         self.inner_t(183)
 
 
+class TestControlSink(unittest.TestCase):
+    """
+    Control OUT data stages can be streamed to a sink, past the size of the control buffer
+    """
+    def setUp(self):
+        self.dev = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID, custom_match=find_by_serial(DUT_SERIAL))
+        self.assertIsNotNone(self.dev, "Couldn't find locm3 gadget0 device")
+
+        self.cfg = uu.find_descriptor(self.dev, bConfigurationValue=2)
+        self.assertIsNotNone(self.cfg, "Config 2 should exist")
+        self.dev.set_configuration(self.cfg)
+        self.req = uu.CTRL_OUT | uu.CTRL_TYPE_VENDOR | uu.CTRL_RECIPIENT_INTERFACE
+
+    def tearDown(self):
+        uu.dispose_resources(self.dev)
+
+    def test_consume(self):
+        ep0_size = self.dev.bMaxPacketSize0
+        for mylen in [1, ep0_size - 1, ep0_size, ep0_size * 3 + 5, 1024, 4000]:
+            data = [x % 63 for x in range(mylen)]
+            written = self.dev.ctrl_transfer(self.req, GZ_REQ_CONSUME, 0, 0, data)
+            self.assertEqual(written, mylen)
+
+    def test_consume_bad_data(self):
+        data = [x % 63 for x in range(1024)]
+        data[700] ^= 1
+        try:
+            self.dev.ctrl_transfer(self.req, GZ_REQ_CONSUME, 0, 0, data)
+            self.fail("Should have got a stall")
+        except usb.core.USBError as e:
+            self.assertIn("Pipe", e.strerror)
+        # and the device is still usable afterwards
+        self.dev.ctrl_transfer(self.req, GZ_REQ_CONSUME, 0, 0, data[:10])
+
+
 class TestConfigSourceSink(unittest.TestCase):
     """
     We could inherit, but it doesn't save much, and this saves me from remembering how to call super.
@@ -372,6 +412,162 @@ class TestConfigSourceSinkPerformance(unittest.TestCase):
         te = datetime.datetime.now() - ts
         print("wrote %s bytes in %s for %s kps" % (txc, te, self.tput(txc, te)))
 
+    def test_poll_budget_perf(self):
+        """
+        Same transfers with usbd_poll() handling 1, 4 and 16 events per call
+        """
+        data = [x & 0xff for x in range(100 * 1024)]
+        for budget in [1, 4, 16]:
+            self.dev.ctrl_transfer(uu.CTRL_TYPE_VENDOR | uu.CTRL_RECIPIENT_INTERFACE, GZ_REQ_SET_POLL_BUDGET, budget)
+            ts = datetime.datetime.now()
+            rxc = 0
+            while rxc < 5 * 1024 * 1024:
+                rxc += len(self.ep_in.read(len(data), timeout=0))
+            te = datetime.datetime.now() - ts
+            print("budget %d: read %s bytes in %s for %s kps" % (budget, rxc, te, self.tput(rxc, te)))
+            ts = datetime.datetime.now()
+            txc = 0
+            while txc < 5 * 1024 * 1024:
+                txc += self.ep_out.write(data, timeout=0)
+            te = datetime.datetime.now() - ts
+            print("budget %d: wrote %s bytes in %s for %s kps" % (budget, txc, te, self.tput(txc, te)))
+        self.dev.ctrl_transfer(uu.CTRL_TYPE_VENDOR | uu.CTRL_RECIPIENT_INTERFACE, GZ_REQ_SET_POLL_BUDGET, 1)
+
+    def test_copy_cycles(self):
+        """
+        Cycles per packet spent copying to and from the usb peripheral.
+        Needs firmware built with -DGZ_CYCLE_COUNT, see README.md
+        """
+        req = uu.CTRL_IN | uu.CTRL_TYPE_VENDOR | uu.CTRL_RECIPIENT_INTERFACE
+        try:
+            self.dev.ctrl_transfer(req, GZ_REQ_GET_CYCLES, 0, 0, 16)
+        except usb.core.USBError:
+            self.skipTest("firmware built without GZ_CYCLE_COUNT")
+        data = [x & 0xff for x in range(100 * 1024)]
+        for aligned in [GZ_REQ_SET_ALIGNED, GZ_REQ_SET_UNALIGNED]:
+            self.dev.ctrl_transfer(uu.CTRL_TYPE_VENDOR | uu.CTRL_RECIPIENT_INTERFACE, aligned, 0)
+            self.dev.ctrl_transfer(req, GZ_REQ_GET_CYCLES, 0, 0, 16)
+            self.ep_in.read(len(data), timeout=0)
+            self.ep_out.write(data, timeout=0)
+            wc, writes, rc, reads = struct.unpack("<4I", self.dev.ctrl_transfer(req, GZ_REQ_GET_CYCLES, 0, 0, 16))
+            print("%s: write %d cycles/packet, read %d cycles/packet" %
+                  ("aligned" if aligned == GZ_REQ_SET_ALIGNED else "unaligned", wc // max(1, writes), rc // max(1, reads)))
+        self.dev.ctrl_transfer(uu.CTRL_TYPE_VENDOR | uu.CTRL_RECIPIENT_INTERFACE, GZ_REQ_SET_ALIGNED, 0)
+
+    def test_transfer_perf(self):
+        """
+        Throughput with the firmware running whole buffer transfers, by DMA
+        on cores that have it.  Needs firmware built with -DGZ_TRANSFERS,
+        see README.md
+        """
+        req = uu.CTRL_TYPE_VENDOR | uu.CTRL_RECIPIENT_INTERFACE
+        try:
+            self.dev.ctrl_transfer(req, GZ_REQ_SET_TRANSFERS, 1)
+        except usb.core.USBError:
+            self.skipTest("firmware built without GZ_TRANSFERS")
+        # A multiple of the firmware's default transfers of 63 packets.
+        # Smaller ones end with a short packet, which ends the read early.
+        size = self.ep_in.wMaxPacketSize * 63 * 16
+        ts = datetime.datetime.now()
+        rxc = 0
+        while rxc < 5 * 1024 * 1024:
+            data = self.ep_in.read(size, timeout=0)
+            self.assertGreater(len(data), 0, "Should have read some bytes")
+            self.assertEqual(0, len(data) % 63, "Should have read whole transfers")
+            rxc += len(data)
+        te = datetime.datetime.now() - ts
+        print("transfers: read %s bytes in %s for %s kps" % (rxc, te, self.tput(rxc, te)))
+        ts = datetime.datetime.now()
+        txc = 0
+        while txc < 5 * 1024 * 1024:
+            txc += self.ep_out.write(data, timeout=0)
+        te = datetime.datetime.now() - ts
+        print("transfers: wrote %s bytes in %s for %s kps" % (txc, te, self.tput(txc, te)))
+        self.dev.ctrl_transfer(req, GZ_REQ_SET_TRANSFERS, 0)
+
+
+class TestConfigIso(unittest.TestCase):
+    """
+    Isochronous source and sink, one packet a frame each way
+    """
+
+    def setUp(self):
+        self.dev = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID, custom_match=find_by_serial(DUT_SERIAL))
+        self.assertIsNotNone(self.dev, "Couldn't find locm3 gadget0 device")
+
+        self.cfg = uu.find_descriptor(self.dev, bConfigurationValue=4)
+        self.assertIsNotNone(self.cfg, "Config 4 should exist")
+        self.dev.set_configuration(self.cfg)
+        self.intf = self.cfg[(0, 0)]
+        self.ep_out = [ep for ep in self.intf if uu.endpoint_direction(ep.bEndpointAddress) == uu.ENDPOINT_OUT][0]
+        self.ep_in = [ep for ep in self.intf if uu.endpoint_direction(ep.bEndpointAddress) == uu.ENDPOINT_IN][0]
+
+    def tearDown(self):
+        uu.dispose_resources(self.dev)
+
+    def test_read(self):
+        """
+        Packets may be lost or come back empty, but a whole one follows the pattern
+        """
+        mps = self.ep_in.wMaxPacketSize
+        data = self.ep_in.read(mps * 32)
+        self.assertGreater(len(data), 0, "Should have got some packets")
+        for start in range(0, len(data) - mps + 1, mps):
+            packet = data[start:start + mps]
+            for a, b in zip(packet, packet[1:]):
+                self.assertEqual((a + 1) % 63, b, "Packet at %d should follow the pattern" % start)
+
+    def test_write(self):
+        mps = self.ep_out.wMaxPacketSize
+        data = [x % 63 for x in range(mps * 32)]
+        written = self.ep_out.write(data)
+        self.assertEqual(written, len(data), "Should have written all bytes plz")
+
+
+@unittest.skip("Perf tests only on demand (comment this line!)")
+class TestConfigIsoPerformance(unittest.TestCase):
+    """
+    Isochronous throughput, should be close to one packet per frame
+    """
+
+    def setUp(self):
+        self.dev = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID, custom_match=find_by_serial(DUT_SERIAL))
+        self.assertIsNotNone(self.dev, "Couldn't find locm3 gadget0 device")
+
+        self.cfg = uu.find_descriptor(self.dev, bConfigurationValue=4)
+        self.assertIsNotNone(self.cfg, "Config 4 should exist")
+        self.dev.set_configuration(self.cfg)
+        self.intf = self.cfg[(0, 0)]
+        self.ep_out = [ep for ep in self.intf if uu.endpoint_direction(ep.bEndpointAddress) == uu.ENDPOINT_OUT][0]
+        self.ep_in = [ep for ep in self.intf if uu.endpoint_direction(ep.bEndpointAddress) == uu.ENDPOINT_IN][0]
+
+    def tearDown(self):
+        uu.dispose_resources(self.dev)
+
+    def tput(self, xc, te):
+        return (xc / 1024 / max(1, te.seconds + te.microseconds /
+                                1000000.0))
+
+    def test_read_perf(self):
+        # One full speed frame a millisecond, so at most 62.5kps at 64 bytes
+        frames = 5000
+        ts = datetime.datetime.now()
+        rxc = 0
+        for _ in range(frames // 100):
+            rxc += len(self.ep_in.read(self.ep_in.wMaxPacketSize * 100))
+        te = datetime.datetime.now() - ts
+        print("iso read %s bytes of %s in %s for %s kps" % (rxc, frames * self.ep_in.wMaxPacketSize, te, self.tput(rxc, te)))
+
+    def test_write_perf(self):
+        frames = 5000
+        data = [x % 63 for x in range(self.ep_out.wMaxPacketSize * 100)]
+        ts = datetime.datetime.now()
+        txc = 0
+        for _ in range(frames // 100):
+            txc += self.ep_out.write(data)
+        te = datetime.datetime.now() - ts
+        print("iso wrote %s bytes in %s for %s kps" % (txc, te, self.tput(txc, te)))
+
 
 class TestControlTransfer_Reads(unittest.TestCase):
     """
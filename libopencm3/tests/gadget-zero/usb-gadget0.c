@@ -27,6 +27,9 @@
 #include <string.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/microsoft.h>
+#ifdef GZ_CYCLE_COUNT
+#include <libopencm3/cm3/dwt.h>
+#endif
 
 #include "trace.h"
 #include "delay.h"
@@ -49,17 +52,44 @@
 #define GZ_REQ_PRODUCE		2
 #define GZ_REQ_SET_ALIGNED	3
 #define GZ_REQ_SET_UNALIGNED	4
+#define GZ_REQ_CONSUME		5
+#define GZ_REQ_SET_POLL_BUDGET	6
+#define GZ_REQ_GET_CYCLES	7
+#define GZ_REQ_SET_TRANSFERS	8
 #define INTEL_COMPLIANCE_WRITE 0x5b
 #define INTEL_COMPLIANCE_READ 0x5c
 
 /* USB configurations */
 #define GZ_CFG_SOURCESINK	2
 #define GZ_CFG_LOOPBACK		3
+#define GZ_CFG_ISO		4
 
+#define CONTROL_EP_MAXPACKET	64
+/* High speed targets need 512, see Makefile.lpc4357-generic */
+#ifndef BULK_EP_MAXPACKET
 #define BULK_EP_MAXPACKET	64
+#endif
+#define ISO_EP_MAXPACKET	64
 
 #define MICROSOFT_DESCRIPTOR_SETS 1U
 
+#ifdef GZ_TRANSFERS
+/*
+ * Source/sink buffers for whole transfers, word aligned for DMA.  They must
+ * be a multiple of the 63 byte pattern, so that it carries on from one
+ * transfer to the next.  The default is a multiple of the packet size as
+ * well; targets short of RAM may pick a smaller multiple of 63, and then
+ * end each transfer with a short packet.
+ */
+#ifndef GZ_TRANSFER_SIZE
+#define GZ_TRANSFER_SIZE	(63 * BULK_EP_MAXPACKET)
+#endif
+#if GZ_TRANSFER_SIZE % 63
+#error "GZ_TRANSFER_SIZE must be a multiple of the 63 byte pattern"
+#endif
+static uint8_t transfer_buf[2][GZ_TRANSFER_SIZE] __attribute__ ((aligned(4)));
+#endif
+
 static const struct usb_device_descriptor dev = {
 	.bLength = USB_DT_DEVICE_SIZE,
 	.bDescriptorType = USB_DT_DEVICE,
@@ -67,7 +97,7 @@ static const struct usb_device_descriptor dev = {
 	.bDeviceClass = USB_CLASS_VENDOR,
 	.bDeviceSubClass = 0,
 	.bDeviceProtocol = 0,
-	.bMaxPacketSize0 = BULK_EP_MAXPACKET,
+	.bMaxPacketSize0 = CONTROL_EP_MAXPACKET,
 
 	/* when we're compatible with gadget 0
 	 * #define DRIVER_VENDOR_NUM       0x0525
@@ -79,7 +109,30 @@ static const struct usb_device_descriptor dev = {
 	.iManufacturer = 1,
 	.iProduct = 2,
 	.iSerialNumber = 3,
-	.bNumConfigurations = 2,
+	.bNumConfigurations = 3,
+};
+
+/*
+ * Source/sink gives each endpoint a number of its own, so that st_usbfs can
+ * double buffer both.
+ */
+static const struct usb_endpoint_descriptor endp_sourcesink[] = {
+	{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 0x01,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = BULK_EP_MAXPACKET,
+		.bInterval = 1,
+	},
+	{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 0x82,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = BULK_EP_MAXPACKET,
+		.bInterval = 1,
+	},
 };
 
 static const struct usb_endpoint_descriptor endp_bulk[] = {
@@ -117,6 +170,26 @@ static const struct usb_endpoint_descriptor endp_bulk[] = {
 	},
 };
 
+/* Isochronous endpoints also need a number each on st_usbfs. */
+static const struct usb_endpoint_descriptor endp_iso[] = {
+	{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 0x03,
+		.bmAttributes = USB_ENDPOINT_ATTR_ISOCHRONOUS,
+		.wMaxPacketSize = ISO_EP_MAXPACKET,
+		.bInterval = 1,
+	},
+	{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 0x84,
+		.bmAttributes = USB_ENDPOINT_ATTR_ISOCHRONOUS,
+		.wMaxPacketSize = ISO_EP_MAXPACKET,
+		.bInterval = 1,
+	},
+};
+
 static const struct usb_interface_descriptor iface_sourcesink[] = {
 	{
 		.bLength = USB_DT_INTERFACE_SIZE,
@@ -126,7 +199,7 @@ static const struct usb_interface_descriptor iface_sourcesink[] = {
 		.bNumEndpoints = 2,
 		.bInterfaceClass = USB_CLASS_VENDOR,
 		.iInterface = 0,
-		.endpoint = endp_bulk,
+		.endpoint = endp_sourcesink,
 	}
 };
 
@@ -143,6 +216,19 @@ static const struct usb_interface_descriptor iface_loopback[] = {
 	}
 };
 
+static const struct usb_interface_descriptor iface_iso[] = {
+	{
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = USB_CLASS_VENDOR,
+		.iInterface = 0,
+		.endpoint = endp_iso,
+	}
+};
+
 static const struct usb_interface ifaces_sourcesink[] = {
 	{
 		.num_altsetting = 1,
@@ -157,6 +243,13 @@ static const struct usb_interface ifaces_loopback[] = {
 	}
 };
 
+static const struct usb_interface ifaces_iso[] = {
+	{
+		.num_altsetting = 1,
+		.altsetting = iface_iso,
+	}
+};
+
 static const struct usb_config_descriptor config[] = {
 	{
 		.bLength = USB_DT_CONFIGURATION_SIZE,
@@ -179,6 +272,17 @@ static const struct usb_config_descriptor config[] = {
 		.bmAttributes = 0x80,
 		.bMaxPower = 0x32,
 		.interface = ifaces_loopback,
+	},
+	{
+		.bLength = USB_DT_CONFIGURATION_SIZE,
+		.bDescriptorType = USB_DT_CONFIGURATION,
+		.wTotalLength = 0,
+		.bNumInterfaces = 1,
+		.bConfigurationValue = GZ_CFG_ISO,
+		.iConfiguration = 6, /* string index */
+		.bmAttributes = 0x80,
+		.bMaxPower = 0x32,
+		.interface = ifaces_iso,
 	}
 };
 
@@ -276,11 +380,12 @@ static const char *usb_strings[] = {
 	"Gadget-Zero",
 	serial,
 	"source and sink data",
-	"loop input to output"
+	"loop input to output",
+	"isochronous source and sink"
 };
 
 /* Buffer to be used for control requests. */
-static uint8_t usbd_control_buffer[5*BULK_EP_MAXPACKET];
+static uint8_t usbd_control_buffer[5*CONTROL_EP_MAXPACKET];
 static usbd_device *our_dev;
 
 /* Private global for state */
@@ -288,6 +393,17 @@ static struct {
 	uint8_t pattern;
 	int pattern_counter;
 	int test_unaligned;	/* If 0 (default), use 16-bit aligned buffers. This should not be declared as bool */
+	bool double_buffered;	/* Source endpoint takes two packets at once */
+	bool transfers;		/* Source/sink run whole transfers, not packets */
+#ifdef GZ_CYCLE_COUNT
+	/* DWT cycles spent in usbd_ep_write_packet/read_packet by source/sink */
+	struct {
+		uint32_t write_cycles;
+		uint32_t writes;
+		uint32_t read_cycles;
+		uint32_t reads;
+	} cycles;
+#endif
 } state = {
 	.pattern = 0,
 	.pattern_counter = 0,
@@ -309,7 +425,14 @@ static void gadget0_ss_out_cb(usbd_device *usbd_dev, uint8_t ep)
 	} else {
 		dest = buf;
 	}
+#ifdef GZ_CYCLE_COUNT
+	uint32_t start = dwt_read_cycle_counter();
+#endif
 	x = usbd_ep_read_packet(usbd_dev, ep, dest, BULK_EP_MAXPACKET);
+#ifdef GZ_CYCLE_COUNT
+	state.cycles.read_cycles += dwt_read_cycle_counter() - start;
+	state.cycles.reads++;
+#endif
 	trace_send_blocking8(1, x);
 }
 
@@ -337,7 +460,16 @@ static void gadget0_ss_in_cb(usbd_device *usbd_dev, uint8_t ep)
 		break;
 	}
 
+#ifdef GZ_CYCLE_COUNT
+	uint32_t start = dwt_read_cycle_counter();
+#endif
 	uint16_t x = usbd_ep_write_packet(usbd_dev, ep, src, BULK_EP_MAXPACKET);
+#ifdef GZ_CYCLE_COUNT
+	if (x) {
+		state.cycles.write_cycles += dwt_read_cycle_counter() - start;
+		state.cycles.writes++;
+	}
+#endif
 	/* As we are calling write in the callback, this should never fail */
 	trace_send_blocking8(2, x);
 	if (x != BULK_EP_MAXPACKET) {
@@ -362,13 +494,55 @@ static void gadget0_out_cb_loopback(usbd_device *usbd_dev, uint8_t ep)
 	ER_DPRINTF("loop OUT %x got %d => %d\n", ep, x, y);
 }
 
+/* Isochronous sink: whatever came in this frame is dropped. */
+static void gadget0_iso_out_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	uint8_t buf[ISO_EP_MAXPACKET] __attribute__ ((aligned(2)));
+
+	usbd_ep_read_packet(usbd_dev, ep, buf, ISO_EP_MAXPACKET);
+}
+
+/*
+ * Isochronous source: called once a frame, when the last packet has gone
+ * or missed its frame, to queue the next one.  Packets carry the same
+ * i % 63 pattern as the bulk source.
+ */
+static void gadget0_iso_in_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	uint8_t buf[ISO_EP_MAXPACKET] __attribute__ ((aligned(2)));
+
+	for (unsigned i = 0; i < ISO_EP_MAXPACKET; i++) {
+		buf[i] = state.pattern_counter++ % 63;
+	}
+	usbd_ep_write_packet(usbd_dev, ep, buf, ISO_EP_MAXPACKET);
+}
+
+#ifdef GZ_TRANSFERS
+/* Keep a transfer going on each source/sink endpoint until told to stop. */
+static void gadget0_ss_transfer_done(usbd_device *usbd_dev, uint8_t ep, uint16_t len)
+{
+	(void) len;
+	if (ep & 0x80) {
+		if (!state.transfers) {
+			/* Back to a packet at a time. */
+			gadget0_ss_in_cb(usbd_dev, ep);
+			return;
+		}
+		usbd_ep_transfer_in(usbd_dev, ep, transfer_buf[0], GZ_TRANSFER_SIZE,
+			false, gadget0_ss_transfer_done);
+	} else if (state.transfers) {
+		usbd_ep_transfer_out(usbd_dev, ep, transfer_buf[1], GZ_TRANSFER_SIZE,
+			gadget0_ss_transfer_done);
+	}
+}
+#endif
+
 static enum usbd_request_return_codes gadget0_control_request(usbd_device *usbd_dev,
 	struct usb_setup_data *req,
 	uint8_t **buf,
 	uint16_t *len,
 	usbd_control_complete_callback *complete)
 {
-	(void) usbd_dev;
 	(void) complete;
 	(void) buf;
 	ER_DPRINTF("ctrl breq: %x, bmRT: %x, windex :%x, wlen: %x, wval :%x\n",
@@ -413,6 +587,40 @@ static enum usbd_request_return_codes gadget0_control_request(usbd_device *usbd_
 	case GZ_REQ_SET_ALIGNED:
 		state.test_unaligned = 0;
 		return USBD_REQ_HANDLED;
+	case GZ_REQ_SET_POLL_BUDGET:
+		/* Events handled per usbd_poll(), for the throughput tests. */
+		usbd_set_poll_budget(usbd_dev, req->wValue);
+		return USBD_REQ_HANDLED;
+#ifdef GZ_CYCLE_COUNT
+	case GZ_REQ_GET_CYCLES:
+		/* Report the packet copy cycle counts so far, and start over. */
+		if (req->wLength < sizeof(state.cycles)) {
+			return USBD_REQ_NOTSUPP;
+		}
+		memcpy(*buf, &state.cycles, sizeof(state.cycles));
+		*len = sizeof(state.cycles);
+		memset(&state.cycles, 0, sizeof(state.cycles));
+		return USBD_REQ_HANDLED;
+#endif
+#ifdef GZ_TRANSFERS
+	case GZ_REQ_SET_TRANSFERS:
+		/*
+		 * Source and sink GZ_TRANSFER_SIZE bytes at a time with
+		 * usbd_ep_transfer_in/out(), or packets again for 0.
+		 */
+		if (state.transfers == !!req->wValue) {
+			return USBD_REQ_HANDLED;
+		}
+		state.transfers = req->wValue;
+		if (state.transfers) {
+			for (unsigned i = 0; i < GZ_TRANSFER_SIZE; i++) {
+				transfer_buf[0][i] = state.pattern ? i % 63 : 0;
+			}
+			gadget0_ss_transfer_done(usbd_dev, 0x82, 0);
+			gadget0_ss_transfer_done(usbd_dev, 0x01, 0);
+		}
+		return USBD_REQ_HANDLED;
+#endif
 	case GZ_REQ_PRODUCE:
 		ER_DPRINTF("fake loopback of %d\n", req->wValue);
 		if (req->wValue > sizeof(usbd_control_buffer)) {
@@ -435,31 +643,69 @@ static enum usbd_request_return_codes gadget0_control_request(usbd_device *usbd_
 	return USBD_REQ_NEXT_CALLBACK;
 }
 
+/*
+ * GZ_REQ_CONSUME takes a data stage of any length, a packet at a time, and
+ * stalls unless every byte follows the same i % 63 pattern as the bulk
+ * source.  wLength is not limited by the control buffer.
+ */
+static enum usbd_request_return_codes gadget0_control_sink(usbd_device *usbd_dev,
+	struct usb_setup_data *req, uint16_t offset, const uint8_t *buf,
+	uint16_t len, usbd_control_complete_callback *complete)
+{
+	(void) usbd_dev;
+	(void) complete;
+
+	if (req->bRequest != GZ_REQ_CONSUME) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+	for (uint16_t i = 0; i < len; i++) {
+		if (buf[i] != (offset + i) % 63) {
+			ER_DPRINTF("consume mismatch at %d\n", offset + i);
+			return USBD_REQ_NOTSUPP;
+		}
+	}
+	return USBD_REQ_HANDLED;
+}
+
 static void gadget0_set_config(usbd_device *usbd_dev, uint16_t wValue)
 {
 	ER_DPRINTF("set cfg %d\n", wValue);
 	switch (wValue) {
 	case GZ_CFG_SOURCESINK:
 		state.test_unaligned = 0;
+		state.transfers = false;
+		usbd_ep_double_buffer(usbd_dev, 0x01, true);
+		state.double_buffered = usbd_ep_double_buffer(usbd_dev, 0x82, true);
 		usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, BULK_EP_MAXPACKET,
 			gadget0_ss_out_cb);
-		usbd_ep_setup(usbd_dev, 0x81, USB_ENDPOINT_ATTR_BULK, BULK_EP_MAXPACKET,
+		usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, BULK_EP_MAXPACKET,
 			gadget0_ss_in_cb);
 		usbd_register_control_callback(
 			usbd_dev,
 			USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
 			USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
 			gadget0_control_request);
-		/* Prime source for IN data. */
-		gadget0_ss_in_cb(usbd_dev, 0x81);
+		usbd_register_control_sink(
+			usbd_dev,
+			USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+			USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+			gadget0_control_sink);
+		/* Prime source for IN data, both buffers if there are two. */
+		gadget0_ss_in_cb(usbd_dev, 0x82);
+		if (state.double_buffered) {
+			gadget0_ss_in_cb(usbd_dev, 0x82);
+		}
 		break;
 	case GZ_CFG_LOOPBACK:
 		/*
 		 * The ordering here is important, as it defines the addresses
 		 * locality. We want to have both out endpoints in sequentially,
 		 * so we can test for overrunning our memory space, if that's a
-		 * concern on the usb peripheral.
+		 * concern on the usb peripheral.  Every number is used both
+		 * ways here, which leaves no room for double buffering.
 		 */
+		usbd_ep_double_buffer(usbd_dev, 0x01, false);
+		usbd_ep_double_buffer(usbd_dev, 0x82, false);
 		usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, BULK_EP_MAXPACKET,
 			gadget0_out_cb_loopback);
 		usbd_ep_setup(usbd_dev, 0x02, USB_ENDPOINT_ATTR_BULK, BULK_EP_MAXPACKET,
@@ -469,9 +715,19 @@ static void gadget0_set_config(usbd_device *usbd_dev, uint16_t wValue)
 		usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, BULK_EP_MAXPACKET,
 			gadget0_in_cb_loopback);
 		break;
+	case GZ_CFG_ISO:
+		state.pattern_counter = 0;
+		usbd_ep_setup(usbd_dev, 0x03, USB_ENDPOINT_ATTR_ISOCHRONOUS, ISO_EP_MAXPACKET,
+			gadget0_iso_out_cb);
+		usbd_ep_setup(usbd_dev, 0x84, USB_ENDPOINT_ATTR_ISOCHRONOUS, ISO_EP_MAXPACKET,
+			gadget0_iso_in_cb);
+		/* Queue the first packet, the rest follow from the callback. */
+		gadget0_iso_in_cb(usbd_dev, 0x84);
+		break;
 	default:
 		ER_DPRINTF("set configuration unknown: %d\n", wValue);
 	}
+	ER_DPRINTF("endpoint memory left %u\n", usbd_ep_memory_free(usbd_dev));
 }
 
 usbd_device *gadget0_init(const usbd_driver *driver, const char *userserial)
@@ -490,6 +746,9 @@ usbd_device *gadget0_init(const usbd_driver *driver, const char *userserial)
 	microsoft_os_register_descriptor_sets(our_dev, microsoft_os_descriptor_sets, MICROSOFT_DESCRIPTOR_SETS);
 	usbd_register_set_config_callback(our_dev, gadget0_set_config);
 	delay_setup();
+#ifdef GZ_CYCLE_COUNT
+	dwt_enable_cycle_counter();
+#endif
 
 	return our_dev;
 }
@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+# This python program generates the ASCII to HID usage tables used by keymap.c.
+#
+# Every layout is described the way the keys are engraved: for each HID usage
+# the character produced without modifiers, with Shift and with AltGr.  The
+# script inverts that into one 128 entry table per layout, indexed by ASCII
+# code, so that firmware lookups are a single array access.
+#
+# Usage: genkeymap.py > generated.keymap.c
+
+import sys
+
+MOD_LCTRL = 0x01
+MOD_LSHIFT = 0x02
+MOD_LALT = 0x04
+MOD_LGUI = 0x08
+MOD_RALT = 0x40		# AltGr
+
+FLAG_DEAD = 0x01	# Dead key, needs a space to emit the character
+
+USAGE_ENTER = 0x28
+USAGE_ESCAPE = 0x29
+USAGE_BACKSPACE = 0x2a
+USAGE_TAB = 0x2b
+USAGE_SPACE = 0x2c
+USAGE_F4 = 0x3d
+USAGE_DELETE = 0x4c
+
+# Control codes with no key of their own, see keymap.h.
+ASCII_GUI = 0x1c
+ASCII_CLOSE = 0x1d
+
+LETTERS = 'abcdefghijklmnopqrstuvwxyz'
+
+
+def letters(swap_yz=False):
+    keys = []
+    for i, c in enumerate(LETTERS):
+        if swap_yz and c in 'yz':
+            c = 'z' if c == 'y' else 'y'
+        keys.append((0x04 + i, c, c.upper(), ''))
+    return keys
+
+
+# (usage, plain, shift, altgr); dead keys are listed separately per layout.
+US = letters() + [
+    (0x1e, '1', '!', ''), (0x1f, '2', '@', ''), (0x20, '3', '#', ''),
+    (0x21, '4', '$', ''), (0x22, '5', '%', ''), (0x23, '6', '^', ''),
+    (0x24, '7', '&', ''), (0x25, '8', '*', ''), (0x26, '9', '(', ''),
+    (0x27, '0', ')', ''),
+    (0x2d, '-', '_', ''), (0x2e, '=', '+', ''), (0x2f, '[', '{', ''),
+    (0x30, ']', '}', ''), (0x31, '\\', '|', ''), (0x33, ';', ':', ''),
+    (0x34, "'", '"', ''), (0x35, '`', '~', ''), (0x36, ',', '<', ''),
+    (0x37, '.', '>', ''), (0x38, '/', '?', ''),
+]
+
+UK = letters() + [
+    (0x1e, '1', '!', ''), (0x1f, '2', '"', ''), (0x20, '3', '', ''),
+    (0x21, '4', '$', ''), (0x22, '5', '%', ''), (0x23, '6', '^', ''),
+    (0x24, '7', '&', ''), (0x25, '8', '*', ''), (0x26, '9', '(', ''),
+    (0x27, '0', ')', ''),
+    (0x2d, '-', '_', ''), (0x2e, '=', '+', ''), (0x2f, '[', '{', ''),
+    (0x30, ']', '}', ''), (0x32, '#', '~', ''), (0x33, ';', ':', ''),
+    (0x34, "'", '@', ''), (0x35, '`', '', ''), (0x36, ',', '<', ''),
+    (0x37, '.', '>', ''), (0x38, '/', '?', ''), (0x64, '\\', '|', ''),
+]
+
+DE = letters(swap_yz=True) + [
+    (0x14, 'q', 'Q', '@'),
+    (0x1e, '1', '!', ''), (0x1f, '2', '"', ''), (0x20, '3', '', ''),
+    (0x21, '4', '$', ''), (0x22, '5', '%', ''), (0x23, '6', '&', ''),
+    (0x24, '7', '/', '{'), (0x25, '8', '(', '['), (0x26, '9', ')', ']'),
+    (0x27, '0', '=', '}'),
+    (0x2d, '', '?', '\\'), (0x2e, '', '`', ''), (0x30, '+', '*', '~'),
+    (0x32, '#', "'", ''), (0x35, '^', '', ''), (0x36, ',', ';', ''),
+    (0x37, '.', ':', ''), (0x38, '-', '_', ''), (0x64, '<', '>', '|'),
+]
+DE_DEAD = '^`'
+
+CZ = letters(swap_yz=True) + [
+    (0x14, 'q', 'Q', '\\'), (0x1a, 'w', 'W', '|'), (0x09, 'f', 'F', '['),
+    (0x0a, 'g', 'G', ']'), (0x1b, 'x', 'X', '#'), (0x06, 'c', 'C', '&'),
+    (0x19, 'v', 'V', '@'), (0x05, 'b', 'B', '{'), (0x11, 'n', 'N', '}'),
+    (0x1e, '+', '1', '~'), (0x1f, '', '2', ''), (0x20, '', '3', '^'),
+    (0x21, '', '4', ''), (0x22, '', '5', ''), (0x23, '', '6', ''),
+    (0x24, '', '7', '`'), (0x25, '', '8', ''), (0x26, '', '9', ''),
+    (0x27, '', '0', ''),
+    (0x2d, '=', '%', ''), (0x2f, '', '/', ''), (0x30, ')', '(', ''),
+    (0x32, '', "'", ''), (0x33, '', '"', '$'), (0x34, '', '!', ''),
+    (0x35, ';', '', ''), (0x36, ',', '?', '<'), (0x37, '.', ':', '>'),
+    (0x38, '-', '_', '*'), (0x64, '\\', '|', ''),
+]
+CZ_DEAD = '^`'
+
+LAYOUTS = [
+    ('us', US, ''),
+    ('uk', UK, ''),
+    ('de', DE, DE_DEAD),
+    ('cz', CZ, CZ_DEAD),
+]
+
+
+def build(keys, dead):
+    table = [None] * 128
+
+    def put(code, usage, mods, flags=0):
+        # Prefer the entry needing the fewest modifiers.
+        old = table[code]
+        if old is None or bin(mods).count('1') < bin(old[1]).count('1'):
+            table[code] = (usage, mods, flags)
+
+    # Later definitions of the same key (AltGr overrides) replace earlier.
+    bykey = {}
+    for usage, plain, shift, altgr in keys:
+        bykey[usage] = (plain, shift, altgr)
+
+    for usage, (plain, shift, altgr) in sorted(bykey.items()):
+        for char, mods in ((plain, 0), (shift, MOD_LSHIFT), (altgr, MOD_RALT)):
+            if char:
+                put(ord(char), usage, mods, FLAG_DEAD if char in dead else 0)
+
+    put(ord(' '), USAGE_SPACE, 0)
+    put(ord('\n'), USAGE_ENTER, 0)
+    put(ord('\r'), USAGE_ENTER, 0)
+    put(ord('\t'), USAGE_TAB, 0)
+    put(ord('\b'), USAGE_BACKSPACE, 0)
+    put(0x1b, USAGE_ESCAPE, 0)
+    put(0x7f, USAGE_DELETE, 0)
+    put(ASCII_GUI, 0, MOD_LGUI)
+    put(ASCII_CLOSE, USAGE_F4, MOD_LALT)
+
+    # Remaining C0 codes are Ctrl+letter, wherever the letter lives.
+    for i, c in enumerate(LETTERS):
+        if table[i + 1] is None:
+            usage, _, _ = table[ord(c)]
+            table[i + 1] = (usage, MOD_LCTRL, 0)
+
+    missing = [chr(c) for c in range(0x20, 0x7f) if table[c] is None]
+    if missing:
+        sys.stderr.write('warning: unmapped characters %r\n' % ''.join(missing))
+
+    return [e if e is not None else (0, 0, 0) for e in table]
+
+
+def describe(code):
+    if 0x20 < code < 0x7f and chr(code) not in '\\*/':
+        return "'%s'" % chr(code)
+    return '0x%02x' % code
+
+
+def main():
+    out = sys.stdout
+    out.write('/*\n * This file was generated by scripts/genkeymap.py,'
+              ' do not edit.\n */\n\n')
+    out.write('#include "keymap.h"\n')
+
+    for name, keys, dead in LAYOUTS:
+        table = build(keys, dead)
+        out.write('\nconst struct keymap_entry keymap_%s[KEYMAP_TABLE_SIZE]'
+                  ' = {\n' % name)
+        for code, (usage, mods, flags) in enumerate(table):
+            out.write('\t{ 0x%02x, 0x%02x, %d },\t/* %s */\n'
+                      % (usage, mods, flags, describe(code)))
+        out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,80 @@
+#include <stddef.h>
+
+#include "sequence.h"
+
+/* True once time a is at or past time b, across counter wrap. */
+static bool seq_reached(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) >= 0;
+}
+
+void seq_sched_init(struct seq_sched *sched, enum keymap_layout layout,
+		    bool (*submit)(const uint8_t *report, uint16_t len),
+		    enum keymap_format (*format)(void))
+{
+	sched->layout = layout;
+	sched->submit = submit;
+	sched->format = format;
+	sched->waiting = NULL;
+	sched->active = NULL;
+	sched->pending_len = 0;
+}
+
+void seq_add(struct seq_sched *sched, struct seq *s)
+{
+	struct seq **p = &sched->waiting;
+
+	while (*p && seq_reached(s->start, (*p)->start))
+		p = &(*p)->next;
+
+	s->state = SEQ_WAITING;
+	s->reports = 0;
+	s->next = *p;
+	*p = s;
+}
+
+uint16_t seq_progress(const struct seq *s)
+{
+	if (s->state == SEQ_TYPING || s->state == SEQ_DONE)
+		return s->typer.s - s->text;
+
+	return 0;
+}
+
+void seq_tick(struct seq_sched *sched, uint32_t now)
+{
+	struct seq *s = sched->active;
+
+	/* A refused report goes first, nothing moves until it is taken. */
+	if (sched->pending_len) {
+		if (!sched->submit(sched->pending, sched->pending_len))
+			return;
+		sched->pending_len = 0;
+	}
+
+	if (!s && sched->waiting && seq_reached(now, sched->waiting->start)) {
+		s = sched->waiting;
+		sched->waiting = s->next;
+		s->next = NULL;
+		s->state = SEQ_TYPING;
+		s->due = now;
+		keymap_typer_start(&s->typer, sched->layout, s->text);
+		sched->active = s;
+	}
+
+	if (!s || !seq_reached(now, s->due))
+		return;
+
+	sched->pending_len = keymap_typer_next(&s->typer, sched->pending,
+					       sched->format());
+	if (!sched->pending_len) {
+		s->state = SEQ_DONE;
+		sched->active = NULL;
+		return;
+	}
+
+	s->reports++;
+	s->due = now + s->rate;
+	if (sched->submit(sched->pending, sched->pending_len))
+		sched->pending_len = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hid_queue.h"
+#include "keymap.h"
+
+enum seq_state {
+	SEQ_IDLE,	/* Not added to a scheduler */
+	SEQ_WAITING,	/* Queued, start time not reached or keyboard busy */
+	SEQ_TYPING,
+	SEQ_DONE,
+};
+
+/*
+ * A text to type, starting at a given time and producing one report every
+ * rate milliseconds.  The caller owns the storage, which must stay valid
+ * until the sequence is done.
+ */
+struct seq {
+	const char *text;
+	uint32_t start;		/* Earliest start, in scheduler milliseconds */
+	uint16_t rate;		/* Milliseconds between two reports */
+
+	/* Progress, read only for the caller. */
+	enum seq_state state;
+	uint16_t reports;	/* Reports produced so far */
+
+	/* Private to the scheduler. */
+	struct seq *next;
+	struct keymap_typer typer;
+	uint32_t due;
+};
+
+/*
+ * Types sequences one after the other, in start time order.  Waiting
+ * sequences are kept sorted when they are added, so a tick only ever looks
+ * at the head of the list and the active sequence, however many are queued.
+ */
+struct seq_sched {
+	enum keymap_layout layout;
+	/* Hands a report to the host, false if it must be retried later. */
+	bool (*submit)(const uint8_t *report, uint16_t len);
+	/* Report format to produce right now. */
+	enum keymap_format (*format)(void);
+
+	struct seq *waiting;
+	struct seq *active;
+	uint8_t pending[HID_REPORT_MAX];	/* Report submit refused */
+	uint16_t pending_len;
+};
+
+void seq_sched_init(struct seq_sched *sched, enum keymap_layout layout,
+		    bool (*submit)(const uint8_t *report, uint16_t len),
+		    enum keymap_format (*format)(void));
+
+/*
+ * Queue a sequence, behind any others with the same start time.  Must not
+ * race with seq_tick(): call it from the same interrupt priority, or with
+ * that interrupt masked.
+ */
+void seq_add(struct seq_sched *sched, struct seq *s);
+
+/* Characters of s typed so far. */
+uint16_t seq_progress(const struct seq *s);
+
+/* Advance the scheduler to time now, in milliseconds. */
+void seq_tick(struct seq_sched *sched, uint32_t now);
+
+#endif
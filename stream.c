@@ -0,0 +1,56 @@
+#include "stream.h"
+
+#if STREAM_RING_SIZE & (STREAM_RING_SIZE - 1)
+#error "STREAM_RING_SIZE must be a power of two"
+#endif
+
+void stream_init(struct stream *s)
+{
+	s->head = 0;
+	s->tail = 0;
+}
+
+uint16_t stream_used(const struct stream *s)
+{
+	/* Indices are free running, unsigned wrap gives the distance. */
+	return (uint16_t)(s->head - s->tail);
+}
+
+uint16_t stream_free(const struct stream *s)
+{
+	return STREAM_RING_SIZE - stream_used(s);
+}
+
+uint16_t stream_write(struct stream *s, const uint8_t *data, uint16_t len)
+{
+	uint16_t head = s->head;
+	uint16_t room = STREAM_RING_SIZE - (uint16_t)(head - s->tail);
+
+	if (len > room)
+		len = room;
+
+	for (uint16_t i = 0; i < len; i++)
+		s->buf[(head + i) & (STREAM_RING_SIZE - 1)] = data[i];
+	/* Publish the bytes only once they are in place. */
+	__asm__ volatile("" ::: "memory");
+	s->head = head + len;
+
+	return len;
+}
+
+uint16_t stream_read(struct stream *s, char *text, uint16_t max)
+{
+	uint16_t tail = s->tail;
+	uint16_t head = s->head;
+	uint16_t n = 0;
+
+	while ((tail != head) && (n < max)) {
+		char c = s->buf[tail++ & (STREAM_RING_SIZE - 1)];
+
+		if (c)
+			text[n++] = c;
+	}
+	s->tail = tail;
+
+	return n;
+}
@@ -0,0 +1,35 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+
+/* Bytes of host text buffered in RAM, must be a power of two. */
+#define STREAM_RING_SIZE 1024
+
+/*
+ * Single producer, single consumer byte ring for text streamed by the host.
+ * As with struct hid_queue the producer only writes head and the consumer
+ * only writes tail.
+ */
+struct stream {
+	uint8_t buf[STREAM_RING_SIZE];
+	volatile uint16_t head;
+	volatile uint16_t tail;
+};
+
+void stream_init(struct stream *s);
+
+uint16_t stream_used(const struct stream *s);
+uint16_t stream_free(const struct stream *s);
+
+/* Append up to len bytes, returns how many fitted. */
+uint16_t stream_write(struct stream *s, const uint8_t *data, uint16_t len);
+
+/*
+ * Take up to max characters into text, dropping NULs so that the result can
+ * be typed as a string.  Returns the number of characters stored, text is
+ * not terminated.
+ */
+uint16_t stream_read(struct stream *s, char *text, uint16_t max);
+
+#endif
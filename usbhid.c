@@ -1,5 +1,5 @@
-#include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/rcc.h>
@@ -7,6 +7,52 @@
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/hid.h>
 
+#include "hid_mux.h"
+#include "keymap.h"
+#include "sequence.h"
+#include "stream.h"
+
+/* Keyboard layout the host is set up for. */
+#ifndef HOST_LAYOUT
+#define HOST_LAYOUT KEYMAP_US
+#endif
+
+/*
+ * Report format used in report protocol, KEYMAP_BOOT or KEYMAP_NKRO.  Boot
+ * protocol hosts (BIOS) always get boot reports.
+ */
+#ifndef HID_MODE
+#define HID_MODE KEYMAP_BOOT
+#endif
+
+/*
+ * HID_MODE for the preprocessor, which cannot compare the keymap_format
+ * enumerators: HID_NKRO is 1 for KEYMAP_NKRO and 0 for KEYMAP_BOOT.
+ */
+#define HID_NKRO_KEYMAP_BOOT	0
+#define HID_NKRO_KEYMAP_NKRO	1
+#define HID_NKRO_(mode)		HID_NKRO_ ## mode
+#define HID_NKRO_OF(mode)	HID_NKRO_(mode)
+#define HID_NKRO		HID_NKRO_OF(HID_MODE)
+
+/*
+ * Report interval in milliseconds (frames), 1 gives a 1 kHz keyboard.  The
+ * endpoint bInterval and the SysTick period that feeds the queue both use
+ * it, so the host polls exactly as often as we produce reports.
+ */
+#ifndef HID_INTERVAL_MS
+#define HID_INTERVAL_MS 1
+#endif
+#if (HID_INTERVAL_MS < 1) || (HID_INTERVAL_MS > 10)
+#error "HID_INTERVAL_MS must be between 1 and 10"
+#endif
+
+/*
+ * Define this to time every report against the USB frame number, see
+ * struct hid_latency below.
+ */
+/* #define HID_LATENCY_TRACE */
+
 /* Define this to include the DFU APP interface. */
 #define INCLUDE_DFU_INTERFACE
 
@@ -15,7 +61,103 @@
 #include <libopencm3/usb/dfu.h>
 #endif
 
+#ifdef HID_LATENCY_TRACE
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#endif
+
+/*
+ * Interrupt priorities, lower is more urgent, the F1 implements the top four
+ * bits.  All USB work happens in the USB low priority interrupt and reports
+ * are produced from SysTick.  Both share one level so neither can preempt
+ * the other in the middle of the USB stack or the report queue, which is
+ * what lets SysTick submit reports without masking interrupts.
+ */
+#define IRQ_PRI_USB		(2 << 4)
+#define IRQ_PRI_SYSTICK		IRQ_PRI_USB
+
 static usbd_device *usbd_dev;
+static usbd_hid hid_interface;
+static usbd_hid *hid = &hid_interface;
+
+/*
+ * Reports waiting for the host, one queue per report type.  SysTick
+ * produces, the IN transfer complete callback of endpoint 0x81 consumes, so
+ * a report is only ever lost if the producer ignores a full queue.  Not
+ * static so that the depths and high water marks can be watched from the
+ * debugger.
+ */
+struct hid_mux hid_reports;
+static volatile bool hid_in_busy;
+
+#ifdef HID_LATENCY_TRACE
+/*
+ * Frame numbers come from the SOF counter, one per millisecond.  With the
+ * queue kept busy, every gap but gaps[HID_INTERVAL_MS] should stay zero.
+ * Not static so that it can be read from the debugger.
+ */
+struct hid_latency {
+	uint32_t reports;	/* Reports collected by the host */
+	uint16_t armed_frame;	/* Frame the pending report was written in */
+	uint16_t done_frame;	/* Frame the previous report was collected in */
+	bool chained;		/* Pending report armed on a completion */
+	uint16_t max_wait;	/* Worst armed to collected time, in frames */
+	uint32_t gaps[16];	/* Frames between back to back reports */
+	uint32_t irq_entry;	/* Cycle counter at USB interrupt entry */
+	uint32_t irq_to_report;	/* Worst cycles from interrupt to next report */
+} hid_latency;
+
+static uint16_t hid_frame(void)
+{
+	return *USB_FNR_REG & USB_FNR_FN;
+}
+
+static void hid_latency_armed(bool chained)
+{
+	hid_latency.armed_frame = hid_frame();
+	hid_latency.chained = chained;
+
+	if (chained) {
+		uint32_t cycles = dwt_read_cycle_counter() -
+				  hid_latency.irq_entry;
+
+		if (cycles > hid_latency.irq_to_report)
+			hid_latency.irq_to_report = cycles;
+	}
+}
+
+static void hid_latency_done(void)
+{
+	uint16_t now = hid_frame();
+	uint16_t wait = (now - hid_latency.armed_frame) & USB_FNR_FN;
+	uint16_t gap = (now - hid_latency.done_frame) & USB_FNR_FN;
+
+	if (wait > hid_latency.max_wait)
+		hid_latency.max_wait = wait;
+	if (hid_latency.chained)
+		hid_latency.gaps[gap < 15 ? gap : 15]++;
+	hid_latency.done_frame = now;
+	hid_latency.reports++;
+}
+#endif
+
+/*
+ * In report protocol the keyboard, media keys and mouse share endpoint 0x81,
+ * every report starting with one of these IDs.  Boot protocol has no report
+ * IDs and carries the keyboard only.
+ */
+#define HID_REPORT_ID_KEYBOARD	1
+#define HID_REPORT_ID_CONSUMER	2
+#define HID_REPORT_ID_MOUSE	3
+
+/* Consumer page usages, HID usage tables 15. */
+#define HID_USAGE_VOLUME_UP	0xE9
+
+/*
+ * Keyboard LEDs last set by the host through SET_REPORT, bit 0 Num Lock to
+ * bit 4 Kana.  Not static so that it can be watched from the debugger.
+ */
+volatile uint8_t hid_leds;
 
 const struct usb_device_descriptor dev_descr = {
 	.bLength = USB_DT_DEVICE_SIZE,
@@ -34,10 +176,44 @@ const struct usb_device_descriptor dev_descr = {
 	.bNumConfigurations = 1,
 };
 
+/*
+ * The keyboard for HID_MODE, followed by the consumer control and mouse
+ * collections that only report protocol hosts use.
+ */
 static const uint8_t hid_report_descriptor[] = {
+#if HID_NKRO
+	0x05, 0x01, // Usage Page (Generic Desktop)
+	0x09, 0x06, // Usage (Keyboard)
+	0xA1, 0x01, // Collection (Application)
+	0x85, HID_REPORT_ID_KEYBOARD, //   Report ID (1)
+	0x05, 0x07, //   Usage Page (Key Codes)
+	0x19, 0xE0, //   Usage Minimum (224)
+	0x29, 0xE7, //   Usage Maximum (231)
+	0x15, 0x00, //   Logical Minimum (0)
+	0x25, 0x01, //   Logical Maximum (1)
+	0x75, 0x01, //   Report Size (1)
+	0x95, 0x08, //   Report Count (8)
+	0x81, 0x02, //   Input (Data, Variable, Absolute) ; Modifier byte
+	0x95, 0x05, //   Report Count (5)
+	0x05, 0x08, //   Usage Page (LEDs)
+	0x19, 0x01, //   Usage Minimum (Num Lock)
+	0x29, 0x05, //   Usage Maximum (Kana)
+	0x91, 0x02, //   Output (Data, Variable, Absolute) ; LED report
+	0x95, 0x01, //   Report Count (1)
+	0x75, 0x03, //   Report Size (3)
+	0x91, 0x01, //   Output (Constant) ; LED report padding
+	0x75, 0x01, //   Report Size (1)
+	0x05, 0x07, //   Usage Page (Key Codes)
+	0x19, 0x00, //   Usage Minimum (0)
+	0x29, KEYMAP_NKRO_USAGES - 1, //   Usage Maximum (119)
+	0x95, KEYMAP_NKRO_USAGES, //   Report Count (120)
+	0x81, 0x02, //   Input (Data, Variable, Absolute) ; Key bitmap
+	0xC0,       // End Collection
+#else
 	0x05, 0x01, // Usage Page (Generic Desktop)
 	0x09, 0x06, // Usage (Keyboard)
 	0xA1, 0x01, // Collection (Application)
+	0x85, HID_REPORT_ID_KEYBOARD, //   Report ID (1)
 	0x05, 0x07, //   Usage Page (Key Codes)
 	0x19, 0xE0, //   Usage Minimum (224)
 	0x29, 0xE7, //   Usage Maximum (231)
@@ -49,6 +225,15 @@ static const uint8_t hid_report_descriptor[] = {
 	0x95, 0x01, //   Report Count (1)
 	0x75, 0x08, //   Report Size (8)
 	0x81, 0x01, //   Input (Constant) ; Reserved byte
+	0x95, 0x05, //   Report Count (5)
+	0x75, 0x01, //   Report Size (1)
+	0x05, 0x08, //   Usage Page (LEDs)
+	0x19, 0x01, //   Usage Minimum (Num Lock)
+	0x29, 0x05, //   Usage Maximum (Kana)
+	0x91, 0x02, //   Output (Data, Variable, Absolute) ; LED report
+	0x95, 0x01, //   Report Count (1)
+	0x75, 0x03, //   Report Size (3)
+	0x91, 0x01, //   Output (Constant) ; LED report padding
 	0x95, 0x06, //   Report Count (6)
 	0x75, 0x08, //   Report Size (8)
 	0x15, 0x00, //   Logical Minimum (0)
@@ -57,104 +242,118 @@ static const uint8_t hid_report_descriptor[] = {
 	0x19, 0x00, //   Usage Minimum (0)
 	0x29, 0x65, //   Usage Maximum (101)
 	0x81, 0x00, //   Input (Data, Array)
+	0xC0,       // End Collection
+#endif
+	0x05, 0x0C, // Usage Page (Consumer)
+	0x09, 0x01, // Usage (Consumer Control)
+	0xA1, 0x01, // Collection (Application)
+	0x85, HID_REPORT_ID_CONSUMER, //   Report ID (2)
+	0x15, 0x00, //   Logical Minimum (0)
+	0x26, 0xFF, 0x03, //   Logical Maximum (1023)
+	0x19, 0x00, //   Usage Minimum (0)
+	0x2A, 0xFF, 0x03, //   Usage Maximum (1023)
+	0x75, 0x10, //   Report Size (16)
+	0x95, 0x01, //   Report Count (1)
+	0x81, 0x00, //   Input (Data, Array) ; One media key
+	0xC0,       // End Collection
+	0x05, 0x01, // Usage Page (Generic Desktop)
+	0x09, 0x02, // Usage (Mouse)
+	0xA1, 0x01, // Collection (Application)
+	0x85, HID_REPORT_ID_MOUSE, //   Report ID (3)
+	0x09, 0x01, //   Usage (Pointer)
+	0xA1, 0x00, //   Collection (Physical)
+	0x05, 0x09, //     Usage Page (Buttons)
+	0x19, 0x01, //     Usage Minimum (1)
+	0x29, 0x03, //     Usage Maximum (3)
+	0x15, 0x00, //     Logical Minimum (0)
+	0x25, 0x01, //     Logical Maximum (1)
+	0x75, 0x01, //     Report Size (1)
+	0x95, 0x03, //     Report Count (3)
+	0x81, 0x02, //     Input (Data, Variable, Absolute) ; Buttons
+	0x75, 0x05, //     Report Size (5)
+	0x95, 0x01, //     Report Count (1)
+	0x81, 0x01, //     Input (Constant) ; Button padding
+	0x05, 0x01, //     Usage Page (Generic Desktop)
+	0x09, 0x30, //     Usage (X)
+	0x09, 0x31, //     Usage (Y)
+	0x09, 0x38, //     Usage (Wheel)
+	0x15, 0x81, //     Logical Minimum (-127)
+	0x25, 0x7F, //     Logical Maximum (127)
+	0x75, 0x08, //     Report Size (8)
+	0x95, 0x03, //     Report Count (3)
+	0x81, 0x06, //     Input (Data, Variable, Relative) ; X, Y, wheel
+	0xC0,       //   End Collection
 	0xC0        // End Collection
 };
 
-static const struct {
-	struct usb_hid_descriptor hid_descriptor;
-	struct {
-		uint8_t bReportDescriptorType;
-		uint16_t wDescriptorLength;
-	} __attribute__((packed)) hid_report;
-} __attribute__((packed)) hid_function = {
-	.hid_descriptor = {
-		.bLength = sizeof(hid_function),
-		.bDescriptorType = USB_DT_HID,
-		.bcdHID = 0x0100,
-		.bCountryCode = 0,
-		.bNumDescriptors = 1,
-	},
-	.hid_report = {
-		.bReportDescriptorType = USB_DT_REPORT,
-		.wDescriptorLength = sizeof(hid_report_descriptor),
-	}
-};
-
-const struct usb_endpoint_descriptor hid_endpoint = {
-	.bLength = USB_DT_ENDPOINT_SIZE,
-	.bDescriptorType = USB_DT_ENDPOINT,
-	.bEndpointAddress = 0x81,
-	.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
-	.wMaxPacketSize = 8,
-	.bInterval = 10,
+/* Interface numbers, in the order the configuration lists them. */
+enum {
+	HID_IFACE,
+	STREAM_IFACE,
+#ifdef INCLUDE_DFU_INTERFACE
+	DFU_IFACE,
+#endif
+	NUM_IFACES
 };
 
-const struct usb_interface_descriptor hid_iface = {
-	.bLength = USB_DT_INTERFACE_SIZE,
-	.bDescriptorType = USB_DT_INTERFACE,
-	.bInterfaceNumber = 0,
-	.bAlternateSetting = 0,
-	.bNumEndpoints = 1,
-	.bInterfaceClass = USB_CLASS_HID,
-	.bInterfaceSubClass = 1, /* boot */
-	.bInterfaceProtocol = 1, 
-	.iInterface = 0,
-
-	.endpoint = &hid_endpoint,
-
-	.extra = &hid_function,
-	.extralen = sizeof(hid_function),
-};
+#define HID_EP			0x81
+/*
+ * Even, so the buffer after this one in st_usbfs packet memory stays
+ * halfword aligned whatever the driver rounds.
+ */
+#define HID_EP_SIZE		((HID_REPORT_MAX + 1) & ~1)
+
+/*
+ * Vendor interface taking text to type from the host, one bulk OUT endpoint
+ * as in the source/sink interface of tests/gadget-zero.  It must not share
+ * endpoint 1 with the HID interrupt endpoint, their types differ.
+ */
+#define STREAM_EP		0x02
+#define STREAM_EP_SIZE		64
 
 #ifdef INCLUDE_DFU_INTERFACE
-const struct usb_dfu_descriptor dfu_function = {
-	.bLength = sizeof(struct usb_dfu_descriptor),
-	.bDescriptorType = DFU_FUNCTIONAL,
-	.bmAttributes = USB_DFU_CAN_DOWNLOAD | USB_DFU_WILL_DETACH,
-	.wDetachTimeout = 255,
-	.wTransferSize = 1024,
-	.bcdDFUVersion = 0x011A,
-};
+#define DFU_DESCRIPTORS , \
+	USB_DESC_INTERFACE(DFU_IFACE, 0, 0, 0xFE, 1, 1, 0), \
+	USB_DFU_DESC_FUNCTIONAL(USB_DFU_CAN_DOWNLOAD | USB_DFU_WILL_DETACH, \
+				255, 1024, 0x011A)
+#else
+#define DFU_DESCRIPTORS
+#endif
 
-const struct usb_interface_descriptor dfu_iface = {
-	.bLength = USB_DT_INTERFACE_SIZE,
-	.bDescriptorType = USB_DT_INTERFACE,
-	.bInterfaceNumber = 1,
-	.bAlternateSetting = 0,
-	.bNumEndpoints = 0,
-	.bInterfaceClass = 0xFE,
-	.bInterfaceSubClass = 1,
-	.bInterfaceProtocol = 1,
-	.iInterface = 0,
-
-	.extra = &dfu_function,
-	.extralen = sizeof(dfu_function),
+/* Sent as it is for GET_DESCRIPTOR(CONFIGURATION), checked by usbdesc.h. */
+static const uint8_t config_descriptor[] = {
+	USB_DESC_CONFIGURATION(NUM_IFACES, 1, 0, 0xC0, 0x32,
+		USB_DESC_INTERFACE(HID_IFACE, 0, 1, USB_CLASS_HID,
+				   USB_HID_SUBCLASS_BOOT_INTERFACE,
+				   USB_HID_INTERFACE_PROTOCOL_KEYBOARD, 0),
+		USB_HID_DESC(0x0100, 0, sizeof(hid_report_descriptor)),
+		USB_DESC_ENDPOINT(HID_EP, USB_ENDPOINT_ATTR_INTERRUPT,
+				  HID_EP_SIZE, HID_INTERVAL_MS),
+
+		USB_DESC_INTERFACE(STREAM_IFACE, 0, 1, USB_CLASS_VENDOR,
+				   0, 0, 0),
+		USB_DESC_ENDPOINT(STREAM_EP, USB_ENDPOINT_ATTR_BULK,
+				  STREAM_EP_SIZE, 1)
+		DFU_DESCRIPTORS)
 };
-#endif
 
-const struct usb_interface ifaces[] = {{
-	.num_altsetting = 1,
-	.altsetting = &hid_iface,
+/*
+ * What the stack itself looks at for SET_CONFIGURATION and SET_INTERFACE,
+ * the descriptors are all in config_descriptor.
+ */
+const struct usb_interface ifaces[NUM_IFACES] = {
+	[HID_IFACE] = { .num_altsetting = 1 },
+	[STREAM_IFACE] = { .num_altsetting = 1 },
 #ifdef INCLUDE_DFU_INTERFACE
-}, {
-	.num_altsetting = 1,
-	.altsetting = &dfu_iface,
+	[DFU_IFACE] = { .num_altsetting = 1 },
 #endif
-}};
+};
 
 const struct usb_config_descriptor config = {
 	.bLength = USB_DT_CONFIGURATION_SIZE,
 	.bDescriptorType = USB_DT_CONFIGURATION,
-	.wTotalLength = 0,
-#ifdef INCLUDE_DFU_INTERFACE
-	.bNumInterfaces = 2,
-#else
-	.bNumInterfaces = 1,
-#endif
+	.bNumInterfaces = NUM_IFACES,
 	.bConfigurationValue = 1,
-	.iConfiguration = 0,
-	.bmAttributes = 0xC0,
-	.bMaxPower = 0x32,
 
 	.interface = ifaces,
 };
@@ -165,25 +364,19 @@ static const char *usb_strings[] = {
 	"DEMO",
 };
 
-/* Buffer to be used for control requests. */
-uint8_t usbd_control_buffer[128];
+/*
+ * Buffer to be used for control requests.  Descriptors are sent from flash
+ * or a packet at a time, so one bMaxPacketSize0 packet is enough.
+ */
+uint8_t usbd_control_buffer[64];
 
-static enum usbd_request_return_codes hid_control_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
-			void (**complete)(usbd_device *, struct usb_setup_data *))
+/* Format for the next report, boot protocol forces boot reports. */
+static enum keymap_format hid_format(void)
 {
-	(void)complete;
-	(void)dev;
-
-	if((req->bmRequestType != 0x81) ||
-	   (req->bRequest != USB_REQ_GET_DESCRIPTOR) ||
-	   (req->wValue != 0x2200))
-		return USBD_REQ_NOTSUPP;
-
-	/* Handle the HID report descriptor. */
-	*buf = (uint8_t *)hid_report_descriptor;
-	*len = sizeof(hid_report_descriptor);
+	if (usb_hid_get_protocol(hid) == USB_HID_PROTOCOL_BOOT)
+		return KEYMAP_BOOT;
 
-	return USBD_REQ_HANDLED;
+	return HID_MODE;
 }
 
 #ifdef INCLUDE_DFU_INTERFACE
@@ -214,18 +407,176 @@ static enum usbd_request_return_codes dfu_control_request(usbd_device *dev, stru
 }
 #endif
 
+/*
+ * Hand the next queued report to the endpoint, if it is free, taking the
+ * report types in turn.  Keyboard and media key reports equal to the one
+ * the host already has cost nothing and are skipped, mouse reports carry
+ * motion and always go out.
+ */
+static void hid_send_next(void)
+{
+	uint16_t len;
+	const uint8_t *report;
+	enum usb_hid_send_status status;
+#ifdef HID_LATENCY_TRACE
+	bool chained = hid_in_busy;
+#endif
+
+	while ((report = hid_mux_peek(&hid_reports, &len))) {
+		/*
+		 * Busy means a transfer is still pending, its completion
+		 * will bring us back here.
+		 */
+		hid_in_busy = true;
+		if (hid_reports.peeked == HID_SOURCE_MOUSE)
+			status = usb_hid_send_event(hid, report, len);
+		else
+			status = usb_hid_send_report(hid, report, len);
+
+		switch (status) {
+		case USB_HID_SEND_BUSY:
+			return;
+		case USB_HID_SEND_UNCHANGED:
+			hid_mux_pop(&hid_reports);
+			continue;
+		case USB_HID_SEND_QUEUED:
+			hid_mux_pop(&hid_reports);
+#ifdef HID_LATENCY_TRACE
+			hid_latency_armed(chained);
+#endif
+			return;
+		}
+	}
+
+	hid_in_busy = false;
+}
+
+static void hid_in_complete(usbd_hid *h)
+{
+	(void)h;
+
+#ifdef HID_LATENCY_TRACE
+	hid_latency_done();
+#endif
+
+	hid_send_next();
+}
+
+static void hid_output_report(usbd_hid *h, uint8_t report_id,
+			      const uint8_t *report, uint16_t len)
+{
+	(void)h;
+
+	/* Report ID 0 is the boot protocol LED report. */
+	if (len && (!report_id || report_id == HID_REPORT_ID_KEYBOARD))
+		hid_leds = report[0];
+}
+
+/*
+ * Queue a report of the given type for the host, prefixed with its report
+ * ID in report protocol.  Returns false if the queue is full, the caller
+ * must then retry the same report later.  Only call this from interrupts at
+ * IRQ_PRI_USB, it may touch the endpoint.
+ */
+static bool hid_submit_source(enum hid_source source, uint8_t report_id,
+			      const uint8_t *report, uint16_t len)
+{
+	uint8_t buf[HID_REPORT_MAX];
+	bool pushed;
+
+	if (usb_hid_get_protocol(hid) == USB_HID_PROTOCOL_BOOT) {
+		/* Boot hosts only know the keyboard, drop the rest. */
+		if (source != HID_SOURCE_KEYBOARD)
+			return true;
+		pushed = hid_mux_push(&hid_reports, source, report, len);
+	} else {
+		buf[0] = report_id;
+		memcpy(buf + 1, report, len);
+		pushed = hid_mux_push(&hid_reports, source, buf, len + 1);
+	}
+	if (!pushed)
+		return false;
+
+	if (!hid_in_busy)
+		hid_send_next();
+
+	return true;
+}
+
+/* Keyboard reports from the typist. */
+static bool hid_submit(const uint8_t *report, uint16_t len)
+{
+	return hid_submit_source(HID_SOURCE_KEYBOARD, HID_REPORT_ID_KEYBOARD,
+				 report, len);
+}
+
+/* Press and release a consumer page usage, false if there is no room. */
+static bool hid_consumer_tap(uint16_t usage)
+{
+	const uint8_t press[] = { usage & 0xff, usage >> 8 };
+	const uint8_t release[] = { 0, 0 };
+	struct hid_queue *q = &hid_reports.queue[HID_SOURCE_CONSUMER];
+
+	if (hid_queue_depth(q) > HID_QUEUE_LEN - 2)
+		return false;
+
+	return hid_submit_source(HID_SOURCE_CONSUMER, HID_REPORT_ID_CONSUMER,
+				 press, sizeof(press)) &&
+	       hid_submit_source(HID_SOURCE_CONSUMER, HID_REPORT_ID_CONSUMER,
+				 release, sizeof(release));
+}
+
+/* Move the pointer by dx, dy and the wheel by wheel, with buttons held. */
+static bool hid_mouse_move(uint8_t buttons, int8_t dx, int8_t dy,
+			   int8_t wheel)
+{
+	const uint8_t report[] = { buttons, dx, dy, wheel };
+
+	return hid_submit_source(HID_SOURCE_MOUSE, HID_REPORT_ID_MOUSE,
+				 report, sizeof(report));
+}
+
+/*
+ * Text from the host waiting to be typed.  The bulk endpoint is NAKed
+ * while there is no room for another packet, so the host simply slows down
+ * to typing speed.  Not static so that the fill level can be watched from
+ * the debugger.
+ */
+struct stream host_text;
+static bool host_text_nak;
+
+static void stream_out(usbd_device *dev, uint8_t ep)
+{
+	uint8_t buf[STREAM_EP_SIZE];
+	uint16_t len;
+
+	/*
+	 * Reading the packet re-arms the endpoint, so NAK it first if this
+	 * packet may leave less than a packet of room.
+	 */
+	if (stream_free(&host_text) < 2 * STREAM_EP_SIZE) {
+		usbd_ep_nak_set(dev, ep, 1);
+		host_text_nak = true;
+	}
+
+	len = usbd_ep_read_packet(dev, ep, buf, sizeof(buf));
+	stream_write(&host_text, buf, len);
+}
+
 static void hid_set_config(usbd_device *dev, uint16_t wValue)
 {
 	(void)wValue;
 	(void)dev;
 
-	usbd_ep_setup(dev, 0x81, USB_ENDPOINT_ATTR_INTERRUPT, 4, NULL);
+	/* The endpoint and HID requests are set up by usb_hid. */
+	hid_mux_init(&hid_reports);
+	hid_in_busy = false;
+
+	stream_init(&host_text);
+	host_text_nak = false;
+	usbd_ep_setup(dev, STREAM_EP, USB_ENDPOINT_ATTR_BULK, STREAM_EP_SIZE,
+		      stream_out);
 
-	usbd_register_control_callback(
-				dev,
-				USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_INTERFACE,
-				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
-				hid_control_request);
 #ifdef INCLUDE_DFU_INTERFACE
 	usbd_register_control_callback(
 				dev,
@@ -234,13 +585,105 @@ static void hid_set_config(usbd_device *dev, uint16_t wValue)
 				dfu_control_request);
 #endif
 
+	nvic_set_priority(NVIC_SYSTICK_IRQ, IRQ_PRI_SYSTICK);
 	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB_DIV8);
 	/* SysTick interrupt every N clock pulses: set reload to N-1 */
-	systick_set_reload(49999);
+	systick_set_reload(rcc_ahb_frequency / 8 / 1000 * HID_INTERVAL_MS - 1);
 	systick_interrupt_enable();
 	systick_counter_enable();
 }
 
+/* Milliseconds between the starts of two texts. */
+#define TEXT_SPACING_MS 2500
+static char t0[] = "  " KEYMAP_GUI;
+static char t1[] = " cmd\n\n\n";
+static char t2[] = " notepad script.py\n";
+static char t3[] = " \nimport webbrowser\nimport time\nwhile True:\n    webbrowser.open('https://www.youtube.com/watch?v=dQw4w9WgXcQ')\n    time.sleep(2)"
+	"\x12" KEYMAP_CLOSE; /* Ctrl+R, Alt+F4 */
+static char t4[] = "               python script.py\n\n"; // firefox https://www.youtube.com/watch?v=dQw4w9WgXcQ\n";
+
+/* Milliseconds between two reports while typing. */
+#define TYPE_RATE_MS 8
+
+static struct seq texts[] = {
+	{ .text = t0, .start = 1 * TEXT_SPACING_MS, .rate = TYPE_RATE_MS },
+	{ .text = t1, .start = 2 * TEXT_SPACING_MS, .rate = TYPE_RATE_MS },
+	{ .text = t2, .start = 3 * TEXT_SPACING_MS, .rate = TYPE_RATE_MS },
+	{ .text = t3, .start = 4 * TEXT_SPACING_MS, .rate = TYPE_RATE_MS },
+	{ .text = t4, .start = 5 * TEXT_SPACING_MS, .rate = TYPE_RATE_MS },
+};
+
+/*
+ * Texts are typed one at a time, each at its start time or as soon as the
+ * one before it is done.  Not static so progress can be read from the
+ * debugger, more texts may be added at runtime with seq_add().
+ */
+struct seq_sched typist;
+
+/*
+ * Milliseconds since the device was first configured, counted by SysTick.
+ * A later SET_CONFIGURATION does not reset it, so the start times of the
+ * texts and of the typing in progress stay on one clock across a
+ * re-enumeration.
+ */
+static uint32_t now_ms;
+
+/*
+ * Once everything is typed, turn the volume up and park the pointer in the
+ * bottom right corner, one step per tick while the queues have room.
+ */
+#define VOLUME_STEPS	25
+#define PARK_STEPS	20
+static uint8_t volume_steps, park_steps;
+
+static void finish(void)
+{
+	if (texts[ARRAY_LENGTH(texts) - 1].state != SEQ_DONE)
+		return;
+
+	if ((volume_steps < VOLUME_STEPS) &&
+	    hid_consumer_tap(HID_USAGE_VOLUME_UP))
+		volume_steps++;
+	if ((park_steps < PARK_STEPS) && hid_mouse_move(0, 127, 127, 0))
+		park_steps++;
+}
+
+/*
+ * Streamed text is typed in chunks: whenever the previous chunk is done,
+ * the next one is taken from the ring and queued like any other text.
+ */
+#ifndef STREAM_RATE_MS
+#define STREAM_RATE_MS	TYPE_RATE_MS
+#endif
+#define STREAM_CHUNK	64
+static char stream_chunk[STREAM_CHUNK + 1];
+static struct seq stream_seq = {
+	.text = stream_chunk,
+	.rate = STREAM_RATE_MS,
+};
+
+static void stream_pump(void)
+{
+	uint16_t len;
+
+	if ((stream_seq.state == SEQ_WAITING) ||
+	    (stream_seq.state == SEQ_TYPING))
+		return;
+
+	len = stream_read(&host_text, stream_chunk, STREAM_CHUNK);
+	if (host_text_nak &&
+	    (stream_free(&host_text) >= 2 * STREAM_EP_SIZE)) {
+		host_text_nak = false;
+		usbd_ep_nak_set(usbd_dev, STREAM_EP, 0);
+	}
+	if (!len)
+		return;
+
+	stream_chunk[len] = 0;
+	stream_seq.start = now_ms;
+	seq_add(&typist, &stream_seq);
+}
+
 int main(void)
 {
 	rcc_clock_setup_pll(&rcc_hsi_configs[RCC_CLOCK_HSI_48MHZ]);
@@ -262,112 +705,44 @@ int main(void)
 		__asm__("nop");
 	}
 
+	seq_sched_init(&typist, HOST_LAYOUT, hid_submit, hid_format);
+	for (unsigned i = 0; i < ARRAY_LENGTH(texts); i++)
+		seq_add(&typist, &texts[i]);
+
 	usbd_dev = usbd_init(&st_usbfs_v1_usb_driver, &dev_descr, &config, usb_strings, 3, usbd_control_buffer, sizeof(usbd_control_buffer));
+	usb_hid_init(hid, usbd_dev, HID_IFACE, HID_EP, HID_EP_SIZE,
+		     hid_report_descriptor, sizeof(hid_report_descriptor),
+		     hid_in_complete, hid_output_report);
+	usb_hid_use_report_ids(hid, true);
+	usb_hid_set_default_idle(hid, USB_HID_IDLE_RATE_KEYBOARD);
+	usbd_register_config_descriptors(usbd_dev, config_descriptor);
 	usbd_register_set_config_callback(usbd_dev, hid_set_config);
 
+#ifdef HID_LATENCY_TRACE
+	dwt_enable_cycle_counter();
+#endif
+
+	/* From here on everything happens in interrupts. */
+	nvic_set_priority(NVIC_USB_LP_CAN_RX0_IRQ, IRQ_PRI_USB);
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+
 	while (1)
-		usbd_poll(usbd_dev);
+		__asm__("wfi");
 }
 
-void string_formating(char a, uint8_t *buf){
-    if (isdigit(a)) {
-        if (a == '0') {
-            buf[2] = 39;
-        } else {
-            int b = a - '0';
-            buf[2] = 29 + b;
-        }	
-    } else if (isalpha(a)) {
-        if (isupper(a)) {
-            buf[0] = 2;
-            int b = (int)a;
-            buf[2] = b - 61;
-        } else {
-            int b = (int)a;
-            buf[2] = b - 93;
-        }
-    } else if (a == ' '){
-	buf[2] = 44;
-    } else if (a == '='){
-	buf[2] = 46;
-    } else if (a == ':'){
-	buf[0] = 2;
-	buf[2] = 51;
-    } else if (a == '/'){
-	buf[2] = 56;
-    } else if (a == '.'){
-	buf[2] = 55;
-    } else if (a == '?'){
-	buf[0] = 2;
-	buf[2] = 56;
-    } else if (a == '\n'){
-	buf[2] = 88;
-    } else if (a == '@'){
-	buf[0] = 0x08;
-    } else if (a == '#'){
-	buf[0] = 0x01;
-	buf[2] = 21;
-    } else if (a == '&'){
-	buf[0] = 0x04;
-	buf[2] = 61;	
-    } else if (a == '('){
-	buf[0] = 2;
-	buf[2] = 38;
-    } else if (a == ')'){
-	buf[0] = 2;
-	buf[2] = 39;
-    } else if (a == '\''){
-	buf[2] = 52;
-    } else if (a == '!'){
-	buf[0] = 2;
-	buf[2] = 30;
-    }
+void usb_lp_can_rx0_isr(void)
+{
+#ifdef HID_LATENCY_TRACE
+	hid_latency.irq_entry = dwt_read_cycle_counter();
+#endif
+	usbd_poll(usbd_dev);
 }
-static int d = 300;
-static char t0[] = "  @";
-static char t1[] = " cmd\n\n\n";
-static char t2[] = " notepad script.py\n";
-static char t3[] = " \nimport webbrowser\nimport time\nwhile True:\n    webbrowser.open('https://www.youtube.com/watch?v=dQw4w9WgXcQ')\n    time.sleep(2)#&";
-static char t4[] = "               python script.py\n\n"; // firefox https://www.youtube.com/watch?v=dQw4w9WgXcQ\n";
-static int tick = 0;
 
 void sys_tick_handler(void)
 {
-		uint8_t buf[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-
-	if ((tick > d) && (tick < d + 2*sizeof(t0))) {
-		if (tick % 2 == 0){
-			unsigned int t = (tick - d)/2;
-			string_formating(t0[t], (uint8_t*) buf);
-		}
-		usbd_ep_write_packet(usbd_dev, 0x81, buf, 8);
-	}
-	if ((tick > 2*d) && (tick < 2*d + 2*sizeof(t1))) {
-		if (tick % 2 == 0){
-			unsigned int t = (tick - 2*d)/2;
-			string_formating(t1[t], (uint8_t*) buf);
-		}
-		usbd_ep_write_packet(usbd_dev, 0x81, buf, 8);
-	}
-	if ((tick > 3*d) && (tick < 3*d + 2*sizeof(t2))) {
-		if (tick % 2 == 0){
-			unsigned int t = (tick - 3*d)/2;
-			string_formating(t2[t], (uint8_t*) buf);
-		}
-		usbd_ep_write_packet(usbd_dev, 0x81, buf, 8);
-	}
-	if ((tick > 4*d) && (tick < 4*d + 2*sizeof(t3))) {
-		if (tick % 2 == 0){
-			unsigned int t = (tick - 4*d)/2;
-			string_formating(t3[t], (uint8_t*) buf);
-		}
-		usbd_ep_write_packet(usbd_dev, 0x81, buf, 8);
-	}if ((tick > 5*d) && (tick < 5*d + 2*sizeof(t4))) {
-		if (tick % 2 == 0){
-			unsigned int t = (tick - 5*d)/2;
-			string_formating(t4[t], (uint8_t*) buf);
-		}
-		usbd_ep_write_packet(usbd_dev, 0x81, buf, 8);
-	}
-	tick++;
+	now_ms += HID_INTERVAL_MS;
+	usb_hid_idle_tick(hid, HID_INTERVAL_MS);
+	stream_pump();
+	seq_tick(&typist, now_ms);
+	finish();
 }